@@ -20,24 +20,115 @@
  */
 #ifndef _APTERYX_SCHEMA_H_
 #define _APTERYX_SCHEMA_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef struct apteryx_schema_instance apteryx_schema_instance;
 typedef struct apteryx_schema_model apteryx_schema_model;
 typedef struct apteryx_schema_node apteryx_schema_node;
+typedef struct apteryx_schema_handle apteryx_schema_handle;
+typedef struct apteryx_schema_path apteryx_schema_path;
+
+/* List key captured by a compiled path (points into the matched path) */
+typedef struct apteryx_schema_key
+{
+    const char *key;
+    size_t len;
+} apteryx_schema_key;
+
+/* Node flags (as in apteryx_schema_node_flags) */
+#define APTERYX_SCHEMA_FLAG_LEAF    (1 << 0)
+#define APTERYX_SCHEMA_FLAG_READ    (1 << 1)
+#define APTERYX_SCHEMA_FLAG_WRITE   (1 << 2)
+/* No node (or the parent of a root) */
+#define APTERYX_SCHEMA_NO_ID        UINT32_MAX
+
+/* Runtime statistics of an instance */
+#define APTERYX_SCHEMA_STATS_BUCKETS    32
+typedef struct apteryx_schema_stats
+{
+    /* How the instance was loaded (not reset) */
+    uint64_t load_ns;
+    uint32_t load_files;
+    uint32_t load_parsed;
+    bool load_cached;
+    /* Lookups (found or not) and the path segments compared */
+    uint64_t lookups;
+    uint64_t lookup_hits;
+    uint64_t lookup_misses;
+    uint64_t lookup_segments;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    /* Translations (mapped to an enum or passed through) */
+    uint64_t translations;
+    uint64_t translation_hits;
+    uint64_t translation_misses;
+    /* Validations (passed or failed) */
+    uint64_t validations;
+    uint64_t validation_passes;
+    uint64_t validation_failures;
+    /* Sampled latencies - bucket i counts operations taking [2^i, 2^(i+1)) ns */
+    uint64_t lookup_ns[APTERYX_SCHEMA_STATS_BUCKETS];
+    uint64_t translate_ns[APTERYX_SCHEMA_STATS_BUCKETS];
+    uint64_t validate_ns[APTERYX_SCHEMA_STATS_BUCKETS];
+} apteryx_schema_stats;
+
 apteryx_schema_instance* apteryx_schema_load (const char *folders);
+apteryx_schema_instance* apteryx_schema_load_cached (const char *folders, const char *cache);
+apteryx_schema_instance* apteryx_schema_load_lazy (const char *folders);
+/* Lookup cache - only set before the instance is shared or published */
+bool apteryx_schema_cache_enable (apteryx_schema_instance *schema, size_t max_bytes);
+void apteryx_schema_cache_stats (apteryx_schema_instance *schema, uint64_t *hits, uint64_t *misses);
+void apteryx_schema_get_stats (apteryx_schema_instance *schema, apteryx_schema_stats *stats);
+void apteryx_schema_reset_stats (apteryx_schema_instance *schema);
+/* Instances are read only and shared by reference - free drops a reference */
+apteryx_schema_instance* apteryx_schema_ref (apteryx_schema_instance *schema);
 void apteryx_schema_free (apteryx_schema_instance *schema);
+/* Published instance that can be replaced while readers hold the old one */
+apteryx_schema_handle* apteryx_schema_handle_new (apteryx_schema_instance *schema);
+apteryx_schema_instance* apteryx_schema_acquire (apteryx_schema_handle *handle);
+bool apteryx_schema_is_current (apteryx_schema_handle *handle, apteryx_schema_instance *schema);
+void apteryx_schema_publish (apteryx_schema_handle *handle, apteryx_schema_instance *schema);
+bool apteryx_schema_reload (apteryx_schema_handle *handle, const char *folders, const char *cache, bool wait);
+void apteryx_schema_handle_free (apteryx_schema_handle *handle);
+/* Incremental updates of a handle that only parse the files that changed */
+bool apteryx_schema_watch (apteryx_schema_handle *handle, const char *folders, bool notify);
+bool apteryx_schema_update (apteryx_schema_handle *handle);
 void apteryx_schema_dump (FILE *fp, apteryx_schema_instance *schema);
+bool apteryx_schema_dump_full (FILE *fp, apteryx_schema_instance *schema, const char *path, int depth, bool json);
 apteryx_schema_model* apteryx_schema_first_model (apteryx_schema_instance *schema);
 apteryx_schema_model* apteryx_schema_next_model (apteryx_schema_instance *schema, apteryx_schema_model *model);
 const char* apteryx_schema_model_name (apteryx_schema_model *model);
 const char* apteryx_schema_model_organization (apteryx_schema_model *model);
 const char* apteryx_schema_model_version (apteryx_schema_model *model);
 apteryx_schema_node* apteryx_schema_lookup (apteryx_schema_instance *schema, const char *path);
+apteryx_schema_node* apteryx_schema_lookup_child (apteryx_schema_instance *schema, apteryx_schema_node *parent, const char *name);
+/* Path templates with "*" for list keys compiled once and matched without allocating */
+apteryx_schema_path* apteryx_schema_compile (apteryx_schema_instance *schema, const char *path);
+apteryx_schema_node* apteryx_schema_path_node (apteryx_schema_path *compiled);
+int apteryx_schema_path_keys (apteryx_schema_path *compiled);
+apteryx_schema_node* apteryx_schema_match (apteryx_schema_path *compiled, const char *path, apteryx_schema_key *keys);
+void apteryx_schema_path_free (apteryx_schema_path *compiled);
+/* Nodes numbered 0 to count - 1 (roots in name order and then depth first in
+ * schema order) with their flags and parent IDs in arrays indexed by ID - not
+ * for lazy loads */
+uint32_t apteryx_schema_node_count (apteryx_schema_instance *schema);
+uint32_t apteryx_schema_node_id (apteryx_schema_instance *schema, apteryx_schema_node *node);
+apteryx_schema_node* apteryx_schema_node_by_id (apteryx_schema_instance *schema, uint32_t id);
+const uint32_t* apteryx_schema_node_flags (apteryx_schema_instance *schema);
+const uint32_t* apteryx_schema_node_parents (apteryx_schema_instance *schema);
+apteryx_schema_node* apteryx_schema_first_child (apteryx_schema_node *node);
+apteryx_schema_node* apteryx_schema_next_child (apteryx_schema_node *node, apteryx_schema_node *child);
 bool apteryx_schema_is_leaf (apteryx_schema_node *node);
 bool apteryx_schema_is_readable (apteryx_schema_node *node);
 bool apteryx_schema_is_writable (apteryx_schema_node *node);
+bool apteryx_schema_validate (apteryx_schema_node *node, const char *value);
 char* apteryx_schema_name (apteryx_schema_node *node);
+const char* apteryx_schema_name_const (apteryx_schema_node *node);
 char* apteryx_schema_translate_to (apteryx_schema_node *node, char *value);
 char* apteryx_schema_translate_from (apteryx_schema_node *node, char *value);
+const char* apteryx_schema_translate_to_const (apteryx_schema_node *node, const char *value);
+const char* apteryx_schema_translate_from_const (apteryx_schema_node *node, const char *value);
 
 #endif /* _APTERYX_SCHEMA_H_ */
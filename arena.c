@@ -0,0 +1,990 @@
+/**
+ * @file arena.c
+ * Packed storage of database schema trees for Apteryx.
+ *
+ * Copyright 2019, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "internal.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NODE_SIZE   sizeof (struct apteryx_schema_node)
+
+/* Arena saved to a file along with the sources it was built from */
+#define ARENA_FILE_MAGIC    0x43535041 /* "APSC" */
+struct schema_arena_file
+{
+    uint32_t magic;
+    uint32_t version;
+    /* Folders string the sources were listed from */
+    uint32_t folders;
+    /* Array of struct schema_arena_source */
+    uint32_t sources;
+    uint32_t n_sources;
+    /* Arena stored in the file */
+    uint32_t arena;
+    uint32_t size;
+};
+struct schema_arena_source
+{
+    uint32_t path;
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t mtime_nsec;
+};
+
+/* Marks a pattern that failed to compile */
+static const char pattern_invalid;
+#define PATTERN_INVALID     ((GRegex *) &pattern_invalid)
+
+static struct schema_arena *
+arena_alloc (void)
+{
+    struct schema_arena *arena = calloc (1, sizeof (struct schema_arena));
+
+    if (arena)
+    {
+        arena->refcount = 1;
+        arena->first_id = UINT64_MAX;
+    }
+    return arena;
+}
+
+/* Point the data back at the arena so a node can find it without a lookup */
+static void
+arena_register (struct schema_arena *arena)
+{
+    ARENA_HEADER (arena)->owner = (uintptr_t) arena;
+}
+
+/* Number of index slots for this many children (at most half full) */
+static uint32_t
+index_size (uint32_t count)
+{
+    uint32_t size = 2;
+    while (size < count * 2)
+        size <<= 1;
+    return size;
+}
+
+/* Add a string to the string table only once */
+static uint32_t
+arena_string (GHashTable *strings, GString *table, uint32_t base, const char *str)
+{
+    gpointer offset;
+
+    if (!str)
+    {
+        return 0;
+    }
+    if (!g_hash_table_lookup_extended (strings, str, NULL, &offset))
+    {
+        offset = GUINT_TO_POINTER (base + table->len);
+        g_string_append_len (table, str, strlen (str) + 1);
+        g_hash_table_insert (strings, (gpointer) str, offset);
+    }
+    return GPOINTER_TO_UINT (offset);
+}
+
+/* Add a child to the index of its parent - the first of any duplicates wins */
+static void
+arena_index (uint32_t *slots, uint32_t size, GPtrArray *order, uint32_t nodes,
+             uint32_t offset, const char *name)
+{
+    uint32_t mask = size - 1;
+    uint32_t i;
+
+    for (i = name_hash (name, strlen (name)) & mask; slots[i]; i = (i + 1) & mask)
+    {
+        struct schema_node *n = order->pdata[(slots[i] - nodes) / NODE_SIZE];
+        if (match_name (n->name, name, strlen (name)))
+            return;
+    }
+    slots[i] = offset;
+}
+
+/* Size the enum map of a node (0 if it has no enum children) */
+static uint32_t
+enums_size (struct schema_node *n, struct schema_arena_enums *enums)
+{
+    int64_t min = INT32_MAX, max = INT32_MIN;
+    bool integers = true;
+    uint32_t count = 0;
+    int32_t v;
+
+    for (struct schema_node *c = n->children; c; c = c->next)
+    {
+        if (!(c->flags & NODE_FLAGS_ENUM))
+            continue;
+        count++;
+        if (integers && c->value && enum_integer (c->value, &v))
+        {
+            min = MIN (min, v);
+            max = MAX (max, v);
+        }
+        else
+        {
+            integers = false;
+        }
+    }
+    if (!count)
+    {
+        return 0;
+    }
+    enums->size = index_size (count);
+    enums->min = 0;
+    enums->range = 0;
+    if (integers && max - min < MAX (16, count * 4))
+    {
+        enums->min = min;
+        enums->range = max - min + 1;
+    }
+    return sizeof (struct schema_arena_enums) + (enums->size * 2 + enums->range) * sizeof (uint32_t);
+}
+
+/* Add an enum child to the maps of its parent - the first of any duplicates wins */
+static void
+arena_enum (struct schema_arena_enums *enums, GPtrArray *order, uint32_t nodes,
+            uint32_t offset, struct schema_node *c)
+{
+    uint32_t mask = enums->size - 1;
+    uint32_t *slots;
+    uint32_t i;
+    int32_t v;
+
+    slots = ENUMS_NAMES (enums);
+    for (i = enum_hash (c->name) & mask; slots[i]; i = (i + 1) & mask)
+    {
+        struct schema_node *n = order->pdata[(slots[i] - nodes) / NODE_SIZE];
+        if (strcmp (n->name, c->name) == 0)
+            break;
+    }
+    if (!slots[i])
+        slots[i] = offset;
+
+    if (!c->value)
+    {
+        return;
+    }
+    slots = ENUMS_VALUES (enums);
+    for (i = enum_hash (c->value) & mask; slots[i]; i = (i + 1) & mask)
+    {
+        struct schema_node *n = order->pdata[(slots[i] - nodes) / NODE_SIZE];
+        if (strcmp (n->value, c->value) == 0)
+            break;
+    }
+    if (!slots[i])
+        slots[i] = offset;
+
+    if (enums->range && enum_integer (c->value, &v) && !ENUMS_INTS (enums)[v - enums->min])
+    {
+        ENUMS_INTS (enums)[v - enums->min] = offset;
+    }
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+    struct apteryx_schema_node *x = *(struct apteryx_schema_node **) a;
+    struct apteryx_schema_node *y = *(struct apteryx_schema_node **) b;
+    return strcmp (NODE_ARENA (x) + x->name, NODE_ARENA (y) + y->name);
+}
+
+/* Number a node and then its children depth first in schema order */
+static uint32_t
+arena_number_node (uint32_t *ids, struct apteryx_schema_node *node, uint32_t id)
+{
+    ids[NODE_INDEX (node)] = id++;
+    for (uint32_t i = 0; i < node->n_children; i++)
+    {
+        struct apteryx_schema_node *child = NODE_CHILD (node, i);
+        if (!(child->flags & NODE_FLAGS_ENUM))
+            id = arena_number_node (ids, child, id);
+    }
+    return id;
+}
+
+/* Number the nodes from the roots in name order (enum values are not numbered) */
+static void
+arena_number (struct schema_arena *arena)
+{
+    struct schema_arena_header *header = ARENA_HEADER (arena);
+    uint32_t *ids = (uint32_t *) (arena->data + header->ids);
+    GPtrArray *roots = g_ptr_array_new ();
+
+    memset (ids, 0xff, header->n_nodes * sizeof (uint32_t));
+    for (uint32_t i = 0; i < header->n_roots; i++)
+        g_ptr_array_add (roots, ARENA_ROOT (arena, i));
+    g_ptr_array_sort (roots, compare_names);
+    for (guint i = 0; i < roots->len; i++)
+        header->n_ids = arena_number_node (ids, roots->pdata[i], header->n_ids);
+    g_ptr_array_free (roots, true);
+}
+
+/* Pack a list of trees and models into a single block of memory */
+struct schema_arena *
+arena_create (GList *roots, GList *models)
+{
+    struct schema_arena *arena;
+    struct schema_arena_header *header;
+    GPtrArray *order = g_ptr_array_new ();
+    GHashTable *strings = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *table = g_string_new (NULL);
+    struct schema_arena_model *model;
+    struct schema_arena_enums enums_map;
+    uint32_t nodes, index, enums, base;
+    uint32_t next, i;
+    GList *iter;
+
+    /* Order the nodes breadth first so that siblings are contiguous */
+    for (iter = roots; iter; iter = g_list_next (iter))
+    {
+        g_ptr_array_add (order, iter->data);
+    }
+    for (i = 0; i < order->len; i++)
+    {
+        struct schema_node *n = order->pdata[i];
+        for (struct schema_node *c = n->children; c; c = c->next)
+        {
+            g_ptr_array_add (order, c);
+        }
+    }
+
+    /* Header, then nodes, then indexes, then enum maps, then IDs, then models, then strings */
+    nodes = sizeof (struct schema_arena_header);
+    index = nodes + order->len * NODE_SIZE;
+    base = index;
+    for (i = 0; i < order->len; i++)
+    {
+        struct schema_node *n = order->pdata[i];
+        uint32_t named = 0;
+        for (struct schema_node *c = n->children; c; c = c->next)
+        {
+            if (c->name[0] != '*')
+                named++;
+        }
+        if (named)
+            base += index_size (named) * sizeof (uint32_t);
+    }
+    enums = base;
+    for (i = 0; i < order->len; i++)
+    {
+        base += enums_size (order->pdata[i], &enums_map);
+    }
+    base += order->len * sizeof (uint32_t);
+    base += g_list_length (models) * sizeof (struct schema_arena_model);
+    for (i = 0; i < order->len; i++)
+    {
+        struct schema_node *n = order->pdata[i];
+        arena_string (strings, table, base, n->name);
+        arena_string (strings, table, base, n->description);
+        arena_string (strings, table, base, n->defvalue);
+        arena_string (strings, table, base, n->value);
+        arena_string (strings, table, base, n->pattern);
+    }
+    for (iter = models; iter; iter = g_list_next (iter))
+    {
+        struct apteryx_schema_model *m = (struct apteryx_schema_model *) iter->data;
+        arena_string (strings, table, base, m->name);
+        arena_string (strings, table, base, m->organization);
+        arena_string (strings, table, base, m->version);
+    }
+
+    arena = arena_alloc ();
+    if (arena)
+    {
+        arena->size = base + table->len;
+        arena->data = calloc (1, arena->size);
+    }
+    if (!arena || !arena->data || arena->size > UINT32_MAX)
+    {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        if (arena)
+            free (arena->data);
+        free (arena);
+        arena = NULL;
+        goto exit;
+    }
+    header = ARENA_HEADER (arena);
+    header->magic = ARENA_MAGIC;
+    header->version = ARENA_VERSION;
+    header->size = arena->size;
+    header->nodes = nodes;
+    header->n_nodes = order->len;
+    header->n_roots = g_list_length (roots);
+    header->models = base - g_list_length (models) * sizeof (struct schema_arena_model);
+    header->n_models = g_list_length (models);
+    header->ids = header->models - order->len * sizeof (uint32_t);
+    memcpy (arena->data + base, table->str, table->len);
+    arena_register (arena);
+
+    /* Fill in the models */
+    model = (struct schema_arena_model *) (arena->data + header->models);
+    for (iter = models; iter; iter = g_list_next (iter), model++)
+    {
+        struct apteryx_schema_model *m = (struct apteryx_schema_model *) iter->data;
+        model->name = arena_string (strings, table, base, m->name);
+        model->organization = arena_string (strings, table, base, m->organization);
+        model->version = arena_string (strings, table, base, m->version);
+    }
+
+    /* Fill in the nodes - children follow in the same order they were queued */
+    next = header->n_roots;
+    for (i = 0; i < order->len; i++)
+    {
+        struct schema_node *n = order->pdata[i];
+        struct apteryx_schema_node *node;
+        struct schema_arena_enums *map;
+        uint32_t *slots = NULL;
+        uint32_t named = 0;
+        uint32_t size, child;
+
+        node = (struct apteryx_schema_node *) (arena->data + nodes + i * NODE_SIZE);
+        node->self = nodes + i * NODE_SIZE;
+        node->flags = n->flags;
+        node->name = arena_string (strings, table, base, n->name);
+        node->description = arena_string (strings, table, base, n->description);
+        node->defvalue = arena_string (strings, table, base, n->defvalue);
+        node->value = arena_string (strings, table, base, n->value);
+        node->pattern = arena_string (strings, table, base, n->pattern);
+        node->hash = name_hash (n->name, strlen (n->name));
+        for (struct schema_node *c = n->children; c; c = c->next)
+        {
+            node->n_children++;
+        }
+        if (!node->n_children)
+        {
+            continue;
+        }
+        node->children = nodes + next * NODE_SIZE;
+
+        for (struct schema_node *c = n->children; c; c = c->next)
+        {
+            if (c->name[0] != '*')
+                named++;
+        }
+        if (named)
+        {
+            node->index = index;
+            node->index_size = index_size (named);
+            slots = (uint32_t *) (arena->data + index);
+            index += node->index_size * sizeof (uint32_t);
+        }
+        for (struct schema_node *c = n->children; c; c = c->next, next++)
+        {
+            uint32_t offset = nodes + next * NODE_SIZE;
+
+            ((struct apteryx_schema_node *) (arena->data + offset))->parent = node->self;
+            if (c->name[0] == '*')
+            {
+                if (!node->wildcard)
+                    node->wildcard = offset;
+            }
+            else
+            {
+                arena_index (slots, node->index_size, order, nodes, offset, c->name);
+            }
+        }
+
+        /* Map enum names and values */
+        size = enums_size (n, &enums_map);
+        if (size)
+        {
+            map = (struct schema_arena_enums *) (arena->data + enums);
+            *map = enums_map;
+            node->enums = enums;
+            enums += size;
+            child = node->children;
+            for (struct schema_node *c = n->children; c; c = c->next, child += NODE_SIZE)
+            {
+                if (c->flags & NODE_FLAGS_ENUM)
+                    arena_enum (map, order, nodes, child, c);
+            }
+        }
+    }
+    arena_number (arena);
+
+exit:
+    g_string_free (table, true);
+    g_hash_table_destroy (strings);
+    g_ptr_array_free (order, true);
+    return arena;
+}
+
+/* Save the arena to a file along with the state of the files it was built from */
+bool
+arena_save (struct schema_arena *arena, const char *filename, const char *folders,
+            GList *files, GArray *stats)
+{
+    struct schema_arena_file header = {};
+    struct schema_arena_source *sources;
+    GString *table = g_string_new (NULL);
+    GString *data;
+    GError *error = NULL;
+    bool ret;
+    uint32_t i;
+    GList *iter;
+
+    /* Header, then sources, then strings, then the arena */
+    header.magic = ARENA_FILE_MAGIC;
+    header.version = ARENA_VERSION;
+    header.sources = sizeof (header);
+    header.n_sources = g_list_length (files);
+    sources = calloc (header.n_sources, sizeof (struct schema_arena_source));
+    header.folders = header.sources + header.n_sources * sizeof (struct schema_arena_source);
+    g_string_append_len (table, folders, strlen (folders) + 1);
+    for (iter = files, i = 0; iter; iter = g_list_next (iter), i++)
+    {
+        struct stat *st = &g_array_index (stats, struct stat, i);
+        sources[i].path = header.folders + table->len;
+        sources[i].size = st->st_size;
+        sources[i].mtime = st->st_mtim.tv_sec;
+        sources[i].mtime_nsec = st->st_mtim.tv_nsec;
+        g_string_append_len (table, (char *) iter->data, strlen ((char *) iter->data) + 1);
+    }
+    header.arena = (header.folders + table->len + 7) & ~7;
+    header.size = header.arena + arena->size;
+
+    data = g_string_sized_new (header.size);
+    g_string_append_len (data, (char *) &header, sizeof (header));
+    g_string_append_len (data, (char *) sources, header.n_sources * sizeof (struct schema_arena_source));
+    g_string_append_len (data, table->str, table->len);
+    g_string_set_size (data, header.arena);
+    memset (data->str + header.folders + table->len, 0, header.arena - header.folders - table->len);
+    g_string_append_len (data, arena->data, arena->size);
+    ((struct schema_arena_header *) (data->str + header.arena))->owner = 0;
+
+    /* Replaced atomically so concurrent readers see the old or new file */
+    ret = g_file_set_contents (filename, data->str, data->len, &error);
+    if (!ret)
+    {
+        ERROR ("APTERYX_SCHEMA: Failed to save \"%s\": %s\n", filename, error->message);
+        g_error_free (error);
+    }
+    g_string_free (data, true);
+    g_string_free (table, true);
+    free (sources);
+    return ret;
+}
+
+/* Return the string at an offset if it is terminated within the file */
+static const char *
+file_string (const char *map, size_t size, uint32_t offset)
+{
+    if (offset >= size || !memchr (map + offset, '\0', size - offset))
+        return NULL;
+    return map + offset;
+}
+
+/* Offset of a node in the node array of an arena being checked */
+static bool
+check_node (struct schema_arena_header *header, uint32_t offset)
+{
+    return offset >= header->nodes &&
+           offset < header->nodes + (uint64_t) header->n_nodes * NODE_SIZE &&
+           (offset - header->nodes) % NODE_SIZE == 0;
+}
+
+/* Offset of a string (0 for none) - strings follow the models to the end of
+ * the arena, which is checked to end with a terminator */
+static bool
+check_string (struct schema_arena_header *header, uint32_t offset)
+{
+    return !offset ||
+           (offset >= header->models + header->n_models * sizeof (struct schema_arena_model) &&
+            offset < header->size);
+}
+
+/* Array of count slots each holding 0 or a node offset - an open addressed
+ * table also needs an empty slot to end every probe */
+static bool
+check_slots (struct schema_arena_header *header, const uint32_t *slots, uint64_t count, bool probed)
+{
+    bool empty = false;
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (!slots[i])
+            empty = true;
+        else if (!check_node (header, slots[i]))
+            return false;
+    }
+    return empty || !probed;
+}
+
+/* Everything a load trusts in an arena read from a file is within it - the
+ * node, ID and model arrays, every offset a node holds, and the IDs number
+ * each node at most once */
+static bool
+arena_check (const char *data)
+{
+    struct schema_arena_header *header = (struct schema_arena_header *) data;
+    struct schema_arena_model *model;
+    uint32_t strings, *ids;
+    uint8_t *numbered;
+    bool ok = true;
+
+    /* Arrays in the order they are packed and strings to the end */
+    strings = header->models + header->n_models * sizeof (struct schema_arena_model);
+    if (header->nodes < sizeof (struct schema_arena_header) || header->nodes % 4 ||
+        header->ids % 4 || header->models % 4 || header->n_roots > header->n_nodes ||
+        header->n_ids > header->n_nodes ||
+        header->nodes + (uint64_t) header->n_nodes * NODE_SIZE > header->ids ||
+        header->ids + (uint64_t) header->n_nodes * sizeof (uint32_t) > header->models ||
+        header->models + (uint64_t) header->n_models * sizeof (struct schema_arena_model) > header->size ||
+        (strings < header->size && data[header->size - 1] != '\0'))
+    {
+        return false;
+    }
+
+    model = (struct schema_arena_model *) (data + header->models);
+    for (uint32_t i = 0; i < header->n_models; i++, model++)
+    {
+        if (!check_string (header, model->name) || !check_string (header, model->organization) ||
+            !check_string (header, model->version))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header->n_nodes; i++)
+    {
+        struct apteryx_schema_node *node = (struct apteryx_schema_node *) (data + header->nodes + i * NODE_SIZE);
+        struct schema_arena_enums *enums;
+
+        /* Children follow their parent so the tree has no cycles */
+        if (node->self != header->nodes + i * NODE_SIZE || !node->name ||
+            !check_string (header, node->name) || !check_string (header, node->description) ||
+            !check_string (header, node->defvalue) || !check_string (header, node->value) ||
+            !check_string (header, node->pattern) ||
+            (node->parent && !check_node (header, node->parent)) ||
+            (node->wildcard && !check_node (header, node->wildcard)))
+        {
+            return false;
+        }
+        if (node->n_children &&
+            (node->children <= node->self || !check_node (header, node->children) ||
+             node->n_children > header->n_nodes - (node->children - header->nodes) / NODE_SIZE))
+        {
+            return false;
+        }
+        if ((node->index || node->index_size) &&
+            (!node->index || node->index % 4 || node->index_size & (node->index_size - 1) ||
+             node->index + (uint64_t) node->index_size * sizeof (uint32_t) > header->ids ||
+             !check_slots (header, (uint32_t *) (data + node->index), node->index_size, true)))
+        {
+            return false;
+        }
+        if (!node->enums)
+        {
+            continue;
+        }
+        enums = (struct schema_arena_enums *) (data + node->enums);
+        if (node->enums % 4 || node->enums + (uint64_t) sizeof (*enums) > header->ids ||
+            !enums->size || enums->size & (enums->size - 1) ||
+            node->enums + sizeof (*enums) + ((uint64_t) enums->size * 2 + enums->range) * sizeof (uint32_t) > header->ids ||
+            !check_slots (header, ENUMS_NAMES (enums), enums->size, true) ||
+            !check_slots (header, ENUMS_VALUES (enums), enums->size, true) ||
+            !check_slots (header, ENUMS_INTS (enums), enums->range, false))
+        {
+            return false;
+        }
+    }
+
+    /* IDs from 0 to n_ids - 1, each used once, for every node but enum values */
+    ids = (uint32_t *) (data + header->ids);
+    numbered = calloc (MAX (header->n_ids, 1), 1);
+    for (uint32_t i = 0; ok && i < header->n_nodes; i++)
+    {
+        struct apteryx_schema_node *node = (struct apteryx_schema_node *) (data + header->nodes + i * NODE_SIZE);
+        if (node->flags & NODE_FLAGS_ENUM)
+            ok = ids[i] == UINT32_MAX;
+        else
+            ok = ids[i] < header->n_ids && !numbered[ids[i]]++;
+    }
+    for (uint32_t i = 0; ok && i < header->n_ids; i++)
+        ok = numbered[i];
+    free (numbered);
+    return ok;
+}
+
+/* Map a saved arena read only if it is still valid for the files */
+struct schema_arena *
+arena_open (const char *filename, const char *folders, GList *files, GArray *stats)
+{
+    struct schema_arena_file *header;
+    struct schema_arena_source *sources;
+    struct schema_arena_header *aheader;
+    struct schema_arena *arena = NULL;
+    struct stat st;
+    char *map;
+    uint32_t i;
+    GList *iter;
+    int fd;
+
+    fd = open (filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat (fd, &st) != 0 || st.st_size < sizeof (struct schema_arena_file))
+    {
+        close (fd);
+        return NULL;
+    }
+    /* Private so that only the page holding the owner is copied */
+    map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    /* Check the file is intact and built by this version */
+    header = (struct schema_arena_file *) map;
+    if (header->magic != ARENA_FILE_MAGIC || header->version != ARENA_VERSION ||
+        header->size != st.st_size || header->arena > header->size ||
+        header->size - header->arena < sizeof (struct schema_arena_header) ||
+        header->sources + (uint64_t) header->n_sources * sizeof (struct schema_arena_source) > header->arena ||
+        g_strcmp0 (file_string (map, header->arena, header->folders), folders) != 0)
+    {
+        DEBUG ("APTERYX_SCHEMA: Ignoring invalid \"%s\"\n", filename);
+        goto invalid;
+    }
+    aheader = (struct schema_arena_header *) (map + header->arena);
+    if (aheader->magic != ARENA_MAGIC || aheader->version != ARENA_VERSION ||
+        aheader->size != header->size - header->arena || !arena_check (map + header->arena))
+    {
+        DEBUG ("APTERYX_SCHEMA: Ignoring invalid \"%s\"\n", filename);
+        goto invalid;
+    }
+
+    /* Check the source files have not changed */
+    sources = (struct schema_arena_source *) (map + header->sources);
+    if (header->n_sources != g_list_length (files))
+    {
+        DEBUG ("APTERYX_SCHEMA: \"%s\" is stale\n", filename);
+        goto invalid;
+    }
+    for (iter = files, i = 0; iter; iter = g_list_next (iter), i++)
+    {
+        struct stat *sst = &g_array_index (stats, struct stat, i);
+        if (g_strcmp0 (file_string (map, header->arena, sources[i].path), (char *) iter->data) != 0 ||
+            sources[i].size != (uint32_t) sst->st_size ||
+            sources[i].mtime != (uint32_t) sst->st_mtim.tv_sec ||
+            sources[i].mtime_nsec != (uint32_t) sst->st_mtim.tv_nsec)
+        {
+            DEBUG ("APTERYX_SCHEMA: \"%s\" is stale\n", filename);
+            goto invalid;
+        }
+    }
+
+    arena = arena_alloc ();
+    if (!arena)
+    {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        goto invalid;
+    }
+    arena->data = map + header->arena;
+    arena->size = aheader->size;
+    arena->map = map;
+    arena->map_size = st.st_size;
+    arena_register (arena);
+    mprotect (map, st.st_size, PROT_READ);
+    return arena;
+
+invalid:
+    munmap (map, st.st_size);
+    return NULL;
+}
+
+/* Compiled pattern of a node - compiled on first use and kept until the
+ * arena is destroyed as the arena itself may be read only. Published with
+ * compare and exchange so that racing threads keep the first one. */
+GRegex *
+arena_pattern (struct apteryx_schema_node *node)
+{
+    struct schema_arena *arena = ARENA_OWNER (NODE_ARENA (node));
+    GRegex **patterns;
+    GRegex *regex;
+    uint32_t i;
+
+    if (!arena)
+    {
+        return NULL;
+    }
+    patterns = (GRegex **) g_atomic_pointer_get (&arena->patterns);
+    if (!patterns)
+    {
+        patterns = calloc (ARENA_HEADER (arena)->n_nodes, sizeof (GRegex *));
+        if (!patterns)
+        {
+            return NULL;
+        }
+        if (!g_atomic_pointer_compare_and_exchange (&arena->patterns, NULL, patterns))
+        {
+            free (patterns);
+            patterns = (GRegex **) g_atomic_pointer_get (&arena->patterns);
+        }
+    }
+    i = (node->self - ARENA_HEADER (arena)->nodes) / NODE_SIZE;
+    regex = (GRegex *) g_atomic_pointer_get (&patterns[i]);
+    if (!regex)
+    {
+        GError *error = NULL;
+        regex = g_regex_new (NODE_STR (node, pattern), G_REGEX_OPTIMIZE, 0, &error);
+        if (!regex)
+        {
+            ERROR ("APTERYX_SCHEMA: Invalid pattern \"%s\" (%s)\n",
+                   NODE_STR (node, pattern), error->message);
+            g_error_free (error);
+            regex = PATTERN_INVALID;
+        }
+        if (!g_atomic_pointer_compare_and_exchange (&patterns[i], NULL, regex))
+        {
+            if (regex != PATTERN_INVALID)
+                g_regex_unref (regex);
+            regex = (GRegex *) g_atomic_pointer_get (&patterns[i]);
+        }
+    }
+    return regex == PATTERN_INVALID ? NULL : regex;
+}
+
+/* Statistics shard that this thread adds to */
+apteryx_schema_stats *
+stats_shard (struct schema_stats *stats)
+{
+    static gint next_shard = 0;
+    static __thread int shard = -1;
+
+    if (shard < 0)
+        shard = g_atomic_int_add (&next_shard, 1) % STATS_SHARDS;
+    return &stats->shards[shard].stats;
+}
+
+/* Aligned so that each shard has its own cache lines */
+struct schema_stats *
+stats_new (void)
+{
+    void *stats;
+
+    if (posix_memalign (&stats, __alignof__ (struct schema_stats), sizeof (struct schema_stats)) != 0)
+        return NULL;
+    memset (stats, 0, sizeof (struct schema_stats));
+    ((struct schema_stats *) stats)->refcount = 1;
+    return (struct schema_stats *) stats;
+}
+
+struct schema_stats *
+stats_ref (struct schema_stats *stats)
+{
+    g_atomic_int_inc (&stats->refcount);
+    return stats;
+}
+
+void
+stats_unref (struct schema_stats *stats)
+{
+    if (stats && g_atomic_int_dec_and_test (&stats->refcount))
+    {
+        if (stats->shared)
+            g_hash_table_destroy (stats->shared);
+        free (stats);
+    }
+}
+
+/* Statistics of the instance this thread last looked up in (referenced
+ * until the thread moves on to another instance or exits) */
+static GPrivate current_key = G_PRIVATE_INIT ((GDestroyNotify) stats_unref);
+static __thread struct schema_stats *current;
+
+void
+stats_use (struct schema_stats *stats)
+{
+    if (current != stats)
+    {
+        current = stats_ref (stats);
+        g_private_replace (&current_key, stats);
+    }
+}
+
+/* Statistics that a node counts in - nodes of an arena shared by instances
+ * can not tell which one they came from, so they count in the instance this
+ * thread last looked up in if it has the arena, or else in the first instance
+ * the arena was added to */
+apteryx_schema_stats *
+arena_stats (struct apteryx_schema_node *node)
+{
+    struct schema_arena *arena = ARENA_OWNER (NODE_ARENA (node));
+    struct schema_stats *stats = current;
+
+    if (!arena)
+    {
+        return NULL;
+    }
+    if (!stats || (stats != arena->stats &&
+                   !(stats->shared && g_hash_table_contains (stats->shared, arena))))
+    {
+        stats = arena->stats;
+    }
+    return stats ? stats_shard (stats) : NULL;
+}
+
+struct schema_arena *
+arena_ref (struct schema_arena *arena)
+{
+    g_atomic_int_inc (&arena->refcount);
+    return arena;
+}
+
+void
+arena_destroy (struct schema_arena *arena)
+{
+    /* Arenas of single roots can be shared by instances */
+    if (!g_atomic_int_dec_and_test (&arena->refcount))
+    {
+        return;
+    }
+    if (arena->patterns)
+    {
+        for (uint32_t i = 0; i < ARENA_HEADER (arena)->n_nodes; i++)
+        {
+            if (arena->patterns[i] && arena->patterns[i] != PATTERN_INVALID)
+                g_regex_unref (arena->patterns[i]);
+        }
+        free (arena->patterns);
+    }
+    if (arena->map)
+        munmap (arena->map, arena->map_size);
+    else
+        free (arena->data);
+    stats_unref (arena->stats);
+    free (arena);
+}
+
+/* Must match the hash in headers generated by xml2c */
+uint32_t
+enum_phash_hash (uint32_t seed, const char *str)
+{
+    uint32_t h = 2166136261u ^ seed;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+}
+
+static gint
+compare_buckets (gconstpointer a, gconstpointer b)
+{
+    return (gint) (*(GPtrArray **) b)->len - (gint) (*(GPtrArray **) a)->len;
+}
+
+/* Place the largest buckets first while there is most room (duplicate keys keep the
+ * first and NULL keys are left out) */
+static bool
+phash_place (struct enum_phash *hash, GPtrArray *keys)
+{
+    GPtrArray *buckets = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+    uint32_t slot[keys->len + 1];
+    bool placed = true;
+
+    /* Key indexes in each bucket followed by the bucket number */
+    for (uint32_t b = 0; b < hash->n_buckets; b++)
+        g_ptr_array_add (buckets, g_ptr_array_new ());
+    for (guint i = 0; i < keys->len; i++)
+    {
+        GPtrArray *bucket;
+        bool duplicate = false;
+
+        if (!keys->pdata[i])
+            continue;
+        bucket = buckets->pdata[enum_phash_hash (0, keys->pdata[i]) & (hash->n_buckets - 1)];
+        for (guint j = 0; j < bucket->len && !duplicate; j++)
+            duplicate = strcmp (keys->pdata[GPOINTER_TO_UINT (bucket->pdata[j])], keys->pdata[i]) == 0;
+        if (!duplicate)
+            g_ptr_array_add (bucket, GUINT_TO_POINTER (i));
+    }
+    for (uint32_t b = 0; b < hash->n_buckets; b++)
+        g_ptr_array_add (buckets->pdata[b], GUINT_TO_POINTER (b));
+    g_ptr_array_sort (buckets, compare_buckets);
+
+    for (uint32_t b = 0; b < hash->n_buckets; b++)
+    {
+        GPtrArray *bucket = buckets->pdata[b];
+        guint n = bucket->len - 1;
+        uint32_t seed;
+        guint i, j;
+
+        if (n == 0)
+            break;
+        for (seed = 1; seed <= UINT16_MAX; seed++)
+        {
+            for (i = 0; i < n; i++)
+            {
+                slot[i] = enum_phash_hash (seed, keys->pdata[GPOINTER_TO_UINT (bucket->pdata[i])]) & (hash->size - 1);
+                for (j = 0; j < i && slot[j] != slot[i]; j++);
+                if (hash->slots[slot[i]] || j < i)
+                    break;
+            }
+            if (i == n)
+                break;
+        }
+        if (seed > UINT16_MAX)
+        {
+            placed = false;
+            break;
+        }
+        hash->seeds[GPOINTER_TO_UINT (bucket->pdata[n])] = seed;
+        for (i = 0; i < n; i++)
+            hash->slots[slot[i]] = GPOINTER_TO_UINT (bucket->pdata[i]) + 1;
+    }
+    g_ptr_array_free (buckets, true);
+    return placed;
+}
+
+struct enum_phash
+enum_phash_build (GPtrArray *keys)
+{
+    struct enum_phash hash = { 0 };
+
+    hash.n_buckets = 1;
+    while (hash.n_buckets * 4 < keys->len)
+        hash.n_buckets <<= 1;
+    hash.size = 1;
+    while (hash.size < keys->len)
+        hash.size <<= 1;
+    for (;; hash.size <<= 1)
+    {
+        hash.seeds = g_new0 (uint16_t, hash.n_buckets);
+        hash.slots = g_new0 (uint16_t, hash.size);
+        if (phash_place (&hash, keys))
+            return hash;
+        g_free (hash.seeds);
+        g_free (hash.slots);
+    }
+}
+
+void
+enum_phash_free (struct enum_phash *hash)
+{
+    g_free (hash->seeds);
+    g_free (hash->slots);
+}
@@ -0,0 +1,662 @@
+/**
+ * @file bench.c
+ * Benchmarks for the Apteryx Schema library using generated schemas
+ *
+ * Copyright 2019, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <glib.h>
+#ifdef HAVE_LUA
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#endif
+#include <apteryx.h>
+#include "apteryx-schema.h"
+
+/* Shape of the generated schema */
+static int depth = 3;
+static int fanout = 8;
+static int lists = 2;
+static int enums = 4;
+static int files = 8;
+/* Timed operations per benchmark */
+static int iterations = 100000;
+/* Most lookup threads (0 for one per processor) */
+static int threads = 0;
+static gboolean no_lua = false;
+
+static GOptionEntry options[] = {
+    { "depth", 'd', 0, G_OPTION_ARG_INT, &depth, "Levels of containers below each module root (3)", "N" },
+    { "fanout", 'f', 0, G_OPTION_ARG_INT, &fanout, "Children of each container and list entry (8)", "N" },
+    { "lists", 'l', 0, G_OPTION_ARG_INT, &lists, "Lists below each module root (2)", "N" },
+    { "enums", 'e', 0, G_OPTION_ARG_INT, &enums, "Values of every other leaf (4, 0 for none)", "N" },
+    { "files", 'F', 0, G_OPTION_ARG_INT, &files, "Schema files with one module each (8)", "N" },
+    { "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Timed operations per benchmark (100000)", "N" },
+    { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Most threads doing lookups at once (0 for one per processor)", "N" },
+    { "no-lua", 0, 0, G_OPTION_ARG_NONE, &no_lua, "Skip the Lua binding benchmarks", NULL },
+    { NULL }
+};
+
+/* Generated leaf */
+struct leaf
+{
+    /* Path with list entries keyed "entry" */
+    char *path;
+    /* Valid value as stored and as named in the schema (enums only) */
+    char *value;
+    char *name;
+    /* Schema node once loaded */
+    apteryx_schema_node *node;
+#ifdef HAVE_LUA
+    /* Reference to the Lua table of the parent node */
+    int parent;
+#endif
+};
+static GPtrArray *leaves = NULL;
+static GPtrArray *enum_leaves = NULL;
+static GPtrArray *pattern_leaves = NULL;
+
+static inline uint64_t
+get_time_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static long
+peak_rss_kb (void)
+{
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Time and peak RSS of one load */
+struct load_result
+{
+    bool success;
+    uint64_t time;
+    long rss_kb;
+};
+typedef bool (*load_fn) (gpointer data);
+
+/* Reset the peak RSS of this process to its current RSS (Linux only) - after
+ * handing back free heap so that reusing it counts towards the new peak */
+static void
+reset_peak_rss (void)
+{
+    FILE *fp;
+
+#ifdef __GLIBC__
+    malloc_trim (0);
+#endif
+    fp = fopen ("/proc/self/clear_refs", "w");
+    if (fp)
+    {
+        fputs ("5", fp);
+        fclose (fp);
+    }
+}
+
+/* Run a load in a child process so that the peak RSS is its own rather than
+ * the peak of everything before it (reported above the RSS at the fork, as
+ * the child starts with the peak of its parent unless that can be reset) */
+static struct load_result
+measure_load (load_fn fn, gpointer data)
+{
+    struct load_result result = { 0 };
+    int fds[2];
+    pid_t pid;
+
+    fflush (stdout);
+    if (pipe (fds) != 0)
+    {
+        return result;
+    }
+    pid = fork ();
+    if (pid == 0)
+    {
+        long base;
+        uint64_t start;
+
+        close (fds[0]);
+        reset_peak_rss ();
+        base = peak_rss_kb ();
+        start = get_time_ns ();
+        result.success = fn (data);
+        result.time = get_time_ns () - start;
+        result.rss_kb = peak_rss_kb () - base;
+        _exit (write (fds[1], &result, sizeof (result)) == sizeof (result) ? 0 : 1);
+    }
+    close (fds[1]);
+    if (pid < 0 || read (fds[0], &result, sizeof (result)) != sizeof (result))
+    {
+        result.success = false;
+    }
+    close (fds[0]);
+    if (pid > 0)
+    {
+        waitpid (pid, NULL, 0);
+    }
+    return result;
+}
+
+static void
+generate_leaves (FILE *fp, const char *path, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct leaf *leaf = g_new0 (struct leaf, 1);
+        leaf->path = g_strdup_printf ("%s/leaf-%d", path, i);
+        if (enums > 0 && i % 2 == 0)
+        {
+            fprintf (fp, "<NODE name=\"leaf-%d\" mode=\"rw\" default=\"0\" help=\"enum leaf %d\">\n", i, i);
+            for (int e = 0; e < enums; e++)
+            {
+                fprintf (fp, "<VALUE name=\"value-%d\" value=\"%d\"/>\n", e, e);
+            }
+            fprintf (fp, "</NODE>\n");
+            leaf->value = g_strdup_printf ("%d", i % enums);
+            leaf->name = g_strdup_printf ("value-%d", i % enums);
+            g_ptr_array_add (enum_leaves, leaf);
+        }
+        else
+        {
+            fprintf (fp, "<NODE name=\"leaf-%d\" mode=\"rw\" help=\"leaf %d\" pattern=\"^[0-9]{1,5}$\"/>\n", i, i);
+            leaf->value = g_strdup_printf ("%d", i);
+            g_ptr_array_add (pattern_leaves, leaf);
+        }
+        g_ptr_array_add (leaves, leaf);
+    }
+}
+
+static void
+generate_containers (FILE *fp, const char *path, int level)
+{
+    if (level >= depth)
+    {
+        generate_leaves (fp, path, fanout);
+        return;
+    }
+    for (int i = 0; i < fanout; i++)
+    {
+        char *child = g_strdup_printf ("%s/node-%d", path, i);
+        fprintf (fp, "<NODE name=\"node-%d\" help=\"container %d\">\n", i, i);
+        generate_containers (fp, child, level + 1);
+        fprintf (fp, "</NODE>\n");
+        g_free (child);
+    }
+}
+
+/* Write one module per file to a new folder */
+static char *
+generate_schema (void)
+{
+    char *folder = g_dir_make_tmp ("apteryx-bench-XXXXXX", NULL);
+
+    leaves = g_ptr_array_new ();
+    enum_leaves = g_ptr_array_new ();
+    pattern_leaves = g_ptr_array_new ();
+    for (int f = 0; f < files; f++)
+    {
+        char *filename = g_strdup_printf ("%s/bench-%03d.xml", folder, f);
+        char *path = g_strdup_printf ("/bench-%d", f);
+        FILE *fp = fopen (filename, "w");
+        if (!fp)
+        {
+            fprintf (stderr, "Failed to write \"%s\"\n", filename);
+            exit (1);
+        }
+        fprintf (fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n");
+        fprintf (fp, "<NODE name=\"bench-%d\" help=\"module %d\">\n", f, f);
+        generate_containers (fp, path, 0);
+        for (int l = 0; l < lists; l++)
+        {
+            char *entry = g_strdup_printf ("%s/list-%d/entry", path, l);
+            fprintf (fp, "<NODE name=\"list-%d\" help=\"list %d\">\n<NODE name=\"*\" help=\"list entry\">\n", l, l);
+            generate_leaves (fp, entry, fanout);
+            fprintf (fp, "</NODE>\n</NODE>\n");
+            g_free (entry);
+        }
+        fprintf (fp, "</NODE>\n</MODULE>\n");
+        fclose (fp);
+        g_free (path);
+        g_free (filename);
+    }
+    return folder;
+}
+
+static void
+destroy_schema (char *folder)
+{
+    for (int f = 0; f < files; f++)
+    {
+        char *filename = g_strdup_printf ("%s/bench-%03d.xml", folder, f);
+        unlink (filename);
+        g_free (filename);
+    }
+    rmdir (folder);
+    g_free (folder);
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Report latency percentiles as one JSON object per line */
+static void
+report_latency (const char *name, uint64_t *samples, int count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    qsort (samples, count, sizeof (uint64_t), compare_samples);
+    printf ("{\"bench\":\"%s\",\"count\":%d,\"min_ns\":%"PRIu64",\"p50_ns\":%"PRIu64","
+            "\"p90_ns\":%"PRIu64",\"p99_ns\":%"PRIu64",\"max_ns\":%"PRIu64"}\n",
+            name, count, samples[0], samples[(count - 1) * 50 / 100],
+            samples[(count - 1) * 90 / 100], samples[(count - 1) * 99 / 100], samples[count - 1]);
+    fflush (stdout);
+}
+
+/* Time an operation on randomly chosen leaves */
+typedef bool (*bench_fn) (struct leaf *leaf, apteryx_schema_instance *schema);
+
+static void
+bench_leaves (const char *name, GPtrArray *set, bench_fn fn, apteryx_schema_instance *schema)
+{
+    uint64_t *samples = g_new (uint64_t, iterations);
+    GRand *rand = g_rand_new_with_seed (1);
+    int count = 0;
+
+    for (int i = 0; set->len && i < iterations; i++)
+    {
+        struct leaf *leaf = (struct leaf *) set->pdata[g_rand_int_range (rand, 0, set->len)];
+        uint64_t start = get_time_ns ();
+        bool ok = fn (leaf, schema);
+        samples[count++] = get_time_ns () - start;
+        if (!ok)
+        {
+            fprintf (stderr, "%s failed for \"%s\"\n", name, leaf->path);
+            count = 0;
+            break;
+        }
+    }
+    report_latency (name, samples, count);
+    g_rand_free (rand);
+    g_free (samples);
+}
+
+static bool
+bench_lookup (struct leaf *leaf, apteryx_schema_instance *schema)
+{
+    return apteryx_schema_lookup (schema, leaf->path) == leaf->node;
+}
+
+static bool
+bench_translate_to (struct leaf *leaf, apteryx_schema_instance *schema)
+{
+    return strcmp (apteryx_schema_translate_to_const (leaf->node, leaf->value), leaf->name) == 0;
+}
+
+static bool
+bench_translate_from (struct leaf *leaf, apteryx_schema_instance *schema)
+{
+    return strcmp (apteryx_schema_translate_from_const (leaf->node, leaf->name), leaf->value) == 0;
+}
+
+static bool
+bench_validate (struct leaf *leaf, apteryx_schema_instance *schema)
+{
+    return apteryx_schema_validate (leaf->node, leaf->value);
+}
+
+/* One of the threads doing lookups at once */
+struct lookup_thread
+{
+    apteryx_schema_handle *handle;
+    guint32 seed;
+    int found;
+};
+
+static gpointer
+lookup_thread (gpointer data)
+{
+    struct lookup_thread *thread = (struct lookup_thread *) data;
+    apteryx_schema_instance *schema = NULL;
+    GRand *rand = g_rand_new_with_seed (thread->seed);
+
+    for (int i = 0; i < iterations; i++)
+    {
+        struct leaf *leaf = (struct leaf *) leaves->pdata[g_rand_int_range (rand, 0, leaves->len)];
+        /* Readers hold an instance for a batch of lookups */
+        if (i % 1024 == 0)
+        {
+            if (schema)
+                apteryx_schema_free (schema);
+            schema = apteryx_schema_acquire (thread->handle);
+        }
+        if (apteryx_schema_lookup (schema, leaf->path))
+            thread->found++;
+    }
+    apteryx_schema_free (schema);
+    g_rand_free (rand);
+    return NULL;
+}
+
+/* Lookup throughput with more and more threads sharing one instance */
+static void
+bench_threads (const char *name, apteryx_schema_handle *handle)
+{
+    int most = threads ? threads : (int) g_get_num_processors ();
+    double single = 0;
+
+    for (int count = 1; ; count = MIN (count * 2, most))
+    {
+        struct lookup_thread *workers = g_new0 (struct lookup_thread, count);
+        GThread **ids = g_new (GThread *, count);
+        uint64_t start = get_time_ns ();
+        uint64_t time;
+        double rate;
+        bool ok = true;
+
+        for (int i = 0; i < count; i++)
+        {
+            workers[i].handle = handle;
+            workers[i].seed = i + 1;
+            ids[i] = g_thread_new ("lookup", lookup_thread, &workers[i]);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            g_thread_join (ids[i]);
+            ok = ok && workers[i].found == iterations;
+        }
+        time = get_time_ns () - start;
+        if (!ok)
+        {
+            fprintf (stderr, "%s failed with %d threads\n", name, count);
+        }
+        rate = (double) count * iterations * 1000000000 / (time ? time : 1);
+        if (count == 1)
+            single = rate;
+        printf ("{\"bench\":\"%s\",\"threads\":%d,\"count\":%d,\"time_us\":%"PRIu64","
+                "\"lookups_per_sec\":%.0f,\"scaling\":%.2f}\n",
+                name, count, count * iterations, time / 1000, rate, single ? rate / single : 0);
+        fflush (stdout);
+        g_free (ids);
+        g_free (workers);
+        if (count == most)
+            break;
+    }
+}
+
+static bool
+load_folder (gpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load ((const char *) data);
+    apteryx_schema_free (schema);
+    return schema != NULL;
+}
+
+static bool
+load_cache (gpointer data)
+{
+    char **args = (char **) data;
+    apteryx_schema_instance *schema = apteryx_schema_load_cached (args[0], args[1]);
+    apteryx_schema_free (schema);
+    return schema != NULL;
+}
+
+static void
+bench_load (const char *folder)
+{
+    char *cache = g_strdup_printf ("%s/bench.cache", folder);
+    char *args[] = { (char *) folder, cache };
+    struct load_result load, build, mapped;
+
+    load = measure_load (load_folder, (gpointer) folder);
+    if (!load.success)
+    {
+        fprintf (stderr, "Failed to load \"%s\"\n", folder);
+        exit (1);
+    }
+    printf ("{\"bench\":\"load\",\"files\":%d,\"leaves\":%u,\"time_us\":%"PRIu64",\"peak_rss_kb\":%ld}\n",
+            files, leaves->len, load.time / 1000, load.rss_kb);
+
+    /* Writing the cache and then mapping it */
+    build = measure_load (load_cache, args);
+    mapped = measure_load (load_cache, args);
+    printf ("{\"bench\":\"load_cached\",\"build_us\":%"PRIu64",\"time_us\":%"PRIu64","
+            "\"build_rss_kb\":%ld,\"peak_rss_kb\":%ld}\n",
+            build.time / 1000, mapped.time / 1000, build.rss_kb, mapped.rss_kb);
+    fflush (stdout);
+    unlink (cache);
+    g_free (cache);
+}
+
+#ifdef HAVE_LUA
+int luaopen_libapteryx_schema (lua_State *L);
+
+/* Helpers compiled once so that only the binding is timed */
+static const char *lua_helpers =
+    "function walk(...) local t = api for i = 1, select('#', ...) do t = t[select(i, ...)] end return t end\n"
+    "function get(t, k) return t[k] end\n"
+    "function set(t, k, v) t[k] = v end\n";
+
+/* Push the table for the parent of a leaf (returns the number of segments walked) */
+static int
+lua_walk (lua_State *L, struct leaf *leaf)
+{
+    char **segments = g_strsplit (leaf->path + 1, "/", -1);
+    int count = g_strv_length (segments) - 1;
+
+    lua_getglobal (L, "walk");
+    for (int i = 0; i < count; i++)
+    {
+        lua_pushstring (L, segments[i]);
+    }
+    g_strfreev (segments);
+    return count;
+}
+
+static bool
+lua_load_api (gpointer data)
+{
+    return luaL_dostring ((lua_State *) data, "api = apteryx.api(folder)") == 0;
+}
+
+static void
+bench_lua (lua_State *L, const char *folder)
+{
+    uint64_t *samples = g_new (uint64_t, iterations);
+    GRand *rand = g_rand_new_with_seed (1);
+    struct load_result load;
+    const char *name;
+    uint64_t start;
+    int count = 0;
+    int i;
+
+    /* Load the binding (measured in a child and then again for the benchmarks) */
+    lua_pushstring (L, folder);
+    lua_setglobal (L, "folder");
+    load = measure_load (lua_load_api, L);
+    if (!lua_load_api (L) || !load.success)
+    {
+        fprintf (stderr, "%s\n", lua_tostring (L, -1));
+        goto exit;
+    }
+    printf ("{\"bench\":\"lua_load\",\"time_us\":%"PRIu64",\"peak_rss_kb\":%ld}\n",
+            load.time / 1000, load.rss_kb);
+    if (luaL_dostring (L, lua_helpers) != 0)
+    {
+        fprintf (stderr, "%s\n", lua_tostring (L, -1));
+        goto exit;
+    }
+
+    /* Walking proxy tables to the parent of a leaf */
+    for (i = 0; i < iterations; i++)
+    {
+        struct leaf *leaf = (struct leaf *) leaves->pdata[g_rand_int_range (rand, 0, leaves->len)];
+        int args = lua_walk (L, leaf);
+        start = get_time_ns ();
+        if (lua_pcall (L, args, 1, 0) != 0)
+            break;
+        samples[count++] = get_time_ns () - start;
+        if (!leaf->parent)
+            leaf->parent = luaL_ref (L, LUA_REGISTRYINDEX);
+        else
+            lua_pop (L, 1);
+    }
+    report_latency ("lua_walk", samples, count);
+
+    /* Validated writes then reads through Apteryx */
+    for (int pass = 0; pass < 2 && i == iterations; pass++)
+    {
+        name = pass == 0 ? "lua_set" : "lua_get";
+        count = 0;
+        for (i = 0; i < iterations; i++)
+        {
+            struct leaf *leaf = (struct leaf *) leaves->pdata[i % leaves->len];
+            if (!leaf->parent)
+            {
+                lua_pcall (L, lua_walk (L, leaf), 1, 0);
+                leaf->parent = luaL_ref (L, LUA_REGISTRYINDEX);
+            }
+            lua_getglobal (L, pass == 0 ? "set" : "get");
+            lua_rawgeti (L, LUA_REGISTRYINDEX, leaf->parent);
+            lua_pushstring (L, strrchr (leaf->path, '/') + 1);
+            if (pass == 0)
+                lua_pushstring (L, leaf->name ? : leaf->value);
+            start = get_time_ns ();
+            if (lua_pcall (L, pass == 0 ? 3 : 2, pass == 0 ? 0 : 1, 0) != 0)
+                break;
+            samples[count++] = get_time_ns () - start;
+            lua_pop (L, pass == 0 ? 0 : 1);
+        }
+        report_latency (name, samples, count);
+    }
+    if (i != iterations)
+    {
+        fprintf (stderr, "%s\n", lua_tostring (L, -1));
+    }
+
+    /* Remove everything written */
+    for (int f = 0; f < files; f++)
+    {
+        char *path = g_strdup_printf ("/bench-%d", f);
+        apteryx_prune (path);
+        g_free (path);
+    }
+
+exit:
+    g_rand_free (rand);
+    g_free (samples);
+}
+#endif
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    apteryx_schema_instance *schema;
+    apteryx_schema_handle *handle;
+    char *folder;
+
+    context = g_option_context_new ("- benchmark the Apteryx schema library");
+    g_option_context_add_main_entries (context, options, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error) ||
+        depth < 0 || fanout < 1 || lists < 0 || enums < 0 || files < 1 || iterations < 1 || threads < 0)
+    {
+        fprintf (stderr, "%s\n", error ? error->message : "Invalid arguments");
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    /* Schema and loading */
+    folder = generate_schema ();
+    printf ("{\"bench\":\"schema\",\"depth\":%d,\"fanout\":%d,\"lists\":%d,\"enums\":%d,"
+            "\"files\":%d,\"leaves\":%u,\"iterations\":%d}\n",
+            depth, fanout, lists, enums, files, leaves->len, iterations);
+    bench_load (folder);
+
+    /* C API */
+    schema = apteryx_schema_load (folder);
+    for (guint i = 0; i < leaves->len; i++)
+    {
+        struct leaf *leaf = (struct leaf *) leaves->pdata[i];
+        leaf->node = apteryx_schema_lookup (schema, leaf->path);
+    }
+    bench_leaves ("lookup", leaves, bench_lookup, schema);
+    bench_leaves ("translate_to", enum_leaves, bench_translate_to, schema);
+    bench_leaves ("translate_from", enum_leaves, bench_translate_from, schema);
+    bench_leaves ("validate", pattern_leaves, bench_validate, schema);
+    apteryx_schema_cache_enable (schema, 1024 * 1024);
+    bench_leaves ("lookup_cached", leaves, bench_lookup, schema);
+    apteryx_schema_free (schema);
+
+    /* Concurrent readers */
+    handle = apteryx_schema_handle_new (apteryx_schema_load (folder));
+    bench_threads ("lookup_threads", handle);
+    apteryx_schema_handle_free (handle);
+    schema = apteryx_schema_load (folder);
+    apteryx_schema_cache_enable (schema, 1024 * 1024);
+    handle = apteryx_schema_handle_new (schema);
+    bench_threads ("lookup_threads_cached", handle);
+    apteryx_schema_handle_free (handle);
+
+#ifdef HAVE_LUA
+    /* Lua binding */
+    if (!no_lua)
+    {
+        lua_State *L = luaL_newstate ();
+        luaL_openlibs (L);
+        if (luaopen_libapteryx_schema (L) == 1)
+        {
+            lua_setglobal (L, "apteryx");
+            bench_lua (L, folder);
+        }
+        else
+        {
+            fprintf (stderr, "Apteryx is not available for the Lua benchmarks\n");
+        }
+        lua_close (L);
+    }
+#endif
+
+    destroy_schema (folder);
+    return 0;
+}
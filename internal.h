@@ -25,9 +25,12 @@
 #include <string.h>
 #include <glib.h>
 #include <syslog.h>
+#include "apteryx-schema.h"
 
 /* Debug */
 extern bool apteryx_schema_debug;
+/* Number of threads used to parse files (0 for one per processor) */
+extern int apteryx_schema_load_threads;
 #define DEBUG(fmt, args...) \
     if (apteryx_schema_debug) \
     { \
@@ -51,40 +54,262 @@ struct apteryx_schema_model
     char *version;
 };
 
-/* Instance */
-struct apteryx_schema_instance
-{
-    /* Hash table of root nodes */
-    GHashTable *roots;
-    /* List of load models */
-    GList *models;
-};
-
-/* Node */
-#define NODE_FLAGS_LEAF       (1 << 0)
-#define NODE_FLAGS_READ       (1 << 1)
-#define NODE_FLAGS_WRITE      (1 << 2)
+/* Node flags */
+#define NODE_FLAGS_LEAF       APTERYX_SCHEMA_FLAG_LEAF
+#define NODE_FLAGS_READ       APTERYX_SCHEMA_FLAG_READ
+#define NODE_FLAGS_WRITE      APTERYX_SCHEMA_FLAG_WRITE
 #define NODE_FLAGS_ENUM       (1 << 3)
-struct apteryx_schema_node
+
+/* Node as built by the schema parsers before being packed into an arena */
+struct schema_node
 {
-    char name[256];
+    char *name;
     int flags;
     char *description;
     char *defvalue;
     char *value;
     char *pattern;
-    GList *children;
+    /* Children in schema order */
+    struct schema_node *children;
+    struct schema_node *last;
+    struct schema_node *next;
+    /* Children by name (only built for nodes that get merged into) */
+    GHashTable *index;
+};
+struct schema_node * node_create (const char *name);
+void node_destroy (struct schema_node *node);
+void node_add_child (struct schema_node *parent, struct schema_node *child);
+
+/* Statistics are kept in shards on their own cache lines, each thread adding
+ * to one shard so that concurrent readers do not contend on the counters */
+#define STATS_SHARDS          16
+struct schema_stats_shard
+{
+    apteryx_schema_stats stats;
+} __attribute__ ((aligned (64)));
+
+/* Statistics of an instance - referenced by the instance, the arenas first
+ * added to it and the threads that last looked up in it */
+struct schema_stats
+{
+    struct schema_stats_shard shards[STATS_SHARDS];
+    gint refcount;
+    /* Arenas of the instance first added to another instance */
+    GHashTable *shared;
+};
+struct schema_stats * stats_new (void);
+struct schema_stats * stats_ref (struct schema_stats *stats);
+void stats_unref (struct schema_stats *stats);
+void stats_use (struct schema_stats *stats);
+
+/* Arena holding a packed copy of one or more schema trees.
+ * Everything in the arena is referenced by byte offset from the start of
+ * the arena (0 meaning none) so that it is position independent. */
+#define ARENA_MAGIC           0x58535041 /* "APSX" */
+#define ARENA_VERSION         4
+struct schema_arena_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /* Total size of the arena in bytes */
+    uint32_t size;
+    /* Array of all nodes in breadth first order - roots first */
+    uint32_t nodes;
+    uint32_t n_nodes;
+    uint32_t n_roots;
+    /* Array of struct schema_arena_model */
+    uint32_t models;
+    uint32_t n_models;
+    /* Node IDs by node number, counted from the first root (NO_ID for enum values) */
+    uint32_t ids;
+    uint32_t n_ids;
+    /* The struct schema_arena holding this data (set when loaded, never saved) */
+    uint64_t owner;
+};
+struct schema_arena_model
+{
+    uint32_t name;
+    uint32_t organization;
+    uint32_t version;
+};
+/* Enum children of a leaf by exact name and by value */
+struct schema_arena_enums
+{
+    /* Open addressed slots (size is a power of 2) of names then values */
+    uint32_t size;
+    /* Direct slots by integer value when the values are a dense range */
+    int32_t min;
+    uint32_t range;
+};
+#define ENUMS_NAMES(enums)      ((uint32_t *) ((enums) + 1))
+#define ENUMS_VALUES(enums)     (ENUMS_NAMES (enums) + (enums)->size)
+#define ENUMS_INTS(enums)       (ENUMS_VALUES (enums) + (enums)->size)
+struct schema_arena
+{
+    /* Contiguous block starting with a struct schema_arena_header */
+    char *data;
+    size_t size;
+    /* References held - the last one destroys the arena */
+    gint refcount;
+    /* Private file mapping containing the arena (if mapped) */
+    void *map;
+    size_t map_size;
+    /* Compiled node patterns by node number (allocated on first use) */
+    GRegex **patterns;
+    /* Statistics of the first instance the arena was added to (NULL until then) */
+    struct schema_stats *stats;
+    /* First ID of the nodes in the instances numbered from a serial on
+     * (serial << 32 | ID, all ones until numbered) */
+    uint64_t first_id;
+};
+struct schema_arena * arena_create (GList *roots, GList *models);
+bool arena_save (struct schema_arena *arena, const char *filename, const char *folders, GList *files, GArray *stats);
+struct schema_arena * arena_open (const char *filename, const char *folders, GList *files, GArray *stats);
+struct schema_arena * arena_ref (struct schema_arena *arena);
+void arena_destroy (struct schema_arena *arena);
+#define ARENA_HEADER(arena)     ((struct schema_arena_header *) (arena)->data)
+#define ARENA_OWNER(data)       ((struct schema_arena *) (uintptr_t) \
+        ((const struct schema_arena_header *) (data))->owner)
+#define ARENA_ROOT(arena, i)    ((struct apteryx_schema_node *) \
+        ((arena)->data + ARENA_HEADER (arena)->nodes + (i) * sizeof (struct apteryx_schema_node)))
+
+/* Node as packed into an arena (read only) */
+struct apteryx_schema_node
+{
+    /* Offset of this node in its arena */
+    uint32_t self;
+    uint32_t flags;
+    /* Strings */
+    uint32_t name;
+    uint32_t description;
+    uint32_t defvalue;
+    uint32_t value;
+    uint32_t pattern;
+    /* Parent node */
+    uint32_t parent;
+    /* First of a contiguous run of child nodes in schema order */
+    uint32_t children;
+    uint32_t n_children;
+    /* Open addressed hash index of named children (size is a power of 2) */
+    uint32_t index;
+    uint32_t index_size;
+    /* Wildcard child that matches any name not in the index */
+    uint32_t wildcard;
+    /* Hash of the '-'/'_' normalised name */
+    uint32_t hash;
+    /* Enum children map (struct schema_arena_enums) */
+    uint32_t enums;
+};
+#define NODE_ARENA(node)        ((const char *) (node) - (node)->self)
+#define NODE_AT(node, offset)   ((struct apteryx_schema_node *) (NODE_ARENA (node) + (offset)))
+#define NODE_STR(node, field)   ((node)->field ? NODE_ARENA (node) + (node)->field : NULL)
+#define NODE_CHILD(node, i)     NODE_AT (node, (node)->children + (i) * sizeof (struct apteryx_schema_node))
+#define NODE_INDEX(node)        (((node)->self - ((struct schema_arena_header *) NODE_ARENA (node))->nodes) / \
+        sizeof (struct apteryx_schema_node))
+uint32_t name_hash (const char *name, size_t len);
+bool match_name (const char *name, const char *segment, size_t len);
+uint32_t enum_hash (const char *str);
+bool enum_integer (const char *str, int32_t *value);
+GRegex * arena_pattern (struct apteryx_schema_node *node);
+
+/* Perfect hash of the names or values of an enum leaf (as generated by xml2c).
+ * Keys are split into buckets by one hash and each bucket has its own seed for
+ * a second hash that puts its keys in free slots (hash and displace). */
+struct enum_phash
+{
+    uint32_t n_buckets;
+    uint16_t *seeds;
+    uint32_t size;
+    /* Index of the key plus one in each slot (0 if empty) */
+    uint16_t *slots;
+};
+uint32_t enum_phash_hash (uint32_t seed, const char *str);
+struct enum_phash enum_phash_build (GPtrArray *keys);
+void enum_phash_free (struct enum_phash *hash);
+apteryx_schema_stats * stats_shard (struct schema_stats *stats);
+apteryx_schema_stats * arena_stats (struct apteryx_schema_node *node);
+
+/* Statistics - counters are updated atomically and latencies sampled */
+#define STATS_ADD(counter, n)   __atomic_add_fetch (&(counter), (n), __ATOMIC_RELAXED)
+uint64_t stats_now (void);
+uint64_t stats_start (void);
+void stats_finish (uint64_t *histogram, uint64_t start);
+
+/* Lookup cache slot - a slot being written (odd sequence) or changed while
+ * read is treated as a miss rather than waited for */
+#define CACHE_SLOT_PATH     108
+struct schema_cache_slot
+{
+    /* Even once written (0 if never), odd while being written */
+    uint32_t seq;
+    uint32_t hash;
+    /* Result of the lookup (may be NULL) */
+    struct apteryx_schema_node *node;
+    /* Path looked up (not terminated) */
+    uint16_t len;
+    /* Hit since the CLOCK hand last passed */
+    uint8_t referenced;
+    char path[CACHE_SLOT_PATH];
+} __attribute__ ((aligned (64)));
+
+/* Bounded cache of lookup results shared without locks by every thread -
+ * each path maps to a set of slots and a miss replaces the slot picked by
+ * the CLOCK hand of that set */
+#define CACHE_WAYS          4
+struct schema_cache
+{
+    /* Slots (a power of two, CACHE_WAYS per set) */
+    struct schema_cache_slot *slots;
+    guint size;
+    /* CLOCK hand of each set */
+    uint8_t *hands;
+    /* Memory used and allowed */
+    size_t bytes;
+    size_t max_bytes;
+};
+
+/* Instance (read only once loaded and shared by reference) */
+struct apteryx_schema_instance
+{
+    /* References held - the last one frees the instance */
+    gint refcount;
+    /* Set once published on a handle for other threads */
+    gint published;
+    /* Hash table of root nodes */
+    GHashTable *roots;
+    /* List of load models */
+    GList *models;
+    /* Arena holding the models and all the nodes (unless packed per root) */
+    struct schema_arena *arena;
+    /* Arenas each holding a single root (may be shared with other instances) */
+    GPtrArray *arenas;
+    /* Roots only parsed on first use by name (lazy loads only) */
+    GHashTable *lazy;
+    /* Held while a lazy root is parsed */
+    GMutex lazy_lock;
+    /* Dense node IDs (numbered at load, NULL for lazy loads) */
+    struct schema_ids *ids;
+    /* Optional lookup cache (only set before the instance is shared) */
+    struct schema_cache *cache;
+    /* Statistics of the instance (summed over the shards) */
+    struct schema_stats *stats;
 };
-struct apteryx_schema_node * node_create (const char *name);
-void node_destroy (struct apteryx_schema_node *node);
 
 #ifdef HAVE_LIBXML
 /* XML schema support */
-struct apteryx_schema_node * xml_schema_load (const char *filename);
+void xml_schema_init (void);
+struct schema_node * xml_schema_load (const char *filename);
+char * xml_schema_root (const char *filename);
 #endif
 #ifdef HAVE_LIBYANG
-/* Yang schema support */
-struct apteryx_schema_node * yang_schema_load (const char *filename, char **name, char **organization, char **version);
+/* Yang schema support (all the modules in a load share one context) */
+struct ly_ctx;
+struct lys_module;
+struct ly_ctx * yang_schema_context (void);
+void yang_schema_context_free (struct ly_ctx *ctx);
+const struct lys_module * yang_schema_parse (struct ly_ctx *ctx, const char *filename);
+struct schema_node * yang_schema_load (const struct lys_module *mod, char **name, char **organization, char **version);
+char * yang_schema_root (const char *filename, bool *deviates);
 #endif
 
 #endif /* _INTERNAL_H_ */
@@ -37,107 +37,1268 @@ extern bool apteryx_schema_debug;
         printf (fmt, ## args); \
     }
 
-/* Global pointer to the loaded schema */
-static apteryx_schema_instance *api = NULL;
+/* Schema shared by every Lua state (replaced by each call to api()) */
+static apteryx_schema_handle *api_handle = NULL;
+static GMutex api_lock;
+
+/* Reference each Lua state holds on the schema it is using */
+struct api_ref
+{
+    apteryx_schema_instance *schema;
+    /* Incremented each time the schema changes so old proxies can be detected */
+    lua_Integer generation;
+};
+static const char api_key = 0;
 /* A root user can write to read-only fields */
 static bool is_root = true;
 
+/* Writes collected by a transaction until it is committed */
+struct transaction
+{
+    /* Pending values by path (NULL to delete) */
+    GHashTable *writes;
+};
+
+/* Local cache of the leaf values read below one node, kept coherent by a watch */
+struct value_cache
+{
+    /* Path of the cached subtree */
+    char *prefix;
+    /* Entries by path and least recently used last - accessed from watch threads */
+    GMutex lock;
+    GHashTable *values;
+    GQueue lru;
+    /* Incremented by every invalidation so that racing reads are not cached */
+    uint64_t generation;
+    /* Memory used and allowed */
+    size_t bytes;
+    size_t max_bytes;
+    /* Statistics */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* A cached value (NULL if not set) and its place in the LRU queue */
+struct cache_entry
+{
+    GList link;
+    char *path;
+    char *value;
+};
+#define CACHE_DEFAULT_BYTES     (1024 * 1024)
+#define CACHE_ENTRY_BYTES(path, value) \
+        (strlen (path) + ((value) ? strlen (value) : 0) + 2 + \
+         sizeof (struct cache_entry) + 2 * sizeof (gpointer))
+
+/* The caches of a Lua state (freed with it) */
+struct state_caches
+{
+    GList *caches;
+};
+static const char caches_key = 0;
+
+/* Every live cache so that watches and writes can reach them */
+static GList *caches = NULL;
+static GMutex caches_lock;
+/* Number of caches using each watch */
+static GHashTable *cache_watches = NULL;
+static GMutex cache_watches_lock;
+
+static int
+lua_apteryx_debug (lua_State *L)
+{
+    if (lua_gettop (L) < 1 || !lua_isboolean (L, 1))
+    {
+        luaL_error (L, "Invalid arguments: requires boolean");
+        return 0;
+    }
+    apteryx_schema_debug = lua_toboolean (L, 1);
+    return 0;
+}
+
+static int
+api_ref_gc (lua_State *L)
+{
+    struct api_ref *ref = (struct api_ref *) luaL_checkudata (L, 1, "apteryx_schema");
+    if (ref->schema)
+    {
+        apteryx_schema_free (ref->schema);
+        ref->schema = NULL;
+    }
+    return 0;
+}
+
+/* Get the schema reference of a Lua state. Only calls from Lua refresh it to
+ * the latest schema so that nodes stay valid for the rest of the call. */
+static struct api_ref *
+api_state (lua_State *L, bool refresh)
+{
+    apteryx_schema_handle *handle = g_atomic_pointer_get (&api_handle);
+    struct api_ref *ref;
+
+    lua_rawgetp (L, LUA_REGISTRYINDEX, &api_key);
+    ref = (struct api_ref *) lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    if (!ref)
+    {
+        ref = (struct api_ref *) lua_newuserdata (L, sizeof (struct api_ref));
+        ref->schema = NULL;
+        ref->generation = 0;
+        if (luaL_newmetatable (L, "apteryx_schema"))
+        {
+            lua_pushcfunction (L, api_ref_gc);
+            lua_setfield (L, -2, "__gc");
+        }
+        lua_setmetatable (L, -2);
+        lua_rawsetp (L, LUA_REGISTRYINDEX, &api_key);
+    }
+    if (refresh && handle && !apteryx_schema_is_current (handle, ref->schema))
+    {
+        if (ref->schema)
+            apteryx_schema_free (ref->schema);
+        ref->schema = apteryx_schema_acquire (handle);
+        ref->generation++;
+    }
+    return ref;
+}
+
+/* Get the path and node bound to a proxy table (no node for the root table) */
+static apteryx_schema_node *
+proxy_node (lua_State *L, int index, const char **path)
+{
+    apteryx_schema_node *node;
+
+    lua_pushstring (L, "__path");
+    lua_rawget (L, index);
+    *path = lua_tostring (L, -1);
+    if (*path == NULL)
+    {
+        *path = "";
+    }
+    lua_pushstring (L, "__node");
+    lua_rawget (L, index);
+    node = (apteryx_schema_node *) lua_touserdata (L, -1);
+    lua_pushstring (L, "__generation");
+    lua_rawget (L, index);
+    if (node && lua_tointeger (L, -1) != api_state (L, false)->generation)
+    {
+        /* Created from a previous schema so find it again */
+        node = apteryx_schema_lookup (api_state (L, false)->schema, *path);
+    }
+    lua_pop (L, 3);
+    return node;
+}
+
+/* Get the transaction (if any) that a proxy table writes to */
+static struct transaction *
+proxy_transaction (lua_State *L, int index)
+{
+    struct transaction *tx;
+
+    lua_pushstring (L, "__tx");
+    lua_rawget (L, index);
+    tx = (struct transaction *) luaL_testudata (L, -1, "apteryx_tx");
+    lua_pop (L, 1);
+    return tx;
+}
+
+/* Get a value written by a transaction (returns false if not written) */
+static bool
+pending_value (struct transaction *tx, const char *path, const char **value)
+{
+    gpointer pending;
+
+    if (!tx || !g_hash_table_lookup_extended (tx->writes, path, NULL, &pending))
+    {
+        return false;
+    }
+    *value = (pending && ((char *) pending)[0] != '\0') ? (const char *) pending : NULL;
+    return true;
+}
+
+/* Check if a path is below a cached subtree */
+static bool
+cache_covers (struct value_cache *cache, const char *path)
+{
+    size_t len = strlen (cache->prefix);
+    return strncmp (path, cache->prefix, len) == 0 && path[len] == '/';
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+    struct cache_entry *entry = (struct cache_entry *) data;
+    g_free (entry->path);
+    g_free (entry->value);
+    g_free (entry);
+}
+
+/* Remove a cached value (with the cache locked) */
+static void
+cache_remove (struct value_cache *cache, const char *path)
+{
+    struct cache_entry *entry = (struct cache_entry *) g_hash_table_lookup (cache->values, path);
+
+    if (entry)
+    {
+        cache->bytes -= CACHE_ENTRY_BYTES (entry->path, entry->value);
+        g_queue_unlink (&cache->lru, &entry->link);
+        g_hash_table_remove (cache->values, path);
+    }
+}
+
+/* Evict the least recently used values until there is room (with the cache locked) */
+static void
+cache_trim (struct value_cache *cache, size_t size)
+{
+    while (cache->lru.tail && cache->bytes + size > cache->max_bytes)
+    {
+        cache_remove (cache, ((struct cache_entry *) cache->lru.tail->data)->path);
+    }
+}
+
+/* Add a value as the most recently used (with the cache locked) */
+static void
+cache_insert (struct value_cache *cache, const char *path, const char *value)
+{
+    size_t size = CACHE_ENTRY_BYTES (path, value);
+    struct cache_entry *entry;
+
+    cache_remove (cache, path);
+    if (size > cache->max_bytes)
+    {
+        return;
+    }
+    cache_trim (cache, size);
+    entry = g_new0 (struct cache_entry, 1);
+    entry->path = g_strdup (path);
+    entry->value = g_strdup (value);
+    entry->link.data = entry;
+    g_queue_push_head_link (&cache->lru, &entry->link);
+    g_hash_table_insert (cache->values, entry->path, entry);
+    cache->bytes += size;
+}
+
+/* Forget a value that has changed in every cache holding it */
+static void
+cache_invalidate (const char *path)
+{
+    g_mutex_lock (&caches_lock);
+    for (GList *iter = caches; iter; iter = g_list_next (iter))
+    {
+        struct value_cache *cache = (struct value_cache *) iter->data;
+        if (cache_covers (cache, path))
+        {
+            g_mutex_lock (&cache->lock);
+            cache->generation++;
+            cache_remove (cache, path);
+            g_mutex_unlock (&cache->lock);
+        }
+    }
+    g_mutex_unlock (&caches_lock);
+}
+
+static bool
+cache_watch (const char *path, const char *value)
+{
+    cache_invalidate (path);
+    return true;
+}
+
+/* Add or drop a cache using the watch on a subtree (watching on first use) */
+static void
+cache_watch_use (const char *prefix, bool use)
+{
+    char *watch = g_strdup_printf ("%s/*", prefix);
+    guint count;
+
+    g_mutex_lock (&cache_watches_lock);
+    if (!cache_watches)
+    {
+        cache_watches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (cache_watches, watch));
+    if (use && count++ == 0)
+    {
+        apteryx_watch (watch, cache_watch);
+    }
+    else if (!use && --count == 0)
+    {
+        apteryx_unwatch (watch, cache_watch);
+    }
+    if (count)
+    {
+        g_hash_table_replace (cache_watches, g_strdup (watch), GUINT_TO_POINTER (count));
+    }
+    else
+    {
+        g_hash_table_remove (cache_watches, watch);
+    }
+    g_mutex_unlock (&cache_watches_lock);
+    g_free (watch);
+}
+
+/* Start caching a subtree - watched before anything is cached */
+static struct value_cache *
+cache_new (const char *prefix)
+{
+    struct value_cache *cache = g_new0 (struct value_cache, 1);
+
+    cache->prefix = g_strdup (prefix);
+    g_mutex_init (&cache->lock);
+    cache->values = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_free);
+    g_queue_init (&cache->lru);
+    cache->max_bytes = CACHE_DEFAULT_BYTES;
+    g_mutex_lock (&caches_lock);
+    caches = g_list_prepend (caches, cache);
+    g_mutex_unlock (&caches_lock);
+    cache_watch_use (prefix, true);
+    return cache;
+}
+
+/* Stop caching a subtree once no watch can reach it */
+static void
+cache_free (struct value_cache *cache)
+{
+    g_mutex_lock (&caches_lock);
+    caches = g_list_remove (caches, cache);
+    g_mutex_unlock (&caches_lock);
+    cache_watch_use (cache->prefix, false);
+    g_hash_table_destroy (cache->values);
+    g_mutex_clear (&cache->lock);
+    g_free (cache->prefix);
+    g_free (cache);
+}
+
+static int
+state_caches_gc (lua_State *L)
+{
+    struct state_caches *state = (struct state_caches *) luaL_checkudata (L, 1, "apteryx_caches");
+    while (state->caches)
+    {
+        cache_free ((struct value_cache *) state->caches->data);
+        state->caches = g_list_delete_link (state->caches, state->caches);
+    }
+    return 0;
+}
+
+/* Get the caches of a Lua state (optionally creating them) */
+static struct state_caches *
+state_caches (lua_State *L, bool create)
+{
+    struct state_caches *state;
+
+    lua_rawgetp (L, LUA_REGISTRYINDEX, &caches_key);
+    state = (struct state_caches *) lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    if (!state && create)
+    {
+        state = (struct state_caches *) lua_newuserdata (L, sizeof (struct state_caches));
+        state->caches = NULL;
+        if (luaL_newmetatable (L, "apteryx_caches"))
+        {
+            lua_pushcfunction (L, state_caches_gc);
+            lua_setfield (L, -2, "__gc");
+        }
+        lua_setmetatable (L, -2);
+        lua_rawsetp (L, LUA_REGISTRYINDEX, &caches_key);
+    }
+    return state;
+}
+
+/* Get a value from a cache of this state or Apteryx (caching it if covered) */
+static char *
+cache_get (lua_State *L, const char *path)
+{
+    struct state_caches *state = state_caches (L, false);
+    struct value_cache *cache = NULL;
+    struct cache_entry *entry;
+    uint64_t generation;
+    char *value;
+
+    for (GList *iter = state ? state->caches : NULL; iter && !cache; iter = g_list_next (iter))
+    {
+        if (cache_covers ((struct value_cache *) iter->data, path))
+            cache = (struct value_cache *) iter->data;
+    }
+    if (!cache)
+    {
+        return apteryx_get (path);
+    }
+
+    g_mutex_lock (&cache->lock);
+    entry = (struct cache_entry *) g_hash_table_lookup (cache->values, path);
+    if (entry)
+    {
+        cache->hits++;
+        g_queue_unlink (&cache->lru, &entry->link);
+        g_queue_push_head_link (&cache->lru, &entry->link);
+        value = g_strdup (entry->value);
+        g_mutex_unlock (&cache->lock);
+        return value;
+    }
+    cache->misses++;
+    generation = cache->generation;
+    g_mutex_unlock (&cache->lock);
+
+    value = apteryx_get (path);
+
+    /* Unless it changed while we were reading it */
+    g_mutex_lock (&cache->lock);
+    if (generation == cache->generation)
+    {
+        cache_insert (cache, path, value);
+    }
+    g_mutex_unlock (&cache->lock);
+    return value;
+}
+
+/* Find a child of a proxy table with a single lookup from its node */
+static apteryx_schema_node *
+proxy_child (lua_State *L, apteryx_schema_node *parent, const char *path, const char *key)
+{
+    if (!parent && path[0] != '\0')
+    {
+        /* No longer in the schema */
+        return NULL;
+    }
+    return apteryx_schema_lookup_child (api_state (L, false)->schema, parent, key);
+}
+
+/* Push the real path of a node onto the stack */
+static const char *
+push_path (lua_State *L, apteryx_schema_node *node, const char *path, const char *key)
+{
+    const char *name = apteryx_schema_name_const (node);
+    return lua_pushfstring (L, "%s/%s", path, strcmp (name, "*") != 0 ? name : key);
+}
+
+/* Push either a value or table onto the stack (the parent table is at index 1) */
+static bool
+push_node (lua_State *L, struct transaction *tx, apteryx_schema_node *node,
+           const char *path, const char *key)
+{
+    const char *__path;
+    const char *pending;
+
+    /* Check the node */
+    if (!node)
+    {
+        /* Not accessible at all */
+        luaL_error (L, "\'%s\' invalid", key);
+        return false;
+    }
+
+    /* For leaves we return a value - either from db, default or nil */
+    if (apteryx_schema_is_leaf (node))
+    {
+        char *value;
+
+        /* Make sure we have access */
+        if (!is_root && !apteryx_schema_is_readable (node))
+        {
+            /* Not readable */
+            luaL_error (L, "\'%s\' not readable", key);
+            return false;
+        }
+
+        /* Get the value from the transaction, Apteryx or its default */
+        __path = push_path (L, node, path, key);
+        if (pending_value (tx, __path, &pending))
+            value = g_strdup (pending);
+        else
+            value = cache_get (L, __path);
+        lua_pop (L, 1);
+        /* Pass back defined values if they exist in the schema */
+        lua_pushstring (L, apteryx_schema_translate_to_const (node, value));
+        free (value);
+    }
+    else
+    {
+        /* Table on the stack bound to the node */
+        lua_newtable (L);
+        lua_pushstring (L, "__path");
+        push_path (L, node, path, key);
+        lua_rawset (L, -3);
+        lua_pushstring (L, "__node");
+        lua_pushlightuserdata (L, node);
+        lua_rawset (L, -3);
+        lua_pushstring (L, "__generation");
+        lua_pushinteger (L, api_state (L, false)->generation);
+        lua_rawset (L, -3);
+        lua_pushstring (L, "__tx");
+        lua_pushstring (L, "__tx");
+        lua_rawget (L, 1);
+        lua_rawset (L, -3);
+        luaL_setmetatable (L, "apteryx_mt");
+    }
+    return true;
+}
+
+/* Set the value of a leaf */
+static bool
+set_node (lua_State *L, struct transaction *tx, apteryx_schema_node *node,
+          const char *path, const char *key, const char *value)
+{
+    const char *__path;
+    const char *val;
+
+    /* Validate the node */
+    if (!node || (!is_root && !apteryx_schema_is_writable (node)) || !apteryx_schema_is_leaf (node))
+    {
+        /* Not accessible */
+        luaL_error (L, "\'%s\' not writable", key);
+        return false;
+    }
+
+    /* Translate from the schema version and check it is valid */
+    val = apteryx_schema_translate_from_const (node, value);
+    if (!apteryx_schema_validate (node, val))
+    {
+        luaL_error (L, "\'%s\' invalid value", key);
+        return false;
+    }
+    __path = push_path (L, node, path, key);
+    if (tx)
+    {
+        /* Written when the transaction is committed */
+        g_hash_table_replace (tx->writes, g_strdup (__path), g_strdup (val));
+        lua_pushboolean (L, true);
+    }
+    else
+    {
+        lua_pushboolean (L, apteryx_set (__path, val));
+        cache_invalidate (__path);
+    }
+    lua_remove (L, -2);
+    return true;
+}
+
+/* Check if a table has no entries */
+static bool
+table_empty (lua_State *L, int index)
+{
+    lua_pushnil (L);
+    if (lua_next (L, index < 0 ? index - 1 : index) == 0)
+    {
+        return true;
+    }
+    lua_pop (L, 2);
+    return false;
+}
+
+/* Push a table of the values below a node from a tree read from Apteryx */
+static void
+push_tree (lua_State *L, apteryx_schema_node *node, GNode *tree)
+{
+    apteryx_schema_node *child;
+
+    lua_newtable (L);
+
+    /* Everything that is set */
+    for (GNode *t = tree ? tree->children : NULL; t; t = t->next)
+    {
+        child = apteryx_schema_lookup_child (api_state (L, false)->schema, node, APTERYX_NAME (t));
+        if (!child)
+        {
+            continue;
+        }
+        if (apteryx_schema_is_leaf (child))
+        {
+            if (!is_root && !apteryx_schema_is_readable (child))
+                continue;
+            lua_pushstring (L, apteryx_schema_translate_to_const (child, APTERYX_VALUE (t)));
+        }
+        else
+        {
+            push_tree (L, child, t);
+        }
+        lua_setfield (L, -2, APTERYX_NAME (t));
+    }
+
+    /* Defaults for anything that is not */
+    for (child = apteryx_schema_first_child (node); child; child = apteryx_schema_next_child (node, child))
+    {
+        const char *name = apteryx_schema_name_const (child);
+        if (strcmp (name, "*") == 0 || (!is_root && !apteryx_schema_is_readable (child)))
+        {
+            continue;
+        }
+        lua_getfield (L, -1, name);
+        if (!lua_isnil (L, -1))
+        {
+            lua_pop (L, 1);
+            continue;
+        }
+        lua_pop (L, 1);
+        if (apteryx_schema_is_leaf (child))
+        {
+            const char *value = apteryx_schema_translate_to_const (child, NULL);
+            if (!value)
+                continue;
+            lua_pushstring (L, value);
+        }
+        else
+        {
+            push_tree (L, child, NULL);
+            if (table_empty (L, -1))
+            {
+                lua_pop (L, 1);
+                continue;
+            }
+        }
+        lua_setfield (L, -2, name);
+    }
+}
+
+/* Find or add the child of a tree node with this name */
+static GNode *
+tree_child (GNode *node, const char *name, size_t len)
+{
+    for (GNode *child = node->children; child; child = child->next)
+    {
+        if (strncmp (APTERYX_NAME (child), name, len) == 0 && APTERYX_NAME (child)[len] == '\0')
+            return child;
+    }
+    return APTERYX_NODE (node, g_strndup (name, len));
+}
+
+/* Apply the pending writes of a transaction below a path to a tree read from Apteryx */
+static GNode *
+tree_overlay (GNode *tree, const char *path, struct transaction *tx)
+{
+    size_t len = strlen (path);
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init (&iter, tx->writes);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        const char *segment = (const char *) key + len;
+        const char *value;
+        const char *end;
+        GNode *node;
+
+        if (strncmp ((const char *) key, path, len) != 0 || *segment != '/')
+        {
+            continue;
+        }
+        if (!tree)
+        {
+            tree = g_node_new (g_strdup (path));
+        }
+        pending_value (tx, (const char *) key, &value);
+
+        /* Find the leaf and replace its value */
+        node = tree;
+        for (segment++; (end = strchr (segment, '/')); segment = end + 1)
+        {
+            node = tree_child (node, segment, end - segment);
+        }
+        node = tree_child (node, segment, strlen (segment));
+        while (node->children)
+        {
+            GNode *old = node->children;
+            g_node_unlink (old);
+            apteryx_free_tree (old);
+        }
+        if (value)
+        {
+            APTERYX_NODE (node, g_strdup (value));
+            continue;
+        }
+
+        /* Remove deleted leaves and anything left empty */
+        while (node != tree && !node->children)
+        {
+            GNode *parent = node->parent;
+            g_node_unlink (node);
+            apteryx_free_tree (node);
+            node = parent;
+        }
+    }
+    return tree;
+}
+
+/* Read everything below a node with a single request */
+static int
+proxy_get (lua_State *L)
+{
+    apteryx_schema_node *node;
+    struct transaction *tx;
+    const char *path;
+    GNode *tree;
+
+    /* If no API, this node does not exist! */
+    if (!api_state (L, true)->schema)
+    {
+        return 0;
+    }
+    luaL_checktype (L, 1, LUA_TTABLE);
+    node = proxy_node (L, 1, &path);
+    if (!node)
+    {
+        luaL_error (L, "\'%s\' invalid", path);
+        return 0;
+    }
+
+    DEBUG ("get: %s\n", path);
+
+    /* Including anything written by a transaction */
+    tree = apteryx_get_tree (path);
+    tx = proxy_transaction (L, 1);
+    if (tx)
+    {
+        tree = tree_overlay (tree, path, tx);
+    }
+    push_tree (L, node, tree);
+    if (tree)
+    {
+        apteryx_free_tree (tree);
+    }
+    return 1;
+}
+
+/* Keys of a list yet to be returned by a keys iterator (at most one page) */
+struct list_keys
+{
+    /* Keys in order */
+    GPtrArray *keys;
+    guint next;
+};
+
+static int
+list_keys_gc (lua_State *L)
+{
+    struct list_keys *keys = (struct list_keys *) luaL_checkudata (L, 1, "apteryx_keys");
+    if (keys->keys)
+    {
+        g_ptr_array_free (keys->keys, true);
+        keys->keys = NULL;
+    }
+    return 0;
+}
+
+/* Return the next key of the page */
+static int
+list_keys_next (lua_State *L)
+{
+    struct list_keys *keys = (struct list_keys *) lua_touserdata (L, lua_upvalueindex (1));
+
+    if (!keys->keys || keys->next >= keys->keys->len)
+    {
+        return 0;
+    }
+    lua_pushstring (L, (const char *) g_ptr_array_index (keys->keys, keys->next++));
+    return 1;
+}
+
+static gint
+compare_keys (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/* Move the key at i down the max-heap until both children are smaller */
+static void
+keys_heap_down (GPtrArray *heap, guint i)
+{
+    char **keys = (char **) heap->pdata;
+
+    while (true)
+    {
+        guint largest = i;
+        guint child = 2 * i + 1;
+        char *swap;
+
+        if (child < heap->len && strcmp (keys[child], keys[largest]) > 0)
+            largest = child;
+        if (child + 1 < heap->len && strcmp (keys[child + 1], keys[largest]) > 0)
+            largest = child + 1;
+        if (largest == i)
+            break;
+        swap = keys[i];
+        keys[i] = keys[largest];
+        keys[largest] = swap;
+        i = largest;
+    }
+}
+
+/* Add a key to a max-heap holding the smallest count keys seen so far */
+static void
+keys_heap_add (GPtrArray *heap, lua_Integer count, const char *key)
+{
+    char **keys;
+    guint i;
+
+    if (heap->len == count)
+    {
+        /* Full - only a key smaller than the largest gets in */
+        if (strcmp (key, (const char *) heap->pdata[0]) >= 0)
+            return;
+        g_free (heap->pdata[0]);
+        heap->pdata[0] = g_strdup (key);
+        keys_heap_down (heap, 0);
+        return;
+    }
+    g_ptr_array_add (heap, g_strdup (key));
+    keys = (char **) heap->pdata;
+    for (i = heap->len - 1; i > 0 && strcmp (keys[(i - 1) / 2], keys[i]) < 0; i = (i - 1) / 2)
+    {
+        char *swap = keys[i];
+        keys[i] = keys[(i - 1) / 2];
+        keys[(i - 1) / 2] = swap;
+    }
+}
+
+/* Iterate over the keys of a list in order (optionally one page after a key) */
 static int
-lua_apteryx_debug (lua_State *L)
+proxy_keys (lua_State *L)
 {
-    if (lua_gettop (L) < 1 || !lua_isboolean (L, 1))
+    static const luaL_Reg _keys_mt[] = {
+        { "__gc", list_keys_gc },
+        { NULL, NULL }
+    };
+    struct list_keys *keys;
+    const char *path;
+    const char *start;
+    lua_Integer count;
+    GList *paths;
+    GPtrArray *page;
+    char *__path;
+    size_t len;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    proxy_node (L, 1, &path);
+    start = luaL_optstring (L, 2, NULL);
+    count = luaL_optinteger (L, 3, 0);
+
+    DEBUG ("keys: %s after %s\n", path, start ? : "");
+
+    __path = g_strdup_printf ("%s/", path);
+    len = strlen (__path);
+    paths = apteryx_search (__path);
+    g_free (__path);
+
+    /* Keep only the first page after the start (a bounded max-heap) */
+    page = g_ptr_array_new_with_free_func (g_free);
+    for (GList *iter = paths; iter; iter = g_list_next (iter))
     {
-        luaL_error (L, "Invalid arguments: requires boolean");
+        const char *key = (const char *) iter->data + len;
+        if (start && strcmp (key, start) <= 0)
+            continue;
+        if (count > 0)
+            keys_heap_add (page, count, key);
+        else
+            g_ptr_array_add (page, g_strdup (key));
+    }
+    g_list_free_full (paths, free);
+    g_ptr_array_sort (page, compare_keys);
+
+    /* Iterator function holding the page */
+    keys = (struct list_keys *) lua_newuserdata (L, sizeof (struct list_keys));
+    keys->keys = page;
+    keys->next = 0;
+    if (luaL_newmetatable (L, "apteryx_keys"))
+    {
+        luaL_setfuncs (L, _keys_mt, 0);
+    }
+    lua_setmetatable (L, -2);
+    lua_pushcclosure (L, list_keys_next, 1);
+    return 1;
+}
+
+/* Find or add the node for a path in the tree being committed */
+static GNode *
+commit_node (GHashTable *nodes, GNode *root, const char *path, size_t len)
+{
+    char *key;
+    GNode *node;
+    const char *slash;
+
+    if (len == 0)
+    {
+        return root;
+    }
+    key = g_strndup (path, len);
+    node = (GNode *) g_hash_table_lookup (nodes, key);
+    if (node)
+    {
+        g_free (key);
+        return node;
+    }
+    slash = memrchr (path, '/', len);
+    node = APTERYX_NODE (commit_node (nodes, root, path, slash - path),
+                         g_strndup (slash + 1, len - (slash + 1 - path)));
+    g_hash_table_insert (nodes, key, node);
+    return node;
+}
+
+/* Write everything in a transaction with a single request */
+static int
+transaction_commit (lua_State *L)
+{
+    struct transaction *tx;
+    GHashTable *nodes;
+    GHashTableIter iter;
+    gpointer key, value;
+    GNode *root;
+    bool cas = false;
+    uint64_t ts = 0;
+    bool ret = true;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    tx = proxy_transaction (L, 1);
+    if (!tx)
+    {
+        luaL_error (L, "Not a transaction");
         return 0;
     }
-    apteryx_schema_debug = lua_toboolean (L, 1);
+    if (lua_gettop (L) >= 2 && lua_isnumber (L, 2))
+    {
+        /* Only if nothing has changed since this timestamp */
+        cas = true;
+        ts = lua_tointeger (L, 2);
+    }
+    if (g_hash_table_size (tx->writes) == 0)
+    {
+        lua_pushboolean (L, true);
+        return 1;
+    }
+
+    /* Build one tree from "/" holding every write */
+    root = g_node_new (g_strdup ("/"));
+    nodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_iter_init (&iter, tx->writes);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        const char *path = (const char *) key;
+        const char *slash = strrchr (path, '/');
+        APTERYX_LEAF (commit_node (nodes, root, path, slash - path),
+                      g_strdup (slash + 1), g_strdup (value ? : ""));
+    }
+    g_hash_table_destroy (nodes);
+    ret = cas ? apteryx_cas_tree (root, ts) : apteryx_set_tree (root);
+    apteryx_free_tree (root);
+
+    /* The tree is written as a whole - keep every write to try again */
+    g_hash_table_iter_init (&iter, tx->writes);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        cache_invalidate ((const char *) key);
+    }
+    if (ret)
+    {
+        g_hash_table_remove_all (tx->writes);
+    }
+    lua_pushboolean (L, ret);
+    return 1;
+}
+
+/* Discard everything written to a transaction */
+static int
+transaction_cancel (lua_State *L)
+{
+    struct transaction *tx;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    tx = proxy_transaction (L, 1);
+    if (tx)
+    {
+        g_hash_table_remove_all (tx->writes);
+    }
     return 0;
 }
 
-/* Push either a value or table onto the stack */
-static bool
-push_node (lua_State *L, apteryx_schema_instance *api, const char *path, const char *key)
+static int
+transaction_gc (lua_State *L)
 {
-    char *__path;
-    apteryx_schema_node *node;
-    char *name;
+    struct transaction *tx = (struct transaction *) luaL_checkudata (L, 1, "apteryx_tx");
+    if (tx->writes)
+    {
+        g_hash_table_destroy (tx->writes);
+        tx->writes = NULL;
+    }
+    return 0;
+}
 
-    /* Lookup the node */
-    __path = g_strdup_printf ("%s/%s", path, key);
-    node = apteryx_schema_lookup (api, __path);
-    if (!node)
+/* Cache the leaves below a node until told not to (or set its cache size) */
+static int
+proxy_cache (lua_State *L)
+{
+    bool enable = !lua_isboolean (L, 2) || lua_toboolean (L, 2);
+    struct state_caches *state;
+    struct value_cache *cache = NULL;
+    const char *path;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    proxy_node (L, 1, &path);
+    state = state_caches (L, true);
+    for (GList *iter = state->caches; iter && !cache; iter = g_list_next (iter))
     {
-        /* Not accessible at all */
-        g_free (__path);
-        luaL_error (L, "\'%s\' invalid", key);
-        return false;
+        if (strcmp (((struct value_cache *) iter->data)->prefix, path) == 0)
+            cache = (struct value_cache *) iter->data;
     }
 
-    /* Use the real path name */
-    name = apteryx_schema_name (node);
-    if (strcmp (name , "*") != 0)
+    DEBUG ("cache: %s %s\n", path, enable ? "on" : "off");
+
+    if (enable && !cache)
     {
-        free (__path);
-        __path = g_strdup_printf ("%s/%s", path, name);
+        cache = cache_new (path);
+        state->caches = g_list_prepend (state->caches, cache);
     }
-    free (name);
+    else if (!enable && cache)
+    {
+        /* Stop caching and drop everything */
+        state->caches = g_list_remove (state->caches, cache);
+        cache_free (cache);
+        return 0;
+    }
+    if (cache && lua_isnumber (L, 2))
+    {
+        /* A smaller bound applies straight away */
+        g_mutex_lock (&cache->lock);
+        cache->max_bytes = MAX (lua_tointeger (L, 2), 0);
+        cache_trim (cache, 0);
+        g_mutex_unlock (&cache->lock);
+    }
+    return 0;
+}
+
+/* Path template compiled against the schema of a Lua state */
+struct compiled_path
+{
+    char *template;
+    apteryx_schema_path *compiled;
+    /* Schema generation it was compiled against */
+    lua_Integer generation;
+};
+
+static int
+compiled_gc (lua_State *L)
+{
+    struct compiled_path *cp = (struct compiled_path *) luaL_checkudata (L, 1, "apteryx_path");
+    apteryx_schema_path_free (cp->compiled);
+    cp->compiled = NULL;
+    free (cp->template);
+    cp->template = NULL;
+    return 0;
+}
+
+/* Get the compiled path (compiled again if the schema has changed) */
+static apteryx_schema_path *
+compiled_path (lua_State *L)
+{
+    struct compiled_path *cp = (struct compiled_path *) luaL_checkudata (L, 1, "apteryx_path");
+    struct api_ref *ref = api_state (L, true);
+
+    if (cp->generation != ref->generation)
+    {
+        apteryx_schema_path_free (cp->compiled);
+        cp->compiled = apteryx_schema_compile (ref->schema, cp->template);
+        cp->generation = ref->generation;
+    }
+    if (!cp->compiled)
+    {
+        luaL_error (L, "\'%s\' invalid", cp->template);
+        return NULL;
+    }
+    return cp->compiled;
+}
+
+/* Build the path with each '*' replaced by the key arguments in turn */
+static char *
+compiled_build (lua_State *L, apteryx_schema_path *compiled)
+{
+    struct compiled_path *cp = (struct compiled_path *) lua_touserdata (L, 1);
+    const char *segment = cp->template;
+    const char *end;
+    GString *path;
+    int arg = 2;
+
+    /* Checked before anything is allocated as a bad key raises an error */
+    for (int i = 0; i < apteryx_schema_path_keys (compiled); i++)
+        luaL_checkstring (L, arg + i);
+    path = g_string_sized_new (64);
+    while (*segment == '/')
+    {
+        segment++;
+        end = strchrnul (segment, '/');
+        g_string_append_c (path, '/');
+        if (end - segment == 1 && *segment == '*')
+            g_string_append (path, lua_tostring (L, arg++));
+        else
+            g_string_append_len (path, segment, end - segment);
+        segment = end;
+    }
+    return g_string_free (path, false);
+}
+
+/* Read a leaf value or the subtree at the path for the given keys */
+static int
+compiled_get (lua_State *L)
+{
+    apteryx_schema_path *compiled = compiled_path (L);
+    apteryx_schema_node *node = apteryx_schema_path_node (compiled);
+    char *path = compiled_build (L, compiled);
+
+    DEBUG ("compiled get: %s\n", path);
 
-    /* For leaves we return a value - either from db, default or nil */
     if (apteryx_schema_is_leaf (node))
     {
         char *value;
 
-        /* Make sure we have access */
         if (!is_root && !apteryx_schema_is_readable (node))
         {
-            /* Not readable */
-            g_free (__path);
-            luaL_error (L, "\'%s\' not readable", key);
-            return false;
+            lua_pushfstring (L, "\'%s\' not readable", path);
+            free (path);
+            return lua_error (L);
         }
-
-        /* Get the value from Apteryx or its default */
-        value = apteryx_get (__path);
-        /* Pass back defined values if they exist in the schema */
-        value = apteryx_schema_translate_to (node, value);
-        lua_pushstring (L, value);
+        value = cache_get (L, path);
+        lua_pushstring (L, apteryx_schema_translate_to_const (node, value));
         free (value);
     }
     else
     {
-        /* Table on the stack */
-        lua_newtable (L);
-        lua_pushstring (L, "__path");
-        lua_pushstring (L, __path);
-        lua_rawset (L, -3);
-        luaL_setmetatable (L, "apteryx_mt");
+        GNode *tree = apteryx_get_tree (path);
+        push_tree (L, node, tree);
+        if (tree)
+            apteryx_free_tree (tree);
     }
-    g_free (__path);
-    return true;
+    free (path);
+    return 1;
+}
+
+/* Set the leaf at the path for the given keys (the value follows the keys) */
+static int
+compiled_set (lua_State *L)
+{
+    apteryx_schema_path *compiled = compiled_path (L);
+    apteryx_schema_node *node = apteryx_schema_path_node (compiled);
+    int arg = 2 + apteryx_schema_path_keys (compiled);
+    const char *value = lua_tostring (L, arg);
+    char *path = compiled_build (L, compiled);
+    bool success;
+
+    DEBUG ("compiled set: %s = %s\n", path, value);
+
+    /* Checked as for any other write */
+    if ((!is_root && !apteryx_schema_is_writable (node)) || !apteryx_schema_is_leaf (node))
+    {
+        lua_pushfstring (L, "\'%s\' not writable", path);
+        free (path);
+        return lua_error (L);
+    }
+    value = apteryx_schema_translate_from_const (node, value);
+    if (!apteryx_schema_validate (node, value))
+    {
+        lua_pushfstring (L, "\'%s\' invalid value", path);
+        free (path);
+        return lua_error (L);
+    }
+    success = apteryx_set (path, value);
+    cache_invalidate (path);
+    free (path);
+    lua_pushboolean (L, success);
+    return 1;
+}
+
+/* Return the keys of a path matching the template (nothing if it does not) */
+static int
+compiled_match (lua_State *L)
+{
+    apteryx_schema_path *compiled = compiled_path (L);
+    int count = apteryx_schema_path_keys (compiled);
+    apteryx_schema_key keys[count + 1];
+
+    if (!apteryx_schema_match (compiled, luaL_checkstring (L, 2), keys))
+    {
+        return 0;
+    }
+    luaL_checkstack (L, count, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        lua_pushlstring (L, keys[i].key, keys[i].len);
+    }
+    return count;
+}
+
+/* Compile a path with '*' for each list key */
+static int
+proxy_compile (lua_State *L)
+{
+    static const luaL_Reg _path_methods[] = {
+        { "get", compiled_get },
+        { "set", compiled_set },
+        { "match", compiled_match },
+        { NULL, NULL }
+    };
+    struct api_ref *ref = api_state (L, true);
+    struct compiled_path *cp;
+    const char *template;
+
+    /* Either api.compile(path) or api:compile(path) */
+    template = luaL_checkstring (L, lua_istable (L, 1) ? 2 : 1);
+    cp = (struct compiled_path *) lua_newuserdata (L, sizeof (struct compiled_path));
+    cp->template = NULL;
+    cp->compiled = NULL;
+    if (luaL_newmetatable (L, "apteryx_path"))
+    {
+        lua_pushcfunction (L, compiled_gc);
+        lua_setfield (L, -2, "__gc");
+        luaL_newlib (L, _path_methods);
+        lua_setfield (L, -2, "__index");
+    }
+    lua_setmetatable (L, -2);
+    cp->template = strdup (template);
+    cp->compiled = apteryx_schema_compile (ref->schema, template);
+    cp->generation = ref->generation;
+    if (!cp->compiled)
+    {
+        luaL_error (L, "\'%s\' invalid", template);
+        return 0;
+    }
+    return 1;
 }
 
+/* Methods of node tables - named schema nodes take precedence */
+static const luaL_Reg proxy_methods[] = {
+    { "get", proxy_get },
+    { "keys", proxy_keys },
+    { "cache", proxy_cache },
+    { NULL, NULL }
+};
+
+/* Methods of transaction root tables - root schema nodes take precedence */
+static const luaL_Reg transaction_methods[] = {
+    { "commit", transaction_commit },
+    { "cancel", transaction_cancel },
+    { NULL, NULL }
+};
+
+/* Methods of the api root table - root schema nodes take precedence */
+static const luaL_Reg api_methods[] = {
+    { "compile", proxy_compile },
+    { NULL, NULL }
+};
+
 static int
 __index (lua_State *L)
 {
+    apteryx_schema_node *parent;
+    apteryx_schema_node *node;
     const char *path;
     const char *key;
 
     /* If no API, this key does not exist! */
-    if (!api)
+    if (!api_state (L, true)->schema)
     {
         return 0;
     }
 
     /* Get stored parameters */
     luaL_checktype (L, 1, LUA_TTABLE);
-    lua_pushstring (L, "__path");
-    lua_rawget (L, 1);
-    path = lua_tostring (L, -1);
-    if (path == NULL)
-    {
-        path = "";
-    }
-    lua_pop (L, 1);
+    parent = proxy_node (L, 1, &path);
 
     /* Get passed in parameters */
     key = lua_tostring (L, 2);
@@ -148,8 +1309,24 @@ __index (lua_State *L)
 
     DEBUG ("__index: %s/%s\n", path, key);
 
+    /* Methods unless there is a node by that name */
+    node = proxy_child (L, parent, path, key);
+    if (!node || strcmp (apteryx_schema_name_const (node), "*") == 0)
+    {
+        const luaL_Reg *method = parent ? proxy_methods :
+                (proxy_transaction (L, 1) ? transaction_methods : api_methods);
+        for (; method && method->name; method++)
+        {
+            if (strcmp (key, method->name) == 0)
+            {
+                lua_pushcfunction (L, method->func);
+                return 1;
+            }
+        }
+    }
+
     /* Push the value onto the stack */
-    if (!push_node (L, api, path, key))
+    if (!push_node (L, proxy_transaction (L, 1), node, path, key))
     {
         return 0;
     }
@@ -161,27 +1338,20 @@ __index (lua_State *L)
 static int
 __newindex (lua_State *L)
 {
+    apteryx_schema_node *parent;
     const char *path;
     const char *key;
     const char *value;
-    char *name;
 
     /* If no API, this key does not exist! */
-    if (!api)
+    if (!api_state (L, true)->schema)
     {
         return 0;
     }
 
     /* Get stored parameters */
     luaL_checktype (L, 1, LUA_TTABLE);
-    lua_pushstring (L, "__path");
-    lua_rawget (L, 1);
-    path = lua_tostring (L, -1);
-    if (path == NULL)
-    {
-        path = "";
-    }
-    lua_pop (L, 1);
+    parent = proxy_node (L, 1, &path);
 
     /* Get passed in parameters */
     key = lua_tostring (L, 2);
@@ -193,57 +1363,31 @@ __newindex (lua_State *L)
 
     DEBUG ("__newindex: %s/%s = %s\n", path, key, value);
 
-    /* Validate the node */
-    char *__path = g_strdup_printf ("%s/%s", path, key);
-    apteryx_schema_node *node = apteryx_schema_lookup (api, __path);
-    if (!node || (!is_root && !apteryx_schema_is_writable (node)) || !apteryx_schema_is_leaf (node))
+    /* Set the value */
+    if (!set_node (L, proxy_transaction (L, 1), proxy_child (L, parent, path, key), path, key, value))
     {
-        /* Not accessible */
-        g_free ((gpointer) __path);
-        luaL_error (L, "\'%s\' not writable", key);
         return 0;
     }
-
-    /* Use the real path name */
-    name = apteryx_schema_name (node);
-    if (strcmp (name , "*") != 0)
-    {
-        free (__path);
-        __path = g_strdup_printf ("%s/%s", path, name);
-    }
-    free (name);
-
-    /* Translate from the schema version */
-    char *val = apteryx_schema_translate_from (node, g_strdup (value));
-    lua_pushboolean (L, apteryx_set (__path, val));
-    g_free (val);
-    g_free (__path);
     return 1;
 }
 
 static int
 __call (lua_State *L)
 {
+    apteryx_schema_node *parent;
     const char *path;
     const char *key;
     const char *value;
 
     /* If no API, this key does not exist! */
-    if (!api)
+    if (!api_state (L, true)->schema)
     {
         return 0;
     }
 
     /* Get stored parameters */
     luaL_checktype (L, 1, LUA_TTABLE);
-    lua_pushstring (L, "__path");
-    lua_rawget (L, 1);
-    path = lua_tostring (L, -1);
-    if (path == NULL)
-    {
-        path = "";
-    }
-    lua_pop (L, 1);
+    parent = proxy_node (L, 1, &path);
 
     /* Get passed in parameters */
     key = lua_tostring (L, 2);
@@ -281,37 +1425,16 @@ __call (lua_State *L)
     }
     else if (value)
     {
-        /* Validate the node */
-        char *__path = g_strdup_printf ("%s/%s", path, key);
-        apteryx_schema_node *node = apteryx_schema_lookup (api, __path);
-        if (!node || (!is_root && !apteryx_schema_is_writable (node)) || !apteryx_schema_is_leaf (node))
+        /* Set the value */
+        if (!set_node (L, proxy_transaction (L, 1), proxy_child (L, parent, path, key), path, key, value))
         {
-            /* Not accessible */
-            g_free ((gpointer) __path);
-            luaL_error (L, "\'%s\' not writable", key);
             return 0;
         }
-
-        /* Use the real path name */
-        char *name = apteryx_schema_name (node);
-        if (strcmp (name , "*") != 0)
-        {
-            free (__path);
-            __path = g_strdup_printf ("%s/%s", path, name);
-        }
-        free (name);
-
-        /* Translate from the schema version */
-        char *val = apteryx_schema_translate_from (node, g_strdup (value));
-        lua_pushboolean (L, apteryx_set (__path, val));
-        g_free (val);
-        g_free (__path);
-        return 1;
     }
     else
     {
         /* Push the node/value onto the stack */
-        if (!push_node (L, api, path, key))
+        if (!push_node (L, proxy_transaction (L, 1), proxy_child (L, parent, path, key), path, key))
         {
             return 0;
         }
@@ -331,26 +1454,56 @@ lua_apteryx_api (lua_State *L)
         { "__call", __call },
         { NULL, NULL }
     };
+    apteryx_schema_instance *schema;
     const char *path = ".";
-    if (lua_gettop (L) == 1 && lua_isstring (L, 1))
+    const char *cache = NULL;
+    bool lazy = false;
+    bool loaded;
+    if (lua_gettop (L) >= 1 && lua_isstring (L, 1))
     {
         path = lua_tostring (L, 1);
     }
-
-    /* Cleanup old one */
-    if (api)
+    if (lua_gettop (L) >= 2 && lua_isstring (L, 2))
+    {
+        cache = lua_tostring (L, 2);
+    }
+    else if (lua_gettop (L) >= 2 && lua_istable (L, 2))
     {
-        apteryx_schema_free (api);
+        lua_getfield (L, 2, "cache");
+        if (lua_isstring (L, -1))
+            cache = lua_tostring (L, -1);
+        lua_getfield (L, 2, "lazy");
+        lazy = lua_toboolean (L, -1);
+        lua_pop (L, 2);
     }
 
-    /* Parse XML files in the specified directory */
-    api = apteryx_schema_load (path);
-    if (!api)
+    /* Everything shares one handle that is never freed */
+    g_mutex_lock (&api_lock);
+    if (!api_handle)
+        g_atomic_pointer_set (&api_handle, apteryx_schema_handle_new (NULL));
+    g_mutex_unlock (&api_lock);
+
+    /* Use the compiled cache, parse roots on first use or parse just the files
+     * that have changed since the last call - the old schema is freed once no
+     * Lua state is using it */
+    if (cache || lazy)
+    {
+        schema = cache ? apteryx_schema_load_cached (path, cache) : apteryx_schema_load_lazy (path);
+        if (schema)
+            apteryx_schema_publish (api_handle, schema);
+        loaded = schema != NULL;
+    }
+    else
+    {
+        loaded = apteryx_schema_watch (api_handle, path, false);
+    }
+    if (!loaded)
     {
         /* No good */
         luaL_error (L, "Error loading: schema from \"%s\"", path);
         return 0;
     }
+    api_state (L, true);
 
     /* Create the API object */
     luaL_newmetatable (L, "apteryx_mt");
@@ -363,9 +1516,154 @@ lua_apteryx_api (lua_State *L)
     return 1;
 }
 
+static int
+lua_apteryx_transaction (lua_State *L)
+{
+    /* Transaction functions */
+    static const luaL_Reg _transaction_mt[] = {
+        { "__gc", transaction_gc },
+        { NULL, NULL }
+    };
+    struct transaction *tx;
+
+    /* If no API, there is nothing to write to! */
+    if (!api_state (L, true)->schema)
+    {
+        luaL_error (L, "No schema loaded");
+        return 0;
+    }
+
+    /* Root table that writes to the transaction */
+    lua_newtable (L);
+    lua_pushstring (L, "__path");
+    lua_pushstring (L, "");
+    lua_rawset (L, -3);
+    lua_pushstring (L, "__tx");
+    tx = (struct transaction *) lua_newuserdata (L, sizeof (struct transaction));
+    tx->writes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    if (luaL_newmetatable (L, "apteryx_tx"))
+    {
+        luaL_setfuncs (L, _transaction_mt, 0);
+    }
+    lua_setmetatable (L, -2);
+    lua_rawset (L, -3);
+    luaL_setmetatable (L, "apteryx_mt");
+    return 1;
+}
+
+/* Totals over the caches of this Lua state */
+static int
+lua_apteryx_cache_stats (lua_State *L)
+{
+    struct state_caches *state = state_caches (L, false);
+    uint64_t hits = 0, misses = 0;
+    size_t entries = 0, bytes = 0, max_bytes = 0;
+
+    for (GList *iter = state ? state->caches : NULL; iter; iter = g_list_next (iter))
+    {
+        struct value_cache *cache = (struct value_cache *) iter->data;
+        g_mutex_lock (&cache->lock);
+        hits += cache->hits;
+        misses += cache->misses;
+        entries += g_hash_table_size (cache->values);
+        bytes += cache->bytes;
+        max_bytes += cache->max_bytes;
+        g_mutex_unlock (&cache->lock);
+    }
+    lua_newtable (L);
+    lua_pushinteger (L, hits);
+    lua_setfield (L, -2, "hits");
+    lua_pushinteger (L, misses);
+    lua_setfield (L, -2, "misses");
+    lua_pushinteger (L, entries);
+    lua_setfield (L, -2, "entries");
+    lua_pushinteger (L, bytes);
+    lua_setfield (L, -2, "bytes");
+    lua_pushinteger (L, max_bytes);
+    lua_setfield (L, -2, "max_bytes");
+    return 1;
+}
+
+/* Add a histogram of latencies to the table on the top of the stack */
+static void
+push_histogram (lua_State *L, const char *name, uint64_t *buckets)
+{
+    lua_createtable (L, APTERYX_SCHEMA_STATS_BUCKETS, 0);
+    for (int i = 0; i < APTERYX_SCHEMA_STATS_BUCKETS; i++)
+    {
+        lua_pushinteger (L, buckets[i]);
+        lua_rawseti (L, -2, i + 1);
+    }
+    lua_setfield (L, -2, name);
+}
+
+static int
+lua_apteryx_stats (lua_State *L)
+{
+    apteryx_schema_stats stats;
+
+    if (!api_state (L, true)->schema)
+    {
+        luaL_error (L, "No schema loaded");
+        return 0;
+    }
+    apteryx_schema_get_stats (api_state (L, false)->schema, &stats);
+    lua_newtable (L);
+    lua_pushinteger (L, stats.load_ns);
+    lua_setfield (L, -2, "load_ns");
+    lua_pushinteger (L, stats.load_files);
+    lua_setfield (L, -2, "load_files");
+    lua_pushinteger (L, stats.load_parsed);
+    lua_setfield (L, -2, "load_parsed");
+    lua_pushboolean (L, stats.load_cached);
+    lua_setfield (L, -2, "load_cached");
+    lua_pushinteger (L, stats.lookups);
+    lua_setfield (L, -2, "lookups");
+    lua_pushinteger (L, stats.lookup_hits);
+    lua_setfield (L, -2, "lookup_hits");
+    lua_pushinteger (L, stats.lookup_misses);
+    lua_setfield (L, -2, "lookup_misses");
+    lua_pushinteger (L, stats.lookup_segments);
+    lua_setfield (L, -2, "lookup_segments");
+    lua_pushinteger (L, stats.cache_hits);
+    lua_setfield (L, -2, "cache_hits");
+    lua_pushinteger (L, stats.cache_misses);
+    lua_setfield (L, -2, "cache_misses");
+    lua_pushinteger (L, stats.translations);
+    lua_setfield (L, -2, "translations");
+    lua_pushinteger (L, stats.translation_hits);
+    lua_setfield (L, -2, "translation_hits");
+    lua_pushinteger (L, stats.translation_misses);
+    lua_setfield (L, -2, "translation_misses");
+    lua_pushinteger (L, stats.validations);
+    lua_setfield (L, -2, "validations");
+    lua_pushinteger (L, stats.validation_passes);
+    lua_setfield (L, -2, "validation_passes");
+    lua_pushinteger (L, stats.validation_failures);
+    lua_setfield (L, -2, "validation_failures");
+    push_histogram (L, "lookup_ns", stats.lookup_ns);
+    push_histogram (L, "translate_ns", stats.translate_ns);
+    push_histogram (L, "validate_ns", stats.validate_ns);
+    return 1;
+}
+
+static int
+lua_apteryx_reset_stats (lua_State *L)
+{
+    apteryx_schema_instance *schema = api_state (L, true)->schema;
+
+    if (schema)
+    {
+        apteryx_schema_reset_stats (schema);
+    }
+    return 0;
+}
+
 static int
 lua_apteryx_valid (lua_State *L)
 {
+    apteryx_schema_instance *schema;
+
     if (lua_gettop (L) != 1 || !lua_isstring (L, 1))
     {
         luaL_error (L, "Invalid arguments: requires path");
@@ -373,7 +1671,8 @@ lua_apteryx_valid (lua_State *L)
     }
 
     /* If no API, this path does not exist! */
-    if (api && apteryx_schema_lookup (api, lua_tostring (L, 1)))
+    schema = api_state (L, true)->schema;
+    if (schema && apteryx_schema_lookup (schema, lua_tostring (L, 1)))
     {
         /* All good */
         lua_pushboolean (L, true);
@@ -392,6 +1691,10 @@ luaopen_libapteryx_schema (lua_State *L)
     static const luaL_Reg _apteryx_fns[] = {
         { "debug", lua_apteryx_debug },
         { "api", lua_apteryx_api },
+        { "transaction", lua_apteryx_transaction },
+        { "cache_stats", lua_apteryx_cache_stats },
+        { "stats", lua_apteryx_stats },
+        { "reset_stats", lua_apteryx_reset_stats },
         { "valid", lua_apteryx_valid },
         { NULL, NULL }
     };
@@ -19,11 +19,20 @@
  */
 #include "internal.h"
 #include <dirent.h>
+#include <errno.h>
 #include <fnmatch.h>
+#include <poll.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include "apteryx-schema.h"
 
 /* Debug */
 bool apteryx_schema_debug = false;
+/* Number of threads used to parse files (0 for one per processor) */
+int apteryx_schema_load_threads = 0;
 
 struct apteryx_schema_model *
 model_create (char *name, char *organization, char *version)
@@ -45,19 +54,28 @@ model_destroy (struct apteryx_schema_model *model)
     free (model);
 }
 
-struct apteryx_schema_node *
+struct schema_node *
 node_create (const char *name)
 {
-    struct apteryx_schema_node *node;
-    node = calloc (1, sizeof (struct apteryx_schema_node));
-    g_strlcpy (node->name, name, 256);
+    struct schema_node *node;
+    node = calloc (1, sizeof (struct schema_node));
+    node->name = strdup (name);
     return node;
 }
 
 void
-node_destroy (struct apteryx_schema_node *node)
+node_destroy (struct schema_node *node)
 {
-    g_list_free_full (node->children, (GDestroyNotify) node_destroy);
+    struct schema_node *child, *next;
+
+    for (child = node->children; child; child = next)
+    {
+        next = child->next;
+        node_destroy (child);
+    }
+    if (node->index)
+        g_hash_table_destroy (node->index);
+    free (node->name);
     free (node->description);
     free (node->defvalue);
     free (node->value);
@@ -65,11 +83,113 @@ node_destroy (struct apteryx_schema_node *node)
     free (node);
 }
 
+void
+node_add_child (struct schema_node *parent, struct schema_node *child)
+{
+    child->next = NULL;
+    if (parent->last)
+        parent->last->next = child;
+    else
+        parent->children = child;
+    parent->last = child;
+}
+
+/* Compare a node name to a path segment treating '-' and '_' as the same */
+bool
+match_name (const char *name, const char *segment, size_t len)
+{
+    char c1, c2;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        c1 = name[i];
+        c2 = segment[i];
+        if (c1 == '\0')
+            return false;
+        if (c1 == '-')
+            c1 = '_';
+        if (c2 == '-')
+            c2 = '_';
+        if (c1 != c2)
+            return false;
+    }
+    return name[len] == '\0';
+}
+
+/* Hash a node name treating '-' and '_' as the same character */
+uint32_t
+name_hash (const char *name, size_t len)
+{
+    uint32_t hash = 5381;
+    char c;
+
+    while (len--)
+    {
+        c = *name++;
+        if (c == '-')
+            c = '_';
+        hash = (hash << 5) + hash + c;
+    }
+    return hash;
+}
+
+/* Hash an enum name or value exactly */
+uint32_t
+enum_hash (const char *str)
+{
+    uint32_t hash = 5381;
+
+    while (*str)
+        hash = (hash << 5) + hash + *str++;
+    return hash;
+}
+
+/* Parse an enum value that is an integer exactly as printed by "%d" */
+bool
+enum_integer (const char *str, int32_t *value)
+{
+    bool negative = (*str == '-');
+    const char *s = str + negative;
+    int64_t v = 0;
+
+    if (!*s || (s[0] == '0' && (s[1] || negative)))
+        return false;
+    for (; *s; s++)
+    {
+        if (*s < '0' || *s > '9' || s - str > 10)
+            return false;
+        v = v * 10 + (*s - '0');
+    }
+    v = negative ? -v : v;
+    if (v < INT32_MIN || v > INT32_MAX)
+        return false;
+    *value = (int32_t) v;
+    return true;
+}
+
+/* Check if a file name has one of the schema extensions that can be parsed */
+static bool
+is_schema_file (const char *name)
+{
+    return false
+#ifdef HAVE_LIBXML
+        || fnmatch ("*.xml", name, 0) == 0
+        || fnmatch ("*.xml.gz", name, 0) == 0
+#endif
+#ifdef HAVE_LIBYANG
+        || fnmatch ("*.yang", name, 0) == 0
+#endif
+        ;
+}
+
+/* List the schema files in each folder (or the file itself) of a ':' separated path */
 static void
 list_schema_files (GList **files, const char *path)
 {
     DIR *dp;
     struct dirent *ep;
+    struct stat st;
     char *saveptr = NULL;
     char *cpath;
     char *dpath;
@@ -84,15 +204,7 @@ list_schema_files (GList **files, const char *path)
             while ((ep = readdir (dp)))
             {
                 char *filename = NULL;
-                if (true
-#ifdef HAVE_LIBXML
-                    && fnmatch ("*.xml", ep->d_name, 0) != 0
-                    && fnmatch ("*.xml.gz", ep->d_name, 0) != 0
-#endif
-#ifdef HAVE_LIBYANG
-                    && fnmatch ("*.yang", ep->d_name, 0) != 0
-#endif
-                    )
+                if (!is_schema_file (ep->d_name))
                 {
                     continue;
                 }
@@ -103,6 +215,10 @@ list_schema_files (GList **files, const char *path)
             }
             (void) closedir (dp);
         }
+        else if (is_schema_file (dpath) && stat (dpath, &st) == 0 && S_ISREG (st.st_mode))
+        {
+            *files = g_list_append (*files, strdup (dpath));
+        }
         dpath = strtok_r (NULL, ":", &saveptr);
     }
     free (cpath);
@@ -111,94 +227,280 @@ list_schema_files (GList **files, const char *path)
 }
 
 static void
-merge_nodes (struct apteryx_schema_node *orig, struct apteryx_schema_node *new, int depth)
+merge_nodes (struct schema_node *orig, struct schema_node *new, int depth)
 {
-    apteryx_schema_node *n;
-    apteryx_schema_node *o;
-    GList *n_iter;
-    GList *o_iter;
-    GList *stolen = NULL;
+    struct schema_node *n;
+    struct schema_node *o;
+    struct schema_node *next;
+    struct schema_node *kept = NULL;
+    struct schema_node *stolen = NULL;
+    struct schema_node *last_kept = NULL;
+    struct schema_node *last_stolen = NULL;
+
+    /* Index the original children - the first of any duplicates wins */
+    if (!orig->index)
+    {
+        orig->index = g_hash_table_new (g_str_hash, g_str_equal);
+        for (o = orig->children; o; o = o->next)
+        {
+            if (!g_hash_table_contains (orig->index, o->name))
+                g_hash_table_insert (orig->index, o->name, o);
+        }
+    }
 
     /* For all the new children of this node */
-    for (n_iter = new->children; n_iter; n_iter = g_list_next (n_iter))
+    for (n = new->children; n; n = next)
     {
-        n = (struct apteryx_schema_node *) n_iter->data;
+        next = n->next;
+        n->next = NULL;
 
         /* Find a match in the original tree */
-        for (o_iter = orig->children; o_iter; o_iter = g_list_next (o_iter))
-        {
-            o = (struct apteryx_schema_node *) o_iter->data;
-            if (g_strcmp0 (n->name, o->name) == 0)
-            {
-                break;
-            }
-        }
-        if (o_iter)
+        o = (struct schema_node *) g_hash_table_lookup (orig->index, n->name);
+        if (o)
         {
             /* Matching node - merge children */
             merge_nodes (o, n, depth + 1);
+            if (last_kept)
+                last_kept->next = n;
+            else
+                kept = n;
+            last_kept = n;
         }
         else
         {
             /* Does not match - steal it */
-            stolen = g_list_append (stolen, n);
+            if (last_stolen)
+                last_stolen->next = n;
+            else
+                stolen = n;
+            last_stolen = n;
         }
     }
+    new->children = kept;
+    new->last = last_kept;
 
     /* Handle the stolen nodes */
-    for (n_iter = stolen; n_iter; n_iter = g_list_next (n_iter))
+    if (stolen)
     {
-        new->children = g_list_remove (new->children, n_iter->data);
+        for (n = stolen; n; n = n->next)
+        {
+            if (!g_hash_table_contains (orig->index, n->name))
+                g_hash_table_insert (orig->index, n->name, n);
+        }
+        if (orig->last)
+            orig->last->next = stolen;
+        else
+            orig->children = stolen;
+        orig->last = last_stolen;
     }
-    orig->children = g_list_concat (orig->children, stolen);
 
     return;
 }
 
-apteryx_schema_instance *
-apteryx_schema_load (const char *folders)
+static gint
+compare_names (struct schema_node *a, struct schema_node *b)
+{
+    return strcmp (a->name, b->name);
+}
+
+static void schema_number (apteryx_schema_instance *schema);
+
+/* Create an instance using the trees and models packed in an arena */
+static apteryx_schema_instance *
+schema_create (struct schema_arena *arena)
 {
     struct apteryx_schema_instance *schema;
-    GList *files = NULL;
-    GList *iter;
+    struct schema_arena_header *header = ARENA_HEADER (arena);
+    struct schema_arena_model *model;
 
     schema = calloc (1, sizeof (struct apteryx_schema_instance));
-    if (!schema)
+    if (!schema || !(schema->stats = stats_new ()))
     {
         ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        free (schema);
+        arena_destroy (arena);
         return NULL;
     }
-    schema->roots = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) node_destroy);
+    schema->refcount = 1;
+    schema->arena = arena;
+    arena->stats = stats_ref (schema->stats);
+    g_mutex_init (&schema->lazy_lock);
+    schema->roots = g_hash_table_new (g_str_hash, g_str_equal);
+    for (uint32_t i = 0; i < header->n_roots; i++)
+    {
+        struct apteryx_schema_node *node = ARENA_ROOT (arena, i);
+        g_hash_table_insert (schema->roots, (gpointer) NODE_STR (node, name), node);
+    }
+    model = (struct schema_arena_model *) (arena->data + header->models);
+    for (uint32_t i = 0; i < header->n_models; i++, model++)
+    {
+        schema->models = g_list_prepend (schema->models, model_create (
+                g_strdup (model->name ? arena->data + model->name : NULL),
+                g_strdup (model->organization ? arena->data + model->organization : NULL),
+                g_strdup (model->version ? arena->data + model->version : NULL)));
+    }
+    schema->models = g_list_reverse (schema->models);
+    return schema;
+}
 
-    /* Load all schema files in the path */
-    list_schema_files (&files, folders);
-    for (iter = files; iter; iter = g_list_next (iter))
+/* Add the roots of another arena to an instance (taking the reference) */
+static void
+schema_add_arena (apteryx_schema_instance *schema, struct schema_arena *arena)
+{
+    struct schema_arena_header *header = ARENA_HEADER (arena);
+
+    if (!schema->arenas)
+        schema->arenas = g_ptr_array_new_with_free_func ((GDestroyNotify) arena_destroy);
+    g_ptr_array_add (schema->arenas, arena);
+    if (!arena->stats)
+    {
+        arena->stats = stats_ref (schema->stats);
+    }
+    else
     {
-        char *filename = (char *) iter->data;
-        apteryx_schema_node *root = NULL;
-        char *name = NULL;
-        char *organization = NULL;
-        char *version = NULL;
+        /* Shared with the instance it was first added to */
+        if (!schema->stats->shared)
+            schema->stats->shared = g_hash_table_new (NULL, NULL);
+        g_hash_table_add (schema->stats->shared, arena);
+    }
+    for (uint32_t i = 0; i < header->n_roots; i++)
+    {
+        struct apteryx_schema_node *node = ARENA_ROOT (arena, i);
+        g_hash_table_insert (schema->roots, (gpointer) NODE_STR (node, name), node);
+    }
+}
 
-        DEBUG ("APTERYX_SCHEMA: Parse %s\n", filename);
+/* Result of parsing a single file */
+struct schema_file
+{
+    const char *filename;
+    struct schema_node *root;
+    char *name;
+    char *organization;
+    char *version;
+#ifdef HAVE_LIBYANG
+    const struct lys_module *module;
+#endif
+};
+
+/* Parse a single file - safe to run in parallel with other files */
+static void
+parse_file (struct schema_file *file, gpointer user_data)
+{
 #ifdef HAVE_LIBXML
-        if (fnmatch ("*.xml", filename, 0) == 0 || fnmatch ("*.xml.gz", filename, 0) == 0)
-        {
-            root = xml_schema_load (filename);
-        }
+    if (fnmatch ("*.xml", file->filename, 0) == 0 || fnmatch ("*.xml.gz", file->filename, 0) == 0)
+    {
+        DEBUG ("APTERYX_SCHEMA: Parse %s\n", file->filename);
+        file->root = xml_schema_load (file->filename);
+    }
 #endif
+}
+
 #ifdef HAVE_LIBYANG
-        if (fnmatch ("*.yang", filename, 0) == 0)
+/* Parse all the YANG modules into one context so that imports are only
+ * resolved once - libyang contexts are not thread safe */
+static void
+parse_yang_files (struct schema_file *parsed, guint count)
+{
+    struct ly_ctx *ctx = NULL;
+    guint i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (fnmatch ("*.yang", parsed[i].filename, 0) == 0)
         {
-            root = yang_schema_load (filename, &name, &organization, &version);
+            DEBUG ("APTERYX_SCHEMA: Parse %s\n", parsed[i].filename);
+            if (!ctx && !(ctx = yang_schema_context ()))
+                return;
+            parsed[i].module = yang_schema_parse (ctx, parsed[i].filename);
         }
+    }
+
+    /* Convert once every module is in the context */
+    for (i = 0; i < count; i++)
+    {
+        if (parsed[i].module)
+        {
+            parsed[i].root = yang_schema_load (parsed[i].module, &parsed[i].name,
+                    &parsed[i].organization, &parsed[i].version);
+        }
+    }
+    if (ctx)
+        yang_schema_context_free (ctx);
+}
+#endif
+
+/* Parse all the files using a thread per processor */
+static void
+parse_files (struct schema_file *parsed, guint count)
+{
+    GThreadPool *pool = NULL;
+    guint threads;
+
+    threads = apteryx_schema_load_threads > 0 ? apteryx_schema_load_threads : g_get_num_processors ();
+    if (MIN (threads, count) > 1)
+    {
+#ifdef HAVE_LIBXML
+        xml_schema_init ();
+#endif
+        pool = g_thread_pool_new ((GFunc) parse_file, NULL, MIN (threads, count), true, NULL);
+    }
+    for (guint i = 0; i < count; i++)
+    {
+        if (pool)
+            g_thread_pool_push (pool, &parsed[i], NULL);
+        else
+            parse_file (&parsed[i], NULL);
+    }
+#ifdef HAVE_LIBYANG
+    parse_yang_files (parsed, count);
 #endif
+    if (pool)
+    {
+        /* Wait for all the files to be parsed */
+        g_thread_pool_free (pool, false, true);
+    }
+}
+
+/* Parse and merge the files and pack the result into an arena */
+static struct schema_arena *
+schema_parse (GList *files)
+{
+    struct schema_arena *arena;
+    struct schema_file *parsed;
+    GHashTable *trees;
+    GList *models = NULL;
+    GList *roots;
+    GList *iter;
+    guint count = g_list_length (files);
+    guint i;
+
+    /* Parse in parallel */
+    parsed = calloc (count, sizeof (struct schema_file));
+    if (!parsed && count)
+    {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        return NULL;
+    }
+    for (iter = files, i = 0; iter; iter = g_list_next (iter), i++)
+    {
+        parsed[i].filename = (char *) iter->data;
+    }
+    parse_files (parsed, count);
+
+    /* Merge in file order so the result is the same as a serial load */
+    trees = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) node_destroy);
+    for (i = 0; i < count; i++)
+    {
+        const char *filename = parsed[i].filename;
+        struct schema_node *root = parsed[i].root;
+
         if (root)
         {
-            apteryx_schema_node *orig = NULL;
+            struct schema_node *orig = NULL;
 
             /* Check if this needs merging in */
-            orig = (struct apteryx_schema_node *) g_hash_table_lookup (schema->roots, root->name);
+            orig = (struct schema_node *) g_hash_table_lookup (trees, root->name);
             if (orig)
             {
                 /* Merge into the original tree */
@@ -209,231 +511,1792 @@ apteryx_schema_load (const char *folders)
             else
             {
                 /* Add to the hash table as a new root */
-                g_hash_table_replace (schema->roots, g_strdup (root->name), root);
+                g_hash_table_replace (trees, root->name, root);
             }
 
             /* Add to model list */
-            if (name)
-                schema->models = g_list_prepend (schema->models, model_create (name, organization, version));
+            if (parsed[i].name)
+            {
+                models = g_list_prepend (models, model_create (parsed[i].name,
+                        parsed[i].organization, parsed[i].version));
+                continue;
+            }
         }
         else
         {
             ERROR ("APTERYX-SCHEMA: Failed to parse schema from file \"%s\".\n", filename);
         }
+        free (parsed[i].name);
+        free (parsed[i].organization);
+        free (parsed[i].version);
     }
-    g_list_free_full (files, free);
+    free (parsed);
 
     /* Ensure creation order of models */
-    schema->models = g_list_reverse (schema->models);
-    return schema;
+    models = g_list_reverse (models);
+
+    /* Pack the merged trees into the arena in name order */
+    roots = g_list_sort (g_hash_table_get_values (trees), (GCompareFunc) compare_names);
+    arena = arena_create (roots, models);
+    g_list_free (roots);
+    g_list_free_full (models, (GDestroyNotify) model_destroy);
+    g_hash_table_destroy (trees);
+    return arena;
 }
 
-void
-apteryx_schema_free (apteryx_schema_instance *schema)
+apteryx_schema_instance *
+apteryx_schema_load (const char *folders)
 {
-    g_hash_table_destroy (schema->roots);
-    g_list_free_full (schema->models, (GDestroyNotify) model_destroy);
-    free (schema);
+    apteryx_schema_instance *schema;
+    struct schema_arena *arena;
+    GList *files = NULL;
+
+    uint64_t start = stats_now ();
+
+    /* Load all schema files in the path */
+    list_schema_files (&files, folders);
+    arena = schema_parse (files);
+    schema = arena ? schema_create (arena) : NULL;
+    if (schema)
+    {
+        schema_number (schema);
+        schema->stats->shards[0].stats.load_files = g_list_length (files);
+        schema->stats->shards[0].stats.load_parsed = g_list_length (files);
+        schema->stats->shards[0].stats.load_ns = stats_now () - start;
+    }
+    g_list_free_full (files, free);
+    return schema;
 }
 
-static void
-_node_dump (GString *buffer, struct apteryx_schema_node *node, int depth)
+apteryx_schema_instance *
+apteryx_schema_load_cached (const char *folders, const char *cache)
 {
+    uint64_t start = stats_now ();
+    apteryx_schema_instance *schema;
+    struct schema_arena *arena;
+    bool cached = true;
+    GArray *stats;
+    GList *files = NULL;
     GList *iter;
 
-    GString *s = g_string_new (NULL);
-    g_string_append_printf (s, "%*s%s", depth * 2, " ", node->name);
-    if (node->flags & NODE_FLAGS_ENUM)
-    {
-        g_string_append_printf (s, "[%s]", node->value);
-    }
-    else if (node->flags && (node->flags != NODE_FLAGS_LEAF))
-    {
-        g_string_append_printf (s, "[");
-        if (node->flags & NODE_FLAGS_READ)
-            g_string_append_printf (s, "r");
-        if (node->flags & NODE_FLAGS_WRITE)
-            g_string_append_printf (s, "w");
-        g_string_append_printf (s, "]");
-    }
-    if (node->description)
-    {
-        int pad = (s->len >= 32) ? 0 : (32 - s->len);
-        g_string_append_printf (s, "%*s\"%s\"", pad, " ", node->description);
-    }
-    if (node->defvalue)
+    /* Note the state of the files before anything is parsed */
+    list_schema_files (&files, folders);
+    stats = g_array_sized_new (false, true, sizeof (struct stat), g_list_length (files));
+    for (iter = files; iter; iter = g_list_next (iter))
     {
-        g_string_append_printf (s, " %s", node->defvalue);
+        struct stat st = {};
+        stat ((char *) iter->data, &st);
+        g_array_append_val (stats, st);
     }
-    if (node->pattern)
+
+    /* Use the saved arena if it is still valid */
+    arena = arena_open (cache, folders, files, stats);
+    if (!arena)
     {
-        g_string_append_printf (s, " %s", node->pattern);
+        DEBUG ("APTERYX_SCHEMA: Rebuilding \"%s\"\n", cache);
+        cached = false;
+        arena = schema_parse (files);
+        if (arena && arena_save (arena, cache, folders, files, stats))
+        {
+            /* Switch to the shared read only copy */
+            struct schema_arena *mapped = arena_open (cache, folders, files, stats);
+            if (mapped)
+            {
+                arena_destroy (arena);
+                arena = mapped;
+            }
+        }
     }
-    g_string_append_printf (s, "\n");
-    g_string_append (buffer, g_string_free (s, false));
-
-    for (iter = node->children; iter; iter = g_list_next (iter))
+    schema = arena ? schema_create (arena) : NULL;
+    if (schema)
     {
-        _node_dump (buffer, (struct apteryx_schema_node *) iter->data, depth + 1);
+        schema_number (schema);
+        schema->stats->shards[0].stats.load_files = g_list_length (files);
+        schema->stats->shards[0].stats.load_parsed = cached ? 0 : g_list_length (files);
+        schema->stats->shards[0].stats.load_cached = cached;
+        schema->stats->shards[0].stats.load_ns = stats_now () - start;
     }
+    g_array_free (stats, true);
+    g_list_free_full (files, free);
+    return schema;
 }
 
-static void
-_schema_dump (gpointer key, gpointer value, gpointer user_data)
-{
-    _node_dump ((GString *) user_data, (struct apteryx_schema_node *) value, 0);
-}
-
-void
-apteryx_schema_dump (FILE *fp, apteryx_schema_instance *schema)
-{
-    GString *s = g_string_new (NULL);
-    g_hash_table_foreach (schema->roots, _schema_dump, (gpointer) s);
-    fprintf (fp, "%s", g_string_free (s, false));
-}
-
-apteryx_schema_model*
-apteryx_schema_first_model (apteryx_schema_instance *schema)
-{
-    return schema->models ? g_list_first (schema->models)->data : NULL;
-}
-
-apteryx_schema_model*
-apteryx_schema_next_model (apteryx_schema_instance *schema, apteryx_schema_model *model)
-{
-    GList *node = g_list_find (schema->models, (gconstpointer) model);
-    node = node ? g_list_next (node) : NULL;
-    return node ? (apteryx_schema_model *)node->data : NULL;
-}
-
-const char *
-apteryx_schema_model_name (apteryx_schema_model *model)
-{
-    return model->name;
-}
-
-const char *
-apteryx_schema_model_organization (apteryx_schema_model *model)
-{
-    return model->organization;
-}
-
-const char *
-apteryx_schema_model_version (apteryx_schema_model *model)
+/* Root of a lazy load that is parsed on first use */
+struct schema_lazy_root
 {
-    return model->version;
-}
+    /* Files contributing to the root in file order */
+    GList *files;
+    /* Set once parsed */
+    gint loaded;
+    struct apteryx_schema_node *node;
+};
 
-static gboolean
-match_name (const char *s1, const char *s2)
+static void
+lazy_root_destroy (struct schema_lazy_root *root)
 {
-    char c1, c2;
-    do
-    {
-        c1 = *s1;
-        c2 = *s2;
-        if (c1 == '\0' && c2 == '\0')
-            return true;
-        if (c1 == '-')
-            c1 = '_';
-        if (c2 == '-')
-            c2 = '_';
-        s1++;
-        s2++;
-    } while (c1 == c2);
-    return false;
+    g_list_free_full (root->files, free);
+    free (root);
 }
 
-static struct apteryx_schema_node *
-lookup_node (struct apteryx_schema_node *node, const char *path, int depth)
+apteryx_schema_instance *
+apteryx_schema_load_lazy (const char *folders)
 {
-    char *key = NULL;
-    int len;
+    uint64_t start = stats_now ();
+    apteryx_schema_instance *schema = NULL;
+    struct schema_arena *arena;
+    GHashTable *lazy;
+    GList *eager = NULL;
+    GList *files = NULL;
     GList *iter;
+    char **names;
+    guint count;
+    guint i;
+    bool merged = false;
+#ifdef HAVE_LIBYANG
+    bool deviates = false;
+#endif
 
-    if (!node)
+    /* Note the root of each XML file and YANG module - everything else is parsed now */
+    list_schema_files (&files, folders);
+    count = g_list_length (files);
+    names = calloc (count + 1, sizeof (char *));
+    if (!names)
     {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        g_list_free_full (files, free);
         return NULL;
     }
-
-    if (path[0] == '/')
+    for (iter = files, i = 0; iter; iter = g_list_next (iter), i++)
     {
-        path++;
+#ifdef HAVE_LIBXML
+        if (fnmatch ("*.xml", iter->data, 0) == 0 || fnmatch ("*.xml.gz", iter->data, 0) == 0)
+            names[i] = xml_schema_root ((char *) iter->data);
+#endif
+#ifdef HAVE_LIBYANG
+        if (fnmatch ("*.yang", iter->data, 0) == 0)
+            names[i] = yang_schema_root ((char *) iter->data, &deviates);
+#endif
     }
-    key = strchr (path, '/');
-    if (key)
+#ifdef HAVE_LIBYANG
+    /* Deviations change other modules so they are all parsed together now */
+    for (iter = files, i = 0; deviates && iter; iter = g_list_next (iter), i++)
     {
-        len = key - path;
-        key = strndup (path, len);
-        path += len;
+        if (fnmatch ("*.yang", iter->data, 0) == 0)
+        {
+            free (names[i]);
+            names[i] = NULL;
+        }
+    }
+#endif
+    lazy = g_hash_table_new_full (g_str_hash, g_str_equal, free, (GDestroyNotify) lazy_root_destroy);
+    for (iter = files, i = 0; iter; iter = g_list_next (iter), i++)
+    {
+        char *name = names[i];
+        if (name)
+        {
+            struct schema_lazy_root *root = g_hash_table_lookup (lazy, name);
+            if (!root)
+            {
+                root = calloc (1, sizeof (struct schema_lazy_root));
+                g_hash_table_insert (lazy, name, root);
+            }
+            else
+            {
+                free (name);
+            }
+            root->files = g_list_append (root->files, iter->data);
+        }
+        else
+        {
+            eager = g_list_append (eager, iter->data);
+        }
+    }
+    free (names);
+    g_list_free (files);
+
+    arena = schema_parse (eager);
+    if (arena)
+    {
+        struct schema_arena_header *header = ARENA_HEADER (arena);
+
+        /* Roots that are also in the eager files are merged with them now */
+        for (uint32_t i = 0; i < header->n_roots; i++)
+        {
+            const char *name = NODE_STR (ARENA_ROOT (arena, i), name);
+            struct schema_lazy_root *root = g_hash_table_lookup (lazy, name);
+            if (root)
+            {
+                eager = g_list_concat (eager, root->files);
+                root->files = NULL;
+                g_hash_table_remove (lazy, name);
+                merged = true;
+            }
+        }
+        if (merged)
+        {
+            arena_destroy (arena);
+            eager = g_list_sort (eager, (GCompareFunc) strcasecmp);
+            arena = schema_parse (eager);
+        }
+    }
+    schema = arena ? schema_create (arena) : NULL;
+    if (schema)
+    {
+        schema->stats->shards[0].stats.load_files = count;
+        schema->stats->shards[0].stats.load_parsed = g_list_length (eager);
+        schema->stats->shards[0].stats.load_ns = stats_now () - start;
+    }
+    g_list_free_full (eager, free);
+    if (schema)
+        schema->lazy = lazy;
+    else
+        g_hash_table_destroy (lazy);
+    return schema;
+}
+
+/* Parse a lazy root on first use */
+static struct apteryx_schema_node *
+lazy_root (apteryx_schema_instance *schema, const char *name)
+{
+    struct schema_lazy_root *root = g_hash_table_lookup (schema->lazy, name);
+    struct schema_arena *arena;
+    uint64_t start;
+
+    if (!root)
+    {
+        return NULL;
+    }
+    if (g_atomic_int_get (&root->loaded))
+    {
+        return root->node;
+    }
+
+    g_mutex_lock (&schema->lazy_lock);
+    if (!root->loaded)
+    {
+        DEBUG ("APTERYX_SCHEMA: Loading \"/%s\"\n", name);
+        start = stats_now ();
+        arena = schema_parse (root->files);
+        if (arena && ARENA_HEADER (arena)->n_roots)
+        {
+            /* Not added to the roots as they are read without the lock */
+            if (!schema->arenas)
+                schema->arenas = g_ptr_array_new_with_free_func ((GDestroyNotify) arena_destroy);
+            g_ptr_array_add (schema->arenas, arena);
+            arena->stats = stats_ref (schema->stats);
+            root->node = ARENA_ROOT (arena, 0);
+        }
+        else if (arena)
+        {
+            arena_destroy (arena);
+        }
+        schema->stats->shards[0].stats.load_parsed += g_list_length (root->files);
+        schema->stats->shards[0].stats.load_ns += stats_now () - start;
+        g_atomic_int_set (&root->loaded, 1);
+    }
+    g_mutex_unlock (&schema->lazy_lock);
+    return root->node;
+}
+
+apteryx_schema_instance *
+apteryx_schema_ref (apteryx_schema_instance *schema)
+{
+    g_atomic_int_inc (&schema->refcount);
+    return schema;
+}
+
+/* Dense node IDs of an instance with the flags and parent of each */
+struct schema_ids
+{
+    /* Numbered after any instance with a lower serial */
+    uint32_t serial;
+    uint32_t count;
+    struct apteryx_schema_node **nodes;
+    uint32_t *flags;
+    uint32_t *parents;
+    /* First ID of each arena for when a later instance has moved it (watched loads) */
+    GHashTable *first;
+};
+
+static void
+ids_free (struct schema_ids *ids)
+{
+    if (ids->first)
+        g_hash_table_destroy (ids->first);
+    free (ids->nodes);
+    free (ids->flags);
+    free (ids->parents);
+    free (ids);
+}
+
+static void
+cache_free (struct schema_cache *cache)
+{
+    if (cache)
+    {
+        free (cache->slots);
+        free (cache->hands);
+        free (cache);
+    }
+}
+
+void
+apteryx_schema_free (apteryx_schema_instance *schema)
+{
+    /* Only the last reference frees the nodes */
+    if (!g_atomic_int_dec_and_test (&schema->refcount))
+    {
+        return;
+    }
+    cache_free (schema->cache);
+    g_hash_table_destroy (schema->roots);
+    if (schema->lazy)
+        g_hash_table_destroy (schema->lazy);
+    if (schema->ids)
+        ids_free (schema->ids);
+    if (schema->arenas)
+        g_ptr_array_free (schema->arenas, true);
+    g_mutex_clear (&schema->lazy_lock);
+    arena_destroy (schema->arena);
+    g_list_free_full (schema->models, (GDestroyNotify) model_destroy);
+    stats_unref (schema->stats);
+    free (schema);
+}
+
+/* Instance published for readers that can be replaced while in use */
+struct apteryx_schema_handle
+{
+    /* Held just long enough to take a reference or swap the instance */
+    GMutex lock;
+    apteryx_schema_instance *current;
+    /* Background reload (if started) */
+    GMutex reload_lock;
+    GThread *reload;
+    /* Folders being tracked for incremental updates (if any) */
+    struct schema_watch *watch;
+};
+
+/* What a background reload loads */
+struct schema_reload
+{
+    apteryx_schema_handle *handle;
+    char *folders;
+    char *cache;
+};
+
+apteryx_schema_handle *
+apteryx_schema_handle_new (apteryx_schema_instance *schema)
+{
+    apteryx_schema_handle *handle = calloc (1, sizeof (apteryx_schema_handle));
+
+    if (!handle)
+    {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        return NULL;
+    }
+    g_mutex_init (&handle->lock);
+    g_mutex_init (&handle->reload_lock);
+    handle->current = schema;
+    if (schema)
+        g_atomic_int_set (&schema->published, true);
+    return handle;
+}
+
+apteryx_schema_instance *
+apteryx_schema_acquire (apteryx_schema_handle *handle)
+{
+    apteryx_schema_instance *schema;
+
+    g_mutex_lock (&handle->lock);
+    schema = handle->current ? apteryx_schema_ref (handle->current) : NULL;
+    g_mutex_unlock (&handle->lock);
+    return schema;
+}
+
+bool
+apteryx_schema_is_current (apteryx_schema_handle *handle, apteryx_schema_instance *schema)
+{
+    /* A held reference keeps the instance (and so its address) from being reused */
+    return g_atomic_pointer_get (&handle->current) == schema;
+}
+
+void
+apteryx_schema_publish (apteryx_schema_handle *handle, apteryx_schema_instance *schema)
+{
+    apteryx_schema_instance *old;
+
+    if (schema)
+        g_atomic_int_set (&schema->published, true);
+    g_mutex_lock (&handle->lock);
+    old = handle->current;
+    g_atomic_pointer_set (&handle->current, schema);
+    g_mutex_unlock (&handle->lock);
+
+    /* Readers still using the old instance keep it alive */
+    if (old)
+        apteryx_schema_free (old);
+}
+
+static gpointer
+schema_reload (gpointer data)
+{
+    struct schema_reload *reload = (struct schema_reload *) data;
+    apteryx_schema_instance *schema;
+
+    schema = reload->cache ? apteryx_schema_load_cached (reload->folders, reload->cache) :
+            apteryx_schema_load (reload->folders);
+    if (schema)
+        apteryx_schema_publish (reload->handle, schema);
+    free (reload->folders);
+    free (reload->cache);
+    free (reload);
+    return GINT_TO_POINTER (schema != NULL);
+}
+
+/* Wait for any background reload to finish (returns false if it failed) */
+static bool
+reload_join (apteryx_schema_handle *handle)
+{
+    bool loaded = true;
+
+    if (handle->reload)
+    {
+        loaded = GPOINTER_TO_INT (g_thread_join (handle->reload));
+        handle->reload = NULL;
+    }
+    return loaded;
+}
+
+bool
+apteryx_schema_reload (apteryx_schema_handle *handle, const char *folders, const char *cache, bool wait)
+{
+    struct schema_reload *reload = calloc (1, sizeof (struct schema_reload));
+    bool loaded = false;
+
+    if (!reload)
+    {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        return false;
+    }
+    reload->handle = handle;
+    reload->folders = strdup (folders);
+    reload->cache = cache ? strdup (cache) : NULL;
+
+    /* One reload at a time so that the last one started is published last */
+    g_mutex_lock (&handle->reload_lock);
+    reload_join (handle);
+    if (wait)
+    {
+        loaded = GPOINTER_TO_INT (schema_reload (reload));
+    }
+    else
+    {
+        handle->reload = g_thread_new ("schema-reload", schema_reload, reload);
+        loaded = true;
+    }
+    g_mutex_unlock (&handle->reload_lock);
+    return loaded;
+}
+
+static void watch_stop (struct schema_watch *watch);
+
+void
+apteryx_schema_handle_free (apteryx_schema_handle *handle)
+{
+    g_mutex_lock (&handle->reload_lock);
+    reload_join (handle);
+    if (handle->watch)
+        watch_stop (handle->watch);
+    g_mutex_unlock (&handle->reload_lock);
+    if (handle->current)
+        apteryx_schema_free (handle->current);
+    g_mutex_clear (&handle->reload_lock);
+    g_mutex_clear (&handle->lock);
+    free (handle);
+}
+
+/* A schema file as last parsed for incremental updates */
+struct schema_source
+{
+    char *filename;
+    /* State of the file when it was parsed */
+    struct stat st;
+    /* Parsed tree (copied before being merged) and model */
+    struct schema_node *root;
+    char *name;
+    char *organization;
+    char *version;
+};
+
+/* Incremental update state of a handle */
+struct schema_watch
+{
+    apteryx_schema_handle *handle;
+    char *folders;
+    /* Held while updating */
+    GMutex lock;
+    /* Sources in file order */
+    GList *sources;
+    /* Arena of each root by name */
+    GHashTable *arenas;
+    /* Last instance built */
+    apteryx_schema_instance *schema;
+    /* Change notification (if running) */
+    int fd;
+    int stop[2];
+    GThread *thread;
+};
+
+/* Time for a burst of file changes to settle before updating once */
+#define WATCH_SETTLE_MS     50
+
+static void
+source_destroy (struct schema_source *source)
+{
+    if (source->root)
+        node_destroy (source->root);
+    free (source->filename);
+    free (source->name);
+    free (source->organization);
+    free (source->version);
+    free (source);
+}
+
+static bool
+source_changed (struct schema_source *source, struct stat *st)
+{
+    return source->st.st_dev != st->st_dev || source->st.st_ino != st->st_ino ||
+           source->st.st_size != st->st_size ||
+           source->st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+           source->st.st_mtim.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+static struct schema_node *
+node_copy (struct schema_node *node)
+{
+    struct schema_node *copy = node_create (node->name);
+    struct schema_node *child;
+
+    copy->flags = node->flags;
+    copy->description = g_strdup (node->description);
+    copy->defvalue = g_strdup (node->defvalue);
+    copy->value = g_strdup (node->value);
+    copy->pattern = g_strdup (node->pattern);
+    for (child = node->children; child; child = child->next)
+    {
+        node_add_child (copy, node_copy (child));
+    }
+    return copy;
+}
+
+/* Merge every source tree of a root in file order and pack it into an arena */
+static struct schema_arena *
+watch_pack (struct schema_watch *watch, const char *name)
+{
+    struct schema_node *tree = NULL;
+    struct schema_arena *arena;
+    GList *sources = NULL;
+    GList *roots;
+
+    for (GList *iter = watch->sources; iter; iter = g_list_next (iter))
+    {
+        struct schema_source *source = (struct schema_source *) iter->data;
+        if (source->root && strcmp (source->root->name, name) == 0)
+            sources = g_list_prepend (sources, source->root);
+    }
+    if (!sources)
+    {
+        return NULL;
+    }
+    sources = g_list_reverse (sources);
+
+    /* Merging takes nodes from the trees so is done on copies */
+    if (sources->next)
+    {
+        tree = node_copy ((struct schema_node *) sources->data);
+        for (GList *iter = sources->next; iter; iter = g_list_next (iter))
+        {
+            struct schema_node *copy = node_copy ((struct schema_node *) iter->data);
+            merge_nodes (tree, copy, 0);
+            node_destroy (copy);
+        }
+    }
+    roots = g_list_prepend (NULL, tree ? tree : sources->data);
+    arena = arena_create (roots, NULL);
+    g_list_free (roots);
+    g_list_free (sources);
+    if (tree)
+        node_destroy (tree);
+    return arena;
+}
+
+static void
+watch_affected (GHashTable *affected, struct schema_source *source)
+{
+    if (source->root)
+        g_hash_table_add (affected, g_strdup (source->root->name));
+}
+
+/* Parse the sources that changed since the last build and rebuild just the
+ * roots they contribute to (returns true if a new instance was built) */
+static bool
+watch_build (struct schema_watch *watch)
+{
+    uint64_t start = stats_now ();
+    GHashTable *old = g_hash_table_new (g_str_hash, g_str_equal);
+    GHashTable *affected = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    GPtrArray *changed = g_ptr_array_new ();
+    struct schema_file *parsed;
+    struct schema_arena *arena;
+    apteryx_schema_instance *schema;
+    GList *sources = NULL;
+    GList *files = NULL;
+    GList *models = NULL;
+    GList *iter;
+    GHashTableIter hiter;
+    gpointer value;
+    bool removed = false;
+    guint i;
+
+    /* Compare the files now in the folders with the last ones parsed */
+    for (iter = watch->sources; iter; iter = g_list_next (iter))
+    {
+        struct schema_source *source = (struct schema_source *) iter->data;
+        g_hash_table_insert (old, source->filename, source);
+    }
+    list_schema_files (&files, watch->folders);
+    for (iter = files; iter; iter = g_list_next (iter))
+    {
+        struct schema_source *source = g_hash_table_lookup (old, iter->data);
+        struct stat st;
+
+        if (stat ((char *) iter->data, &st) != 0)
+            continue;
+        if (source)
+        {
+            g_hash_table_remove (old, source->filename);
+            if (!source_changed (source, &st))
+            {
+                sources = g_list_prepend (sources, source);
+                continue;
+            }
+            watch_affected (affected, source);
+            source_destroy (source);
+        }
+        source = calloc (1, sizeof (struct schema_source));
+        source->filename = strdup ((char *) iter->data);
+        source->st = st;
+        sources = g_list_prepend (sources, source);
+        g_ptr_array_add (changed, source);
+    }
+    g_list_free_full (files, free);
+    sources = g_list_reverse (sources);
+
+    /* Whatever is left has been removed */
+    g_hash_table_iter_init (&hiter, old);
+    while (g_hash_table_iter_next (&hiter, NULL, &value))
+    {
+        watch_affected (affected, (struct schema_source *) value);
+        source_destroy ((struct schema_source *) value);
+        removed = true;
+    }
+    g_hash_table_destroy (old);
+    g_list_free (watch->sources);
+    watch->sources = sources;
+    if (changed->len == 0 && !removed && watch->schema)
+    {
+        g_ptr_array_free (changed, true);
+        g_hash_table_destroy (affected);
+        return false;
+    }
+
+#ifdef HAVE_LIBYANG
+    /* YANG modules are resolved against each other so are parsed together */
+    for (i = 0; i < changed->len; i++)
+    {
+        if (fnmatch ("*.yang", ((struct schema_source *) changed->pdata[i])->filename, 0) == 0)
+            break;
+    }
+    if (i < changed->len)
+    {
+        for (iter = sources; iter; iter = g_list_next (iter))
+        {
+            struct schema_source *source = (struct schema_source *) iter->data;
+            if (source->root && fnmatch ("*.yang", source->filename, 0) == 0)
+            {
+                watch_affected (affected, source);
+                node_destroy (source->root);
+                source->root = NULL;
+                free (source->name);
+                free (source->organization);
+                free (source->version);
+                source->name = source->organization = source->version = NULL;
+                g_ptr_array_add (changed, source);
+            }
+        }
+    }
+#endif
+
+    /* Parse just the changed files */
+    parsed = calloc (MAX (changed->len, 1), sizeof (struct schema_file));
+    for (i = 0; i < changed->len; i++)
+    {
+        parsed[i].filename = ((struct schema_source *) changed->pdata[i])->filename;
+    }
+    parse_files (parsed, changed->len);
+    for (i = 0; i < changed->len; i++)
+    {
+        struct schema_source *source = (struct schema_source *) changed->pdata[i];
+        source->root = parsed[i].root;
+        source->name = parsed[i].name;
+        source->organization = parsed[i].organization;
+        source->version = parsed[i].version;
+        if (!source->root)
+            ERROR ("APTERYX-SCHEMA: Failed to parse schema from file \"%s\".\n", source->filename);
+        watch_affected (affected, source);
+    }
+    free (parsed);
+
+    /* Pack again only the roots that the changes touched */
+    g_hash_table_iter_init (&hiter, affected);
+    while (g_hash_table_iter_next (&hiter, &value, NULL))
+    {
+        arena = watch_pack (watch, (char *) value);
+        if (arena)
+            g_hash_table_replace (watch->arenas, (gpointer) NODE_STR (ARENA_ROOT (arena, 0), name), arena);
+        else
+            g_hash_table_remove (watch->arenas, value);
+    }
+
+    /* New instance of the models and every root */
+    for (iter = sources; iter; iter = g_list_next (iter))
+    {
+        struct schema_source *source = (struct schema_source *) iter->data;
+        if (source->root && source->name)
+        {
+            models = g_list_prepend (models, model_create (g_strdup (source->name),
+                    g_strdup (source->organization), g_strdup (source->version)));
+        }
+    }
+    models = g_list_reverse (models);
+    arena = arena_create (NULL, models);
+    g_list_free_full (models, (GDestroyNotify) model_destroy);
+    schema = arena ? schema_create (arena) : NULL;
+    if (schema)
+    {
+        g_hash_table_iter_init (&hiter, watch->arenas);
+        while (g_hash_table_iter_next (&hiter, NULL, &value))
+            schema_add_arena (schema, arena_ref ((struct schema_arena *) value));
+        schema_number (schema);
+        schema->stats->shards[0].stats.load_files = g_list_length (sources);
+        schema->stats->shards[0].stats.load_parsed = changed->len;
+        schema->stats->shards[0].stats.load_ns = stats_now () - start;
+    }
+    DEBUG ("APTERYX_SCHEMA: Updated %u of %u files in \"%s\"\n",
+           changed->len, g_list_length (sources), watch->folders);
+    g_ptr_array_free (changed, true);
+    g_hash_table_destroy (affected);
+    if (!schema)
+    {
+        return false;
+    }
+    if (watch->schema)
+        apteryx_schema_free (watch->schema);
+    watch->schema = schema;
+    return true;
+}
+
+/* Build if needed and publish the latest instance (true if it was not current) */
+static bool
+watch_update (struct schema_watch *watch)
+{
+    bool updated;
+
+    g_mutex_lock (&watch->lock);
+    watch_build (watch);
+    updated = watch->schema && !apteryx_schema_is_current (watch->handle, watch->schema);
+    if (updated)
+        apteryx_schema_publish (watch->handle, apteryx_schema_ref (watch->schema));
+    g_mutex_unlock (&watch->lock);
+    return updated;
+}
+
+static gpointer
+watch_thread (gpointer data)
+{
+    struct schema_watch *watch = (struct schema_watch *) data;
+    struct pollfd fds[2] = { { watch->fd, POLLIN, 0 }, { watch->stop[0], POLLIN, 0 } };
+    char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+    while (true)
+    {
+        if (poll (fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        /* Let a burst of changes settle and then update once */
+        do
+        {
+            while (read (watch->fd, buffer, sizeof (buffer)) > 0);
+        } while (poll (fds, 1, WATCH_SETTLE_MS) > 0);
+        watch_update (watch);
+    }
+    return NULL;
+}
+
+/* Start notifications of changes to the folders (false if not possible) */
+static bool
+watch_notify (struct schema_watch *watch)
+{
+    char *saveptr = NULL;
+    char *folders;
+    char *folder;
+
+    watch->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0 || pipe (watch->stop) != 0)
+    {
+        ERROR ("APTERYX_SCHEMA: Failed to watch \"%s\" (%s)\n", watch->folders, strerror (errno));
+        return false;
+    }
+    folders = strdup (watch->folders);
+    for (folder = strtok_r (folders, ":", &saveptr); folder; folder = strtok_r (NULL, ":", &saveptr))
+    {
+        if (inotify_add_watch (watch->fd, folder, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE |
+                IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB) < 0)
+        {
+            DEBUG ("APTERYX_SCHEMA: Not watching \"%s\" (%s)\n", folder, strerror (errno));
+        }
+    }
+    free (folders);
+    watch->thread = g_thread_new ("schema-watch", watch_thread, watch);
+    return true;
+}
+
+static void
+watch_stop (struct schema_watch *watch)
+{
+    if (watch->thread)
+    {
+        /* Closing the pipe also wakes the thread if the write cannot be made */
+        while (write (watch->stop[1], "", 1) < 0 && errno == EINTR);
+        close (watch->stop[1]);
+        watch->stop[1] = -1;
+        g_thread_join (watch->thread);
+    }
+    if (watch->stop[0] >= 0)
+        close (watch->stop[0]);
+    if (watch->stop[1] >= 0)
+        close (watch->stop[1]);
+    if (watch->fd >= 0)
+        close (watch->fd);
+    watch->handle->watch = NULL;
+    g_list_free_full (watch->sources, (GDestroyNotify) source_destroy);
+    g_hash_table_destroy (watch->arenas);
+    if (watch->schema)
+        apteryx_schema_free (watch->schema);
+    g_mutex_clear (&watch->lock);
+    free (watch->folders);
+    free (watch);
+}
+
+bool
+apteryx_schema_watch (apteryx_schema_handle *handle, const char *folders, bool notify)
+{
+    struct schema_watch *watch;
+    bool loaded;
+
+    g_mutex_lock (&handle->reload_lock);
+    watch = handle->watch;
+    if (watch && (strcmp (watch->folders, folders) != 0 || notify != (watch->thread != NULL)))
+    {
+        watch_stop (watch);
+        watch = NULL;
+    }
+    if (!watch)
+    {
+        watch = calloc (1, sizeof (struct schema_watch));
+        watch->handle = handle;
+        watch->folders = strdup (folders);
+        watch->arenas = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) arena_destroy);
+        watch->fd = watch->stop[0] = watch->stop[1] = -1;
+        g_mutex_init (&watch->lock);
+        handle->watch = watch;
+    }
+
+    /* Bring the handle up to date before any notifications */
+    watch_update (watch);
+    loaded = watch->schema != NULL;
+    if (loaded && notify && !watch->thread && !watch_notify (watch))
+    {
+        watch_stop (watch);
+        loaded = false;
+    }
+    g_mutex_unlock (&handle->reload_lock);
+    return loaded;
+}
+
+bool
+apteryx_schema_update (apteryx_schema_handle *handle)
+{
+    bool updated = false;
+
+    g_mutex_lock (&handle->reload_lock);
+    if (handle->watch)
+        updated = watch_update (handle->watch);
+    g_mutex_unlock (&handle->reload_lock);
+    return updated;
+}
+
+/* Write one line per node (and its children down to the remaining depth) */
+static void
+node_dump_text (FILE *fp, struct apteryx_schema_node *node, int indent, int depth)
+{
+    int len = fprintf (fp, "%*s%s", indent * 2, " ", NODE_STR (node, name));
+    if (node->flags & NODE_FLAGS_ENUM)
+    {
+        len += fprintf (fp, "[%s]", NODE_STR (node, value));
+    }
+    else if (node->flags && (node->flags != NODE_FLAGS_LEAF))
+    {
+        len += fprintf (fp, "[%s%s]", (node->flags & NODE_FLAGS_READ) ? "r" : "",
+                        (node->flags & NODE_FLAGS_WRITE) ? "w" : "");
+    }
+    if (node->description)
+    {
+        int pad = (len >= 32) ? 0 : (32 - len);
+        fprintf (fp, "%*s\"%s\"", pad, " ", NODE_STR (node, description));
+    }
+    if (node->defvalue)
+    {
+        fprintf (fp, " %s", NODE_STR (node, defvalue));
+    }
+    if (node->pattern)
+    {
+        fprintf (fp, " %s", NODE_STR (node, pattern));
+    }
+    fputc ('\n', fp);
+
+    for (uint32_t i = 0; depth != 0 && i < node->n_children; i++)
+    {
+        node_dump_text (fp, NODE_CHILD (node, i), indent + 1, depth - 1);
+    }
+}
+
+/* Write a string with JSON escaping */
+static void
+dump_json_string (FILE *fp, const char *str)
+{
+    fputc ('"', fp);
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf (fp, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf (fp, "\\u%04x", *c);
+        else
+            fputc (*c, fp);
+    }
+    fputc ('"', fp);
+}
+
+static void
+dump_json_field (FILE *fp, const char *field, const char *value)
+{
+    if (value)
+    {
+        fprintf (fp, ",\"%s\":", field);
+        dump_json_string (fp, value);
+    }
+}
+
+/* Write a node as a JSON object (and its children down to the remaining depth) */
+static void
+node_dump_json (FILE *fp, struct apteryx_schema_node *node, int depth)
+{
+    fputs ("{\"name\":", fp);
+    dump_json_string (fp, NODE_STR (node, name));
+    if (node->flags & NODE_FLAGS_ENUM)
+    {
+        dump_json_field (fp, "value", NODE_STR (node, value));
+    }
+    else if (node->flags & NODE_FLAGS_LEAF)
+    {
+        fprintf (fp, ",\"mode\":\"%s%s\"", (node->flags & NODE_FLAGS_READ) ? "r" : "",
+                 (node->flags & NODE_FLAGS_WRITE) ? "w" : "");
+    }
+    dump_json_field (fp, "description", NODE_STR (node, description));
+    dump_json_field (fp, "default", NODE_STR (node, defvalue));
+    dump_json_field (fp, "pattern", NODE_STR (node, pattern));
+    if (depth != 0 && node->n_children)
+    {
+        fputs (",\"children\":[", fp);
+        for (uint32_t i = 0; i < node->n_children; i++)
+        {
+            if (i)
+                fputc (',', fp);
+            node_dump_json (fp, NODE_CHILD (node, i), depth - 1);
+        }
+        fputc (']', fp);
+    }
+    fputc ('}', fp);
+}
+
+static gint
+compare_roots (gconstpointer a, gconstpointer b)
+{
+    struct apteryx_schema_node *x = *(struct apteryx_schema_node **) a;
+    struct apteryx_schema_node *y = *(struct apteryx_schema_node **) b;
+    return strcmp (NODE_ARENA (x) + x->name, NODE_ARENA (y) + y->name);
+}
+
+/* Every root in name order (loading any lazy roots) */
+static GPtrArray *
+sorted_roots (apteryx_schema_instance *schema)
+{
+    GPtrArray *roots = g_ptr_array_new ();
+    GHashTableIter iter;
+    gpointer root;
+
+    g_hash_table_iter_init (&iter, schema->roots);
+    while (g_hash_table_iter_next (&iter, NULL, &root))
+        g_ptr_array_add (roots, root);
+    if (schema->lazy)
+    {
+        gpointer name;
+        g_hash_table_iter_init (&iter, schema->lazy);
+        while (g_hash_table_iter_next (&iter, &name, NULL))
+        {
+            if ((root = lazy_root (schema, (char *) name)))
+                g_ptr_array_add (roots, root);
+        }
+    }
+    g_ptr_array_sort (roots, compare_roots);
+    return roots;
+}
+
+bool
+apteryx_schema_dump_full (FILE *fp, apteryx_schema_instance *schema, const char *path,
+                          int depth, bool json)
+{
+    GPtrArray *roots = g_ptr_array_new ();
+    gpointer root;
+
+    /* Everything (in name order) or just one subtree */
+    if (path && path[0] && strcmp (path, "/") != 0)
+    {
+        root = apteryx_schema_lookup (schema, path);
+        if (!root)
+        {
+            g_ptr_array_free (roots, true);
+            return false;
+        }
+        g_ptr_array_add (roots, root);
+    }
+    else
+    {
+        g_ptr_array_free (roots, true);
+        roots = sorted_roots (schema);
+    }
+
+    /* Written as we go rather than buffered */
+    if (json)
+        fputc ('[', fp);
+    for (guint i = 0; i < roots->len; i++)
+    {
+        if (json)
+        {
+            if (i)
+                fputc (',', fp);
+            node_dump_json (fp, roots->pdata[i], depth);
+        }
+        else
+        {
+            node_dump_text (fp, roots->pdata[i], 0, depth);
+        }
+    }
+    if (json)
+        fputs ("]\n", fp);
+    g_ptr_array_free (roots, true);
+    return true;
+}
+
+void
+apteryx_schema_dump (FILE *fp, apteryx_schema_instance *schema)
+{
+    apteryx_schema_dump_full (fp, schema, NULL, -1, false);
+}
+
+static gint
+compare_arenas (gconstpointer a, gconstpointer b)
+{
+    struct apteryx_schema_node *x = ARENA_ROOT (*(struct schema_arena **) a, 0);
+    struct apteryx_schema_node *y = ARENA_ROOT (*(struct schema_arena **) b, 0);
+    return compare_roots (&x, &y);
+}
+
+/* First ID of the nodes of an arena in an instance */
+static inline uint32_t
+ids_first (struct schema_ids *ids, struct schema_arena *arena)
+{
+    uint64_t first = __atomic_load_n (&arena->first_id, __ATOMIC_RELAXED);
+
+    if ((first >> 32) <= ids->serial)
+        return (uint32_t) first;
+    return ids->first ? GPOINTER_TO_UINT (g_hash_table_lookup (ids->first, arena)) : 0;
+}
+
+/* Number the nodes at load - each arena numbers its own nodes from the roots
+ * in name order, so the instance only has to put its arenas in order. Not
+ * done for lazy loads as it would parse every root */
+static void
+schema_number (apteryx_schema_instance *schema)
+{
+    static gint next_serial = 0;
+    struct schema_ids *ids;
+    GPtrArray *arenas = g_ptr_array_new ();
+    uint32_t count = 0;
+    guint i;
+
+    if (ARENA_HEADER (schema->arena)->n_roots)
+        g_ptr_array_add (arenas, schema->arena);
+    for (i = 0; schema->arenas && i < schema->arenas->len; i++)
+        g_ptr_array_add (arenas, schema->arenas->pdata[i]);
+    for (i = 0; i < arenas->len; i++)
+        count += ARENA_HEADER ((struct schema_arena *) arenas->pdata[i])->n_ids;
+
+    /* Arenas of single roots are numbered one after the other by name */
+    g_ptr_array_sort (arenas, compare_arenas);
+    ids = calloc (1, sizeof (struct schema_ids));
+    ids->serial = g_atomic_int_add (&next_serial, 1);
+    ids->nodes = malloc (MAX (count, 1) * sizeof (struct apteryx_schema_node *));
+    ids->flags = malloc (MAX (count, 1) * sizeof (uint32_t));
+    ids->parents = malloc (MAX (count, 1) * sizeof (uint32_t));
+    if (arenas->len > 1)
+        ids->first = g_hash_table_new (NULL, NULL);
+    for (i = 0; i < arenas->len; i++)
+    {
+        struct schema_arena *arena = arenas->pdata[i];
+        struct schema_arena_header *header = ARENA_HEADER (arena);
+        uint32_t *local = (uint32_t *) (arena->data + header->ids);
+        struct apteryx_schema_node *node = ARENA_ROOT (arena, 0);
+        uint64_t first = __atomic_load_n (&arena->first_id, __ATOMIC_RELAXED);
+
+        /* Shared arenas keep the first ID of earlier instances while it holds */
+        if (first == UINT64_MAX || (uint32_t) first != ids->count)
+            __atomic_store_n (&arena->first_id, (uint64_t) ids->serial << 32 | ids->count, __ATOMIC_RELAXED);
+        if (ids->first)
+            g_hash_table_insert (ids->first, arena, GUINT_TO_POINTER (ids->count));
+        for (uint32_t n = 0; n < header->n_nodes; n++, node++)
+        {
+            uint32_t id = local[n];
+            if (id == APTERYX_SCHEMA_NO_ID)
+                continue;
+            id += ids->count;
+            ids->nodes[id] = node;
+            ids->flags[id] = node->flags;
+            ids->parents[id] = node->parent ?
+                    ids->count + local[NODE_INDEX (NODE_AT (node, node->parent))] : APTERYX_SCHEMA_NO_ID;
+        }
+        ids->count += header->n_ids;
+    }
+    g_ptr_array_free (arenas, true);
+    schema->ids = ids;
+}
+
+uint32_t
+apteryx_schema_node_count (apteryx_schema_instance *schema)
+{
+    return schema->ids ? schema->ids->count : 0;
+}
+
+uint32_t
+apteryx_schema_node_id (apteryx_schema_instance *schema, apteryx_schema_node *node)
+{
+    struct schema_arena_header *header;
+
+    if (!schema->ids || !node || (node->flags & NODE_FLAGS_ENUM))
+    {
+        return APTERYX_SCHEMA_NO_ID;
+    }
+    header = (struct schema_arena_header *) NODE_ARENA (node);
+    return ids_first (schema->ids, ARENA_OWNER (header)) +
+           ((uint32_t *) ((char *) header + header->ids))[NODE_INDEX (node)];
+}
+
+apteryx_schema_node *
+apteryx_schema_node_by_id (apteryx_schema_instance *schema, uint32_t id)
+{
+    return schema->ids && id < schema->ids->count ? schema->ids->nodes[id] : NULL;
+}
+
+const uint32_t *
+apteryx_schema_node_flags (apteryx_schema_instance *schema)
+{
+    return schema->ids ? schema->ids->flags : NULL;
+}
+
+const uint32_t *
+apteryx_schema_node_parents (apteryx_schema_instance *schema)
+{
+    return schema->ids ? schema->ids->parents : NULL;
+}
+
+apteryx_schema_model*
+apteryx_schema_first_model (apteryx_schema_instance *schema)
+{
+    return schema->models ? g_list_first (schema->models)->data : NULL;
+}
+
+apteryx_schema_model*
+apteryx_schema_next_model (apteryx_schema_instance *schema, apteryx_schema_model *model)
+{
+    GList *node = g_list_find (schema->models, (gconstpointer) model);
+    node = node ? g_list_next (node) : NULL;
+    return node ? (apteryx_schema_model *)node->data : NULL;
+}
+
+const char *
+apteryx_schema_model_name (apteryx_schema_model *model)
+{
+    return model->name;
+}
+
+const char *
+apteryx_schema_model_organization (apteryx_schema_model *model)
+{
+    return model->organization;
+}
+
+const char *
+apteryx_schema_model_version (apteryx_schema_model *model)
+{
+    return model->version;
+}
+
+/* Latencies are only measured for one in this many operations on each thread */
+#define STATS_SAMPLE_RATE       16
+
+uint64_t
+stats_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+/* Start timing an operation if it is sampled (0 if not) */
+uint64_t
+stats_start (void)
+{
+    static __thread uint32_t tick = 0;
+    return (++tick % STATS_SAMPLE_RATE) ? 0 : stats_now ();
+}
+
+/* Add the time since a sampled start to a histogram */
+void
+stats_finish (uint64_t *histogram, uint64_t start)
+{
+    uint64_t ns;
+    int bucket;
+
+    if (!start)
+    {
+        return;
+    }
+    ns = stats_now () - start;
+    bucket = ns ? 63 - __builtin_clzll (ns) : 0;
+    STATS_ADD (histogram[MIN (bucket, APTERYX_SCHEMA_STATS_BUCKETS - 1)], 1);
+}
+
+/* Find the child matching a path segment of the given length */
+static struct apteryx_schema_node *
+lookup_node (struct apteryx_schema_node *node, const char *segment, size_t len)
+{
+    struct apteryx_schema_node *n = NULL;
+
+    /* Named children take precedence over the wildcard */
+    if (node->index_size)
+    {
+        const uint32_t *slots = (const uint32_t *) (NODE_ARENA (node) + node->index);
+        uint32_t hash = name_hash (segment, len);
+        uint32_t mask = node->index_size - 1;
+
+        for (uint32_t i = hash & mask; slots[i]; i = (i + 1) & mask)
+        {
+            struct apteryx_schema_node *c = NODE_AT (node, slots[i]);
+            if (c->hash == hash && match_name (NODE_STR (c, name), segment, len))
+            {
+                n = c;
+                break;
+            }
+        }
+    }
+    if (!n && node->wildcard)
+        n = NODE_AT (node, node->wildcard);
+    DEBUG ("CMP: %.*s - %s\n", (int) len, segment, n ? NODE_STR (n, name) : "NO MATCH");
+    return n;
+}
+
+/* Find the root node named by the first segment of a path */
+static struct apteryx_schema_node *
+lookup_root (apteryx_schema_instance *schema, const char *segment, const char **end)
+{
+    struct apteryx_schema_node *node;
+    char key[256];
+
+    *end = strchrnul (segment, '/');
+    if (*end - segment >= sizeof (key))
+    {
+        return NULL;
+    }
+    memcpy (key, segment, *end - segment);
+    key[*end - segment] = '\0';
+    node = (struct apteryx_schema_node *) g_hash_table_lookup (schema->roots, key);
+    if (!node && schema->lazy)
+    {
+        node = lazy_root (schema, key);
+    }
+    if (!node)
+    {
+        DEBUG ("No root node for %s\n", key);
+    }
+    return node;
+}
+
+/* Find the node one segment at a time (counting the segments compared) */
+static struct apteryx_schema_node *
+lookup_segments (struct apteryx_schema_node *node, const char *end, uint64_t *segments)
+{
+    const char *segment;
+
+    while (node && *end == '/')
+    {
+        segment = end + 1;
+        end = strchrnul (segment, '/');
+        node = lookup_node (node, segment, end - segment);
+        (*segments)++;
+    }
+    return node;
+}
+
+static struct apteryx_schema_node *
+_schema_lookup (apteryx_schema_instance *schema, const char *path)
+{
+    struct apteryx_schema_node *node;
+    uint64_t segments = 1;
+    const char *end;
+
+    DEBUG ("LOOKUP: %s\n", path);
+
+    /* Segments are walked in place - no copies of the path are made */
+    if (!path || path[0] != '/')
+    {
+        return NULL;
+    }
+    node = lookup_root (schema, path + 1, &end);
+    node = lookup_segments (node, end, &segments);
+    STATS_ADD (stats_shard (schema->stats)->lookup_segments, segments);
+    return node;
+}
+
+/* Count a lookup and its sampled latency */
+static void
+lookup_stats (apteryx_schema_instance *schema, struct apteryx_schema_node *node, uint64_t start)
+{
+    apteryx_schema_stats *stats = stats_shard (schema->stats);
+
+    stats_use (schema->stats);
+    if (node)
+        STATS_ADD (stats->lookup_hits, 1);
+    else
+        STATS_ADD (stats->lookup_misses, 1);
+    stats_finish (stats->lookup_ns, start);
+}
+
+apteryx_schema_node *
+apteryx_schema_lookup_child (apteryx_schema_instance *schema, apteryx_schema_node *parent, const char *name)
+{
+    struct apteryx_schema_node *node;
+    uint64_t start = stats_start ();
+    uint64_t segments = 1;
+    const char *end;
+
+    if (!name)
+    {
+        return NULL;
+    }
+    if (parent)
+    {
+        end = strchrnul (name, '/');
+        node = lookup_node (parent, name, end - name);
     }
     else
     {
-        key = strdup (path);
-        path = NULL;
+        node = lookup_root (schema, name, &end);
+    }
+    node = lookup_segments (node, end, &segments);
+    STATS_ADD (stats_shard (schema->stats)->lookup_segments, segments);
+    lookup_stats (schema, node, start);
+    return node;
+}
+
+apteryx_schema_node *
+apteryx_schema_first_child (apteryx_schema_node *node)
+{
+    return node->n_children ? NODE_CHILD (node, 0) : NULL;
+}
+
+apteryx_schema_node *
+apteryx_schema_next_child (apteryx_schema_node *node, apteryx_schema_node *child)
+{
+    /* Children are contiguous */
+    uint32_t i = (child->self - node->children) / sizeof (struct apteryx_schema_node) + 1;
+    return i < node->n_children ? NODE_CHILD (node, i) : NULL;
+}
+
+bool
+apteryx_schema_cache_enable (apteryx_schema_instance *schema, size_t max_bytes)
+{
+    struct schema_cache *cache;
+    void *slots;
+    guint size;
+
+    /* Lookups read the cache without locks so it can not change under them */
+    if (g_atomic_int_get (&schema->refcount) > 1 || g_atomic_int_get (&schema->published))
+    {
+        ERROR ("APTERYX_SCHEMA: The cache can only be set before the instance is shared.\n");
+        return false;
+    }
+    cache_free (schema->cache);
+    schema->cache = NULL;
+    if (max_bytes == 0)
+    {
+        return true;
+    }
+
+    /* As many sets of slots and their hands as fit (at least one set) */
+    size = CACHE_WAYS;
+    while ((size_t) size * 2 * (sizeof (struct schema_cache_slot) + 1) <= max_bytes)
+        size <<= 1;
+    cache = calloc (1, sizeof (struct schema_cache));
+    if (!cache || !(cache->hands = calloc (size / CACHE_WAYS, 1)) ||
+        posix_memalign (&slots, __alignof__ (struct schema_cache_slot),
+                        size * sizeof (struct schema_cache_slot)) != 0)
+    {
+        ERROR ("APTERYX_SCHEMA: Memory allocation error.\n");
+        if (cache)
+            free (cache->hands);
+        free (cache);
+        return false;
+    }
+    memset (slots, 0, size * sizeof (struct schema_cache_slot));
+    cache->slots = (struct schema_cache_slot *) slots;
+    cache->size = size;
+    cache->max_bytes = max_bytes;
+    cache->bytes = size * (sizeof (struct schema_cache_slot) + 1);
+    schema->cache = cache;
+    return true;
+}
+
+void
+apteryx_schema_cache_stats (apteryx_schema_instance *schema, uint64_t *hits, uint64_t *misses)
+{
+    apteryx_schema_stats stats;
+
+    apteryx_schema_get_stats (schema, &stats);
+    if (hits)
+        *hits = stats.cache_hits;
+    if (misses)
+        *misses = stats.cache_misses;
+}
+
+/* Number of counters following the load details in the statistics */
+#define STATS_COUNTERS  ((sizeof (apteryx_schema_stats) - offsetof (apteryx_schema_stats, lookups)) / sizeof (uint64_t))
+
+void
+apteryx_schema_get_stats (apteryx_schema_instance *schema, apteryx_schema_stats *stats)
+{
+    uint64_t *total = &stats->lookups;
+
+    /* A snapshot summed over the shards - counters may move on while being read */
+    memcpy (stats, &schema->stats->shards[0].stats, offsetof (apteryx_schema_stats, lookups));
+    memset (total, 0, STATS_COUNTERS * sizeof (uint64_t));
+    for (int i = 0; i < STATS_SHARDS; i++)
+    {
+        uint64_t *counters = &schema->stats->shards[i].stats.lookups;
+        for (size_t j = 0; j < STATS_COUNTERS; j++)
+            total[j] += __atomic_load_n (&counters[j], __ATOMIC_RELAXED);
+    }
+
+    /* Only the outcomes are counted to keep the cost down */
+    stats->lookups = stats->lookup_hits + stats->lookup_misses;
+    stats->translations = stats->translation_hits + stats->translation_misses;
+    stats->validations = stats->validation_passes + stats->validation_failures;
+}
+
+void
+apteryx_schema_reset_stats (apteryx_schema_instance *schema)
+{
+    /* Everything but how the instance was loaded */
+    for (int i = 0; i < STATS_SHARDS; i++)
+        memset (&schema->stats->shards[i].stats.lookups, 0, STATS_COUNTERS * sizeof (uint64_t));
+}
+
+/* Pick the slot of a set to replace - an empty one or the first the CLOCK
+ * hand finds not hit since it last passed. NULL if another thread moved the
+ * hand first (it is replacing a slot of the same set) */
+static struct schema_cache_slot *
+cache_victim (struct schema_cache_slot *set, uint8_t *hand)
+{
+    uint8_t start = __atomic_load_n (hand, __ATOMIC_RELAXED);
+    uint8_t way = start;
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++)
+    {
+        if (__atomic_load_n (&set[i].seq, __ATOMIC_RELAXED) == 0)
+            return &set[i];
     }
 
-    for (iter = node->children; iter; iter = g_list_next (iter))
+    /* Every slot is given a second chance at most once */
+    for (i = 0; i < 2 * CACHE_WAYS; i++, way = (way + 1) % CACHE_WAYS)
+    {
+        if (!__atomic_load_n (&set[way].referenced, __ATOMIC_RELAXED))
+            break;
+        __atomic_store_n (&set[way].referenced, 0, __ATOMIC_RELAXED);
+    }
+    if (!__atomic_compare_exchange_n (hand, &start, (way + 1) % CACHE_WAYS, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        struct apteryx_schema_node *n = (struct apteryx_schema_node *) iter->data;
+        return NULL;
+    }
+    return &set[way];
+}
 
-        DEBUG ("%*sCMP: %s to %s", depth*2, " ", key, n->name);
+static struct apteryx_schema_node *
+cache_lookup (apteryx_schema_instance *schema, const char *path)
+{
+    struct schema_cache *cache = schema->cache;
+    struct schema_cache_slot *set;
+    struct schema_cache_slot *slot;
+    struct apteryx_schema_node *node;
+    uint32_t seq, hash;
+    size_t len;
+    guint index;
+    int i;
+
+    if (!cache || !path || (len = strlen (path)) > CACHE_SLOT_PATH)
+    {
+        return _schema_lookup (schema, path);
+    }
 
-        if (n->name && (n->name[0] == '*' ||  match_name (n->name, key)))
+    /* Results (including misses) are cached by full path */
+    hash = name_hash (path, len);
+    index = hash & (cache->size / CACHE_WAYS - 1);
+    set = &cache->slots[index * CACHE_WAYS];
+    for (i = 0; i < CACHE_WAYS; i++)
+    {
+        slot = &set[i];
+        seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq && !(seq & 1) && slot->hash == hash && slot->len == len &&
+            memcmp (slot->path, path, len) == 0)
         {
-            DEBUG(" - MATCH\n");
-            free (key);
-            if (path)
+            node = slot->node;
+            __atomic_thread_fence (__ATOMIC_ACQUIRE);
+            if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) == seq)
             {
-                return lookup_node (n, path, depth+1);
+                /* Only written when clear to keep the line shared */
+                if (!__atomic_load_n (&slot->referenced, __ATOMIC_RELAXED))
+                    __atomic_store_n (&slot->referenced, 1, __ATOMIC_RELAXED);
+                STATS_ADD (stats_shard (schema->stats)->cache_hits, 1);
+                return node;
             }
-            return n;
         }
-        DEBUG(" - NO\n");
     }
+    STATS_ADD (stats_shard (schema->stats)->cache_misses, 1);
+    node = _schema_lookup (schema, path);
 
-    free (key);
-    return NULL;
+    /* Replace the victim unless another thread is already writing it */
+    slot = cache_victim (set, &cache->hands[index]);
+    if (!slot)
+    {
+        return node;
+    }
+    seq = __atomic_load_n (&slot->seq, __ATOMIC_RELAXED);
+    if (!(seq & 1) && __atomic_compare_exchange_n (&slot->seq, &seq, seq + 1, false,
+                                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        __atomic_thread_fence (__ATOMIC_RELEASE);
+        slot->hash = hash;
+        slot->node = node;
+        slot->len = len;
+        __atomic_store_n (&slot->referenced, 0, __ATOMIC_RELAXED);
+        memcpy (slot->path, path, len);
+        __atomic_store_n (&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+    return node;
 }
 
 apteryx_schema_node *
 apteryx_schema_lookup (apteryx_schema_instance *schema, const char *path)
 {
-    struct apteryx_schema_node *root;
+    uint64_t start = stats_start ();
+    struct apteryx_schema_node *node = cache_lookup (schema, path);
+    lookup_stats (schema, node, start);
+    return node;
+}
+
+/* Segment of a compiled path */
+struct schema_path_segment
+{
+    /* Name in the template */
+    const char *name;
+    size_t len;
+    /* Matches any list key */
+    bool key;
+    /* A fixed list key compared exactly (names treat '-' and '_' the same) */
+    bool exact;
     struct apteryx_schema_node *node;
+};
 
-    DEBUG ("LOOKUP: %s\n", path);
+/* Path template compiled to the nodes it passes through */
+struct apteryx_schema_path
+{
+    apteryx_schema_instance *schema;
+    char *path;
+    int n_keys;
+    int n_segments;
+    struct schema_path_segment segments[];
+};
 
-    /* Find root node */
-    char *rpath = g_strdup (path + 1);
-    char *tmp = strchr (rpath, '/');
-    if (tmp)
-        *tmp = '\0';
+apteryx_schema_path *
+apteryx_schema_compile (apteryx_schema_instance *schema, const char *path)
+{
+    struct apteryx_schema_path *compiled;
+    struct apteryx_schema_node *node = NULL;
+    const char *root_end;
+    char *segment;
+    char *end;
+    int count = 0;
 
-    /* Find the root node */
-    root = (struct apteryx_schema_node *) g_hash_table_lookup (schema->roots, rpath);
-    if (!root)
+    if (!schema || !path || path[0] != '/')
     {
-        DEBUG ("No root node for %s\n", rpath);
-        free (rpath);
         return NULL;
     }
-
-    /* Check if we only want the root */
-    if (strlen (path) == (strlen (rpath) + 1))
+    for (const char *c = path; *c; c++)
     {
-        node = root;
+        if (*c == '/')
+            count++;
     }
-    else
+    compiled = calloc (1, sizeof (*compiled) + count * sizeof (struct schema_path_segment));
+    compiled->path = strdup (path);
+    compiled->n_segments = count;
+
+    /* Walk the template once, noting the node at each segment */
+    end = compiled->path;
+    for (int i = 0; i < count; i++)
     {
-        /* Recursively find the node */
-        node = lookup_node (root, path + strlen (rpath) + 1, 0);
+        struct schema_path_segment *s = &compiled->segments[i];
+
+        segment = end + 1;
+        end = strchrnul (segment, '/');
+        s->name = segment;
+        s->len = end - segment;
+        s->key = s->len == 1 && segment[0] == '*';
+        if (i == 0)
+            node = s->key ? NULL : lookup_root (schema, segment, &root_end);
+        else
+            node = lookup_node (node, segment, s->len);
+        if (!node || (s->key && strcmp (NODE_ARENA (node) + node->name, "*") != 0))
+        {
+            DEBUG ("COMPILE: %s - NO MATCH at %.*s\n", path, (int) s->len, segment);
+            free (compiled->path);
+            free (compiled);
+            return NULL;
+        }
+        s->node = node;
+        s->exact = !s->key && strcmp (NODE_ARENA (node) + node->name, "*") == 0;
+        if (s->key)
+            compiled->n_keys++;
+        /* Terminated for comparing names */
+        *end = '\0';
     }
+    compiled->schema = apteryx_schema_ref (schema);
+    return compiled;
+}
+
+apteryx_schema_node *
+apteryx_schema_path_node (apteryx_schema_path *compiled)
+{
+    return compiled->segments[compiled->n_segments - 1].node;
+}
+
+int
+apteryx_schema_path_keys (apteryx_schema_path *compiled)
+{
+    return compiled->n_keys;
+}
+
+apteryx_schema_node *
+apteryx_schema_match (apteryx_schema_path *compiled, const char *path, apteryx_schema_key *keys)
+{
+    struct apteryx_schema_node *node = NULL;
+    const char *end;
+    int k = 0;
 
-    free (rpath);
+    /* Literal segments are compared and keys captured in place */
+    for (int i = 0; path && i < compiled->n_segments; i++)
+    {
+        struct schema_path_segment *s = &compiled->segments[i];
+
+        if (*path != '/')
+            goto exit;
+        path++;
+        end = strchrnul (path, '/');
+        if (s->key)
+        {
+            if (end == path)
+                goto exit;
+            if (keys)
+            {
+                keys[k].key = path;
+                keys[k].len = end - path;
+            }
+            k++;
+        }
+        else if (end - path != s->len ||
+                 /* Spelt as in the template or with '-' and '_' swapped */
+                 !(memcmp (path, s->name, s->len) == 0 || (!s->exact && match_name (s->name, path, s->len))))
+        {
+            goto exit;
+        }
+        path = end;
+    }
+    if (path && *path == '\0')
+        node = compiled->segments[compiled->n_segments - 1].node;
+exit:
+    lookup_stats (compiled->schema, node, 0);
     return node;
 }
 
+void
+apteryx_schema_path_free (apteryx_schema_path *compiled)
+{
+    if (compiled)
+    {
+        apteryx_schema_free (compiled->schema);
+        free (compiled->path);
+        free (compiled);
+    }
+}
+
 bool
 apteryx_schema_is_leaf (apteryx_schema_node *node)
 {
@@ -452,28 +2315,127 @@ apteryx_schema_is_writable (apteryx_schema_node *node)
     return (node->flags & NODE_FLAGS_WRITE) == NODE_FLAGS_WRITE;
 }
 
-char *
-apteryx_schema_translate_to (apteryx_schema_node *node, char *value)
+static bool
+validate (apteryx_schema_node *node, const char *value)
 {
-    GList *iter;
+    GRegex *regex;
+
+    /* Anything matches no pattern (or an invalid one) and values can always be removed */
+    if (!node->pattern || !value)
+        return true;
+    regex = arena_pattern (node);
+    if (!regex)
+        return true;
+    return g_regex_match (regex, value, 0, NULL);
+}
+
+bool
+apteryx_schema_validate (apteryx_schema_node *node, const char *value)
+{
+    apteryx_schema_stats *stats = arena_stats (node);
+    uint64_t start = stats_start ();
+    bool valid = validate (node, value);
+
+    if (stats)
+    {
+        if (valid)
+            STATS_ADD (stats->validation_passes, 1);
+        else
+            STATS_ADD (stats->validation_failures, 1);
+        stats_finish (stats->validate_ns, start);
+    }
+    return valid;
+}
+
+/* Find the enum child of a leaf with this name or value */
+static apteryx_schema_node *
+enum_lookup (apteryx_schema_node *node, const char *str, bool by_value)
+{
+    struct schema_arena_enums *enums;
+    uint32_t *slots;
+    uint32_t mask, i;
+    int32_t v;
+
+    if (!node->enums || !str)
+    {
+        return NULL;
+    }
+    enums = (struct schema_arena_enums *) (NODE_ARENA (node) + node->enums);
+
+    /* Dense integer values are indexed directly */
+    if (by_value && enums->range)
+    {
+        if (!enum_integer (str, &v) || v < enums->min ||
+            (int64_t) v - enums->min >= enums->range)
+            return NULL;
+        i = ENUMS_INTS (enums)[v - enums->min];
+        return i ? NODE_AT (node, i) : NULL;
+    }
+
+    slots = by_value ? ENUMS_VALUES (enums) : ENUMS_NAMES (enums);
+    mask = enums->size - 1;
+    for (i = enum_hash (str) & mask; slots[i]; i = (i + 1) & mask)
+    {
+        apteryx_schema_node *n = NODE_AT (node, slots[i]);
+        if (g_strcmp0 (by_value ? NODE_STR (n, value) : NODE_STR (n, name), str) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+/* Count a translation and its sampled latency */
+static void
+translate_stats (apteryx_schema_node *node, apteryx_schema_node *n, uint64_t start)
+{
+    apteryx_schema_stats *stats = arena_stats (node);
+
+    if (stats)
+    {
+        if (n)
+            STATS_ADD (stats->translation_hits, 1);
+        else
+            STATS_ADD (stats->translation_misses, 1);
+        stats_finish (stats->translate_ns, start);
+    }
+}
+
+const char *
+apteryx_schema_translate_to_const (apteryx_schema_node *node, const char *value)
+{
+    uint64_t start = stats_start ();
+    apteryx_schema_node *n;
 
     /* Get the default if needed - untranslated */
     if (!value && node->defvalue)
     {
-        value = g_strdup (node->defvalue);
+        value = NODE_STR (node, defvalue);
     }
-    
+
     /* Find an ENUM node with this value */
-    for (iter = node->children; iter; iter = g_list_next (iter))
+    n = enum_lookup (node, value, true);
+    translate_stats (node, n, start);
+    return n ? NODE_STR (n, name) : value;
+}
+
+const char *
+apteryx_schema_translate_from_const (apteryx_schema_node *node, const char *value)
+{
+    uint64_t start = stats_start ();
+
+    /* Find an ENUM node with this name */
+    apteryx_schema_node *n = enum_lookup (node, value, false);
+    translate_stats (node, n, start);
+    return n ? NODE_STR (n, value) : value;
+}
+
+char *
+apteryx_schema_translate_to (apteryx_schema_node *node, char *value)
+{
+    const char *translated = apteryx_schema_translate_to_const (node, value);
+    if (translated != value)
     {
-        apteryx_schema_node *n = (apteryx_schema_node *) iter->data;
-        if ((n->flags & NODE_FLAGS_ENUM) == NODE_FLAGS_ENUM &&
-            g_strcmp0 (value, n->value) == 0)
-        {
-            free (value);
-            value = g_strdup (n->name);
-            break;
-        }
+        free (value);
+        value = g_strdup (translated);
     }
     return value;
 }
@@ -481,19 +2443,11 @@ apteryx_schema_translate_to (apteryx_schema_node *node, char *value)
 char *
 apteryx_schema_translate_from (apteryx_schema_node *node, char *value)
 {
-    GList *iter;
-
-    /* Find an ENUM node with this name */
-    for (iter = node->children; iter; iter = g_list_next (iter))
+    const char *translated = apteryx_schema_translate_from_const (node, value);
+    if (translated != value)
     {
-        apteryx_schema_node *n = (apteryx_schema_node *) iter->data;
-        if ((n->flags & NODE_FLAGS_ENUM) == NODE_FLAGS_ENUM &&
-            g_strcmp0 (value, n->name) == 0)
-        {
-            free (value);
-            value = g_strdup (n->value);
-            break;
-        }
+        free (value);
+        value = g_strdup (translated);
     }
     return value;
 }
@@ -501,5 +2455,11 @@ apteryx_schema_translate_from (apteryx_schema_node *node, char *value)
 char*
 apteryx_schema_name (apteryx_schema_node *node)
 {
-    return node ? g_strdup (node->name) : NULL;
+    return node ? g_strdup (NODE_STR (node, name)) : NULL;
+}
+
+const char*
+apteryx_schema_name_const (apteryx_schema_node *node)
+{
+    return node ? NODE_STR (node, name) : NULL;
 }
@@ -20,18 +20,34 @@
 #include "internal.h"
 #include <inttypes.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdarg.h>
 #include <sys/time.h>
 #ifdef HAVE_LUA
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #endif
+#ifdef HAVE_LIBXML
+#include <libxml/parser.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <apteryx.h>
 #include "apteryx-schema.h"
+#ifdef HAVE_LIBXML
+/* Generated by xml2c from the schemas in TEST_DATA */
+#include "test-schema.h"
+#endif
 
 #define TEST_APTERYX_PATH   "/test"
 #define TEST_ITERATIONS     1000
 #define TEST_SCHEMA_PATH    "."
+#ifndef TEST_DATA
+#define TEST_DATA           "testdata"
+#endif
 
 static inline uint64_t
 get_time_us (void)
@@ -41,6 +57,75 @@ get_time_us (void)
     return (tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec);
 }
 
+#ifdef __GLIBC__
+/* Count heap allocations and track heap usage while enabled */
+static bool count_allocations = false;
+static int allocations = 0;
+static ssize_t heap_bytes = 0;
+static ssize_t heap_peak = 0;
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static inline void
+heap_used (void *ptr, ssize_t sign)
+{
+    if (ptr)
+    {
+        heap_bytes += sign * (ssize_t) malloc_usable_size (ptr);
+        if (heap_bytes > heap_peak)
+            heap_peak = heap_bytes;
+    }
+}
+
+void *
+malloc (size_t size)
+{
+    void *ptr = __libc_malloc (size);
+    if (count_allocations)
+    {
+        allocations++;
+        heap_used (ptr, 1);
+    }
+    return ptr;
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc (nmemb, size);
+    if (count_allocations)
+    {
+        allocations++;
+        heap_used (ptr, 1);
+    }
+    return ptr;
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    if (count_allocations)
+    {
+        allocations++;
+        heap_used (ptr, -1);
+    }
+    ptr = __libc_realloc (ptr, size);
+    if (count_allocations)
+        heap_used (ptr, 1);
+    return ptr;
+}
+
+void
+free (void *ptr)
+{
+    if (count_allocations)
+        heap_used (ptr, -1);
+    __libc_free (ptr);
+}
+#endif /* __GLIBC__ */
+
 static bool
 assert_apteryx_empty (void)
 {
@@ -76,42 +161,13 @@ static void
 generate_xml_schemas (gpointer fixture, gconstpointer data)
 {
     FILE *schema;
+    char *contents;
+    gsize length;
 
-    schema = fopen ("./test.xml", "w");
-    if (schema)
-    {
-        fprintf (schema,
-"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-"<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
-"    xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
-"    xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
-"    https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
-"    <NODE name=\"test\" help=\"this is a test node\">\n"
-"        <NODE name=\"debug\" mode=\"rw\" default=\"0\" help=\"Debug configuration\" pattern=\"^(0|1)$\">\n"
-"            <VALUE name=\"disable\" value=\"0\" help=\"Debugging is disabled\" />\n"
-"            <VALUE name=\"enable\" value=\"1\" help=\"Debugging is enabled\" />\n"
-"        </NODE>\n"
-"        <NODE name=\"list\" help=\"this is a list of stuff\">\n"
-"            <NODE name=\"*\" help=\"the list item\">\n"
-"                <NODE name=\"name\" mode=\"rw\" help=\"this is the list key\"/>\n"
-"                <NODE name=\"type\" mode=\"rw\" default=\"1\" help=\"this is the list type\">\n"
-"                    <VALUE name=\"big\" value=\"1\"/>\n"
-"                    <VALUE name=\"little\" value=\"2\"/>\n"
-"                </NODE>\n"
-"                <NODE name=\"sub-list\" help=\"this is a list of stuff attached to a list\">\n"
-"                    <NODE name=\"*\" help=\"the sublist item\">\n"
-"                        <NODE name=\"i-d\" mode=\"rw\" help=\"this is the sublist key\"/>\n"
-"                    </NODE>\n"
-"                </NODE>\n"
-"            </NODE>\n"
-"        </NODE>\n"
-"        <NODE name=\"trivial-list\" help=\"this is a simple list of stuff\">\n"
-"            <NODE name=\"*\" help=\"the list item\" />\n"
-"        </NODE>\n"
-"    </NODE>\n"
-"</MODULE>\n");
-        fclose (schema);
-    }
+    /* Also the schema that test-schema.h is generated from */
+    g_assert_true (g_file_get_contents (TEST_DATA "/test.xml", &contents, &length, NULL));
+    g_assert_true (g_file_set_contents ("./test.xml", contents, length, NULL));
+    g_free (contents);
     schema = fopen ("./test1.xml", "w");
     if (schema)
     {
@@ -295,169 +351,2089 @@ test_api_models (gpointer fixture, gconstpointer data)
     g_assert_true (assert_apteryx_empty ());
 }
 
-#ifdef HAVE_LUA
-int luaopen_libapteryx_schema (lua_State *L);
-static bool
-_run_lua (char *script)
+static void
+test_api_lookup (gpointer fixture, gconstpointer data)
 {
-    char *buffer = strdup (script);
-    lua_State *L;
-    char *line;
-    int res = -1;
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    g_assert_nonnull (schema);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test/debug"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test/state"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test/list/cat_nip/sub_list/dog/i_d"));
+    g_assert_true (apteryx_schema_lookup (schema, "/test/trivial-list") ==
+                   apteryx_schema_lookup (schema, "/test/trivial_list"));
+    g_assert_null (apteryx_schema_lookup (schema, "/test/missing"));
+    g_assert_null (apteryx_schema_lookup (schema, "/test/debug/missing"));
+    g_assert_null (apteryx_schema_lookup (schema, "/missing"));
+    apteryx_schema_free (schema);
+}
 
-    L = luaL_newstate ();
-    luaL_openlibs (L);
-    luaopen_libapteryx_schema (L);
-    lua_setglobal (L, "apteryx");
-    line = strtok (buffer, "\n");
-    while (line != NULL)
+static void
+test_api_compile (gpointer fixture, gconstpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_path *compiled;
+    apteryx_schema_key keys[2];
+    char *shorter;
+
+    g_assert_nonnull (schema);
+    compiled = apteryx_schema_compile (schema, "/test/list/*/sub-list/*/i-d");
+    g_assert_nonnull (compiled);
+    g_assert_cmpint (apteryx_schema_path_keys (compiled), ==, 2);
+    g_assert_true (apteryx_schema_path_node (compiled) ==
+                   apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d"));
+
+    /* Keys point into the matched path */
+    g_assert_true (apteryx_schema_match (compiled, "/test/list/cat-nip/sub_list/dog/i-d", keys) ==
+                   apteryx_schema_path_node (compiled));
+    g_assert_cmpint (keys[0].len, ==, 7);
+    g_assert_true (strncmp (keys[0].key, "cat-nip", keys[0].len) == 0);
+    g_assert_cmpint (keys[1].len, ==, 3);
+    g_assert_true (strncmp (keys[1].key, "dog", keys[1].len) == 0);
+    g_assert_null (apteryx_schema_match (compiled, "/test/list/cat-nip/sub-list/dog", keys));
+    g_assert_null (apteryx_schema_match (compiled, "/test/list/cat-nip/sub-list/dog/i-d/x", keys));
+    g_assert_null (apteryx_schema_match (compiled, "/test/list//sub-list/dog/i-d", keys));
+    g_assert_null (apteryx_schema_match (compiled, "/test/lists/cat-nip/sub-list/dog/i-d", keys));
+    /* Never read past the end of a shorter path */
+    shorter = g_strdup ("/test/li");
+    g_assert_null (apteryx_schema_match (compiled, shorter, keys));
+    g_free (shorter);
+    apteryx_schema_path_free (compiled);
+
+    /* Fixed keys are matched exactly */
+    compiled = apteryx_schema_compile (schema, "/test/list/cat-nip/name");
+    g_assert_nonnull (compiled);
+    g_assert_cmpint (apteryx_schema_path_keys (compiled), ==, 0);
+    g_assert_nonnull (apteryx_schema_match (compiled, "/test/list/cat-nip/name", NULL));
+    g_assert_null (apteryx_schema_match (compiled, "/test/list/cat_nip/name", NULL));
+    apteryx_schema_path_free (compiled);
+
+    g_assert_null (apteryx_schema_compile (schema, "/test/*"));
+    g_assert_null (apteryx_schema_compile (schema, "/test/missing"));
+    g_assert_null (apteryx_schema_compile (schema, "test/debug"));
+
+    /* Holds a reference on the schema */
+    compiled = apteryx_schema_compile (schema, "/test/debug");
+    apteryx_schema_free (schema);
+    g_assert_true (apteryx_schema_validate (apteryx_schema_path_node (compiled), "1"));
+    apteryx_schema_path_free (compiled);
+}
+
+static void
+test_api_lookup_child (gpointer fixture, gconstpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_node *node;
+    g_assert_nonnull (schema);
+    node = apteryx_schema_lookup_child (schema, NULL, "test");
+    g_assert_true (node == apteryx_schema_lookup (schema, "/test"));
+    node = apteryx_schema_lookup_child (schema, node, "list");
+    g_assert_true (node == apteryx_schema_lookup (schema, "/test/list"));
+    node = apteryx_schema_lookup_child (schema, node, "cat-nip");
+    g_assert_cmpstr (apteryx_schema_name_const (node), ==, "*");
+    g_assert_true (apteryx_schema_lookup_child (schema, node, "sub_list/dog/i_d") ==
+                   apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d"));
+    g_assert_true (apteryx_schema_lookup_child (schema, NULL, "test/debug") ==
+                   apteryx_schema_lookup (schema, "/test/debug"));
+    g_assert_null (apteryx_schema_lookup_child (schema, node, "missing"));
+    g_assert_null (apteryx_schema_lookup_child (schema, NULL, "missing"));
+    int count = 0;
+    for (apteryx_schema_node *child = apteryx_schema_first_child (node); child;
+         child = apteryx_schema_next_child (node, child))
     {
-        res = luaL_loadstring (L, line);
-        if (res == 0)
-            res = lua_pcall (L, 0, 0, 0);
-        if (res != 0)
-            fprintf (stderr, "%s\n", lua_tostring(L, -1));
-        g_assert_true (res == 0);
-        line = strtok (NULL,"\n");
+        g_assert_true (apteryx_schema_lookup_child (schema, node, apteryx_schema_name_const (child)) == child);
+        count++;
     }
-    lua_close (L);
-    free (buffer);
-    return res == 0;
+    g_assert_cmpint (count, ==, 3);
+    apteryx_schema_free (schema);
 }
 
-void
-test_lua_api_parse (gpointer fixture, gconstpointer data)
+static void
+test_api_cache (gpointer fixture, gconstpointer data)
 {
-    g_assert_true (_run_lua ("api = apteryx.api('"TEST_SCHEMA_PATH"')"));
-    g_assert_true (assert_apteryx_empty ());
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_node *node;
+    uint64_t hits, misses, before;
+    g_assert_nonnull (schema);
+    node = apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d");
+    g_assert_true (apteryx_schema_cache_enable (schema, 4096));
+    g_assert_true (apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d") == node);
+    g_assert_true (apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d") == node);
+    g_assert_null (apteryx_schema_lookup (schema, "/test/missing"));
+    g_assert_null (apteryx_schema_lookup (schema, "/test/missing"));
+    apteryx_schema_cache_stats (schema, &hits, &misses);
+    g_assert_cmpuint (hits, ==, 2);
+    g_assert_cmpuint (misses, ==, 2);
+    for (int i = 0; i < 1000; i++)
+    {
+        char *path = g_strdup_printf ("/test/list/%d/sub-list/%d/i-d", i, i);
+        g_assert_true (apteryx_schema_lookup (schema, path) == node);
+        g_assert_true (schema->cache->bytes <= 4096);
+        g_free (path);
+    }
+
+    /* A path hit between misses is not evicted by them */
+    apteryx_schema_cache_stats (schema, &before, NULL);
+    for (int i = 0; i < 1000; i++)
+    {
+        char *path = g_strdup_printf ("/test/list/%d/sub-list/cold/i-d", i);
+        g_assert_true (apteryx_schema_lookup (schema, path) == node);
+        g_assert_true (apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d") == node);
+        g_free (path);
+    }
+    apteryx_schema_cache_stats (schema, &hits, NULL);
+    g_assert_cmpuint (hits - before, >=, 999);
+    g_assert_true (apteryx_schema_cache_enable (schema, 0));
+    g_assert_true (apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d") == node);
+
+    /* Not once other threads may be looking up */
+    apteryx_schema_ref (schema);
+    g_assert_false (apteryx_schema_cache_enable (schema, 4096));
+    apteryx_schema_free (schema);
+    apteryx_schema_free (schema);
 }
 
-void
-test_lua_api_set_get (gpointer fixture, gconstpointer data)
+static char *
+dump_schema (apteryx_schema_instance *schema)
 {
-    g_assert_true (_run_lua (
-        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
-        "api.test.debug = 'enable'                                        \n"
-        "assert(api.test.debug == 'enable')                               \n"
-        "api.test.debug = nil                                             \n"
-        "assert(api.test.debug == 'disable')                              \n"
-    ));
-    g_assert_true (assert_apteryx_empty ());
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream (&buffer, &size);
+    apteryx_schema_dump (fp, schema);
+    fclose (fp);
+    return buffer;
 }
 
-void
-test_lua_api_list (gpointer fixture, gconstpointer data)
+static void
+test_api_stats (gpointer fixture, gconstpointer data)
 {
-    g_assert_true (_run_lua (
-        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
-        "api.test.list('cat-nip').sub_list('dog').i_d = '1'               \n"
-        "assert(api.test.list('cat-nip').sub_list('dog').i_d == '1')      \n"
-        "api.test.list('cat-nip').sub_list('dog').i_d = nil               \n"
-        "assert(api.test.list('cat-nip').sub_list('dog').i_d == nil)      \n"
-    ));
-    g_assert_true (assert_apteryx_empty ());
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_stats stats;
+    apteryx_schema_node *node;
+    uint64_t sampled = 0;
+
+    g_assert_nonnull (schema);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_files, >, 0);
+    g_assert_false (stats.load_cached);
+
+    apteryx_schema_reset_stats (schema);
+    for (int i = 0; i < 32; i++)
+    {
+        node = apteryx_schema_lookup (schema, "/test/debug");
+        g_assert_null (apteryx_schema_lookup (schema, "/test/missing"));
+        g_assert_cmpstr (apteryx_schema_translate_to_const (node, "1"), ==, "enable");
+        g_assert_cmpstr (apteryx_schema_translate_from_const (node, "2"), ==, "2");
+        g_assert_false (apteryx_schema_validate (node, "2"));
+    }
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.lookups, ==, 64);
+    g_assert_cmpint (stats.lookup_hits, ==, 32);
+    g_assert_cmpint (stats.lookup_misses, ==, 32);
+    g_assert_cmpint (stats.lookup_segments, ==, 128);
+    g_assert_cmpint (stats.translations, ==, 64);
+    g_assert_cmpint (stats.translation_hits, ==, 32);
+    g_assert_cmpint (stats.validations, ==, 32);
+    g_assert_cmpint (stats.validation_failures, ==, 32);
+    for (int i = 0; i < APTERYX_SCHEMA_STATS_BUCKETS; i++)
+        sampled += stats.lookup_ns[i] + stats.translate_ns[i] + stats.validate_ns[i];
+    g_assert_cmpint (sampled, >, 0);
+
+    apteryx_schema_reset_stats (schema);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.lookups, ==, 0);
+    g_assert_cmpint (stats.validations, ==, 0);
+    g_assert_cmpint (stats.load_files, >, 0);
+    apteryx_schema_free (schema);
 }
 
-void
-test_lua_api_trivial_list (gpointer fixture, gconstpointer data)
+static void
+test_api_reload (gpointer fixture, gconstpointer data)
 {
-    g_assert_true (_run_lua (
-        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
-        "api.test.trivial_list('cat-nip', 'cat-nip')                      \n"
-        "assert(api.test.trivial_list('cat-nip') == 'cat-nip')            \n"
-        "api.test.trivial_list('cat-nip', nil)                            \n"
-        "assert(api.test.trivial_list('cat-nip') == nil)                  \n"
-    ));
-    g_assert_true (assert_apteryx_empty ());
+    apteryx_schema_handle *handle;
+    apteryx_schema_instance *old;
+    apteryx_schema_instance *schema;
+    apteryx_schema_node *node;
+
+    handle = apteryx_schema_handle_new (apteryx_schema_load (TEST_SCHEMA_PATH));
+    g_assert_nonnull (handle);
+    old = apteryx_schema_acquire (handle);
+    g_assert_true (apteryx_schema_is_current (handle, old));
+    node = apteryx_schema_lookup (old, "/test/debug");
+    g_assert_nonnull (node);
+
+    /* Readers keep using the old instance after a reload */
+    g_assert_true (apteryx_schema_reload (handle, TEST_SCHEMA_PATH, NULL, true));
+    g_assert_false (apteryx_schema_is_current (handle, old));
+    g_assert_true (apteryx_schema_lookup (old, "/test/debug") == node);
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "1"), ==, "enable");
+    apteryx_schema_free (old);
+
+    schema = apteryx_schema_acquire (handle);
+    g_assert_true (apteryx_schema_is_current (handle, schema));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test/debug"));
+    apteryx_schema_free (schema);
+
+    /* A background reload is finished before the handle is freed */
+    g_assert_true (apteryx_schema_reload (handle, TEST_SCHEMA_PATH, NULL, false));
+    apteryx_schema_handle_free (handle);
 }
 
-void
-test_lua_api_search (gpointer fixture, gconstpointer data)
+static void
+test_api_dump (gpointer fixture, gconstpointer data)
 {
-    g_assert_true (_run_lua (
-        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
-        "api.test.list('cat-nip').sub_list('dog').i_d = '1'               \n"
-        "api.test.list('cat-nip').sub_list('cat').i_d = '2'               \n"
-        "api.test.list('cat-nip').sub_list('mouse').i_d = '3'             \n"
-        "api.test.list('cat_nip').sub_list('bat').i_d = '4'               \n"
-        "api.test.list('cat_nip').sub_list('frog').i_d = '5'              \n"
-        "api.test.list('cat_nip').sub_list('horse').i_d = '6'             \n"
-        "cats1 = api.test.list('cat-nip').sub_list()                      \n"
-        "assert(#cats1 == 3)                                              \n"
-        "cats2 = api.test.list('cat_nip').sub_list()                      \n"
-        "assert(#cats2 == 3)                                              \n"
-        "api.test.list('cat-nip').sub_list('dog').i_d = nil               \n"
-        "api.test.list('cat-nip').sub_list('cat').i_d = nil               \n"
-        "api.test.list('cat-nip').sub_list('mouse').i_d = nil             \n"
-        "api.test.list('cat_nip').sub_list('bat').i_d = nil               \n"
-        "api.test.list('cat_nip').sub_list('frog').i_d = nil              \n"
-        "api.test.list('cat_nip').sub_list('horse').i_d = nil             \n"
-    ));
-    g_assert_true (assert_apteryx_empty ());
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *fp;
+
+    g_assert_nonnull (schema);
+
+    /* Subtree limited to its direct children */
+    fp = open_memstream (&buffer, &size);
+    g_assert_true (apteryx_schema_dump_full (fp, schema, "/test/list", 1, false));
+    fclose (fp);
+    g_assert_cmpstr (buffer, ==,
+                     " list                           \"this is a list of stuff\"\n"
+                     "  *                             \"the list item\"\n");
+    free (buffer);
+
+    /* JSON */
+    fp = open_memstream (&buffer, &size);
+    g_assert_true (apteryx_schema_dump_full (fp, schema, "/test/debug", -1, true));
+    fclose (fp);
+    g_assert_cmpstr (buffer, ==,
+                     "[{\"name\":\"debug\",\"mode\":\"rw\",\"description\":\"Debug configuration\","
+                     "\"default\":\"0\",\"pattern\":\"^(0|1)$\",\"children\":["
+                     "{\"name\":\"disable\",\"value\":\"0\",\"description\":\"Debugging is disabled\"},"
+                     "{\"name\":\"enable\",\"value\":\"1\",\"description\":\"Debugging is enabled\"}]}]\n");
+    free (buffer);
+
+    /* Everything matches the plain dump */
+    fp = open_memstream (&buffer, &size);
+    g_assert_true (apteryx_schema_dump_full (fp, schema, NULL, -1, false));
+    fclose (fp);
+    char *expected = dump_schema (schema);
+    g_assert_cmpstr (buffer, ==, expected);
+    free (expected);
+    free (buffer);
+
+    g_assert_false (apteryx_schema_dump_full (stdout, schema, "/test/missing", -1, false));
+    apteryx_schema_free (schema);
 }
 
-void
-test_lua_load_api_memory (gpointer fixture, gconstpointer data)
+static int
+count_models (apteryx_schema_instance *schema)
 {
-    lua_State *L;
-    unsigned long before;
-    unsigned long after;
-    int res = -1;
+    apteryx_schema_model *model;
+    int count = 0;
+    for (model = apteryx_schema_first_model (schema); model; model = apteryx_schema_next_model (schema, model))
+        count++;
+    return count;
+}
 
-    before = _memory_usage ();
-    L = luaL_newstate ();
-    luaL_openlibs (L);
-    luaopen_libapteryx_schema (L);
-    lua_setglobal (L, "apteryx");
-    res = luaL_loadstring (L, "apteryx.api('"TEST_SCHEMA_PATH"')");
-    if (res == 0)
-        res = lua_pcall (L, 0, 0, 0);
-    if (res != 0)
-        fprintf (stderr, "%s\n", lua_tostring(L, -1));
-    after = _memory_usage ();
-    lua_close (L);
-    printf ("%ldkb ... ", (after - before));
-    g_assert_true (res == 0);
+static void
+test_api_load_cached (gpointer fixture, gconstpointer data)
+{
+    const char *cache = "./test.cache";
+    struct timeval times[2] = {{ 1, 0 }, { 1, 0 }};
+    apteryx_schema_instance *schema;
+    struct stat before, after;
+    char *expected;
+    char *dump;
+    int models;
+
+    unlink (cache);
+    schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    g_assert_nonnull (schema);
+    expected = dump_schema (schema);
+    models = count_models (schema);
+    apteryx_schema_free (schema);
+
+    /* Built and saved */
+    schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+    g_assert_nonnull (schema);
+    g_assert_nonnull (schema->arena->map);
+    g_assert_true (stat (cache, &before) == 0);
+    dump = dump_schema (schema);
+    g_assert_cmpstr (dump, ==, expected);
+    free (dump);
+    apteryx_schema_free (schema);
+
+    /* Reused */
+    schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+    g_assert_nonnull (schema);
+    g_assert_nonnull (schema->arena->map);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d"));
+    g_assert_cmpint (count_models (schema), ==, models);
+    g_assert_true (stat (cache, &after) == 0);
+    g_assert_true (before.st_ino == after.st_ino);
+    apteryx_schema_free (schema);
+
+    /* Rebuilt when a source changes */
+    utimes ("./test.xml", times);
+    utimes ("./test.yang", times);
+    schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+    g_assert_nonnull (schema);
+    g_assert_true (stat (cache, &after) == 0);
+    g_assert_true (before.st_ino != after.st_ino);
+    dump = dump_schema (schema);
+    g_assert_cmpstr (dump, ==, expected);
+    free (dump);
+    apteryx_schema_free (schema);
+
+    free (expected);
+    unlink (cache);
 }
 
-void
-test_lua_load_api_performance (gpointer fixture, gconstpointer data)
+/* Cache files with any word changed or cut short are rebuilt or still safe to use */
+static void
+test_api_load_cached_corrupt (gpointer fixture, gconstpointer data)
 {
-    uint64_t start;
-    int i;
+    const char *cache = "./test.cache";
+    apteryx_schema_instance *schema;
+    apteryx_schema_stats stats;
+    char *expected;
+    char *contents;
+    char *dump;
+    gsize length;
+    int rejected = 0;
+    FILE *null;
 
-    start = get_time_us ();
-    for (i = 0; i < 10; i++)
+    unlink (cache);
+    schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+    g_assert_nonnull (schema);
+    expected = dump_schema (schema);
+    apteryx_schema_free (schema);
+    g_assert_true (g_file_get_contents (cache, &contents, &length, NULL));
+    null = fopen ("/dev/null", "w");
+
+    for (gsize offset = 0; offset + sizeof (uint32_t) <= length; offset += sizeof (uint32_t))
     {
-        g_assert_true (_run_lua ("apteryx.api('"TEST_SCHEMA_PATH"')"));
+        for (int pass = 0; pass < 3; pass++)
+        {
+            uint32_t *word = (uint32_t *) (contents + offset);
+            uint32_t saved = *word;
+            apteryx_schema_node *node;
+
+            /* Far out, a little out, or the file cut short */
+            *word = pass == 0 ? saved ^ 0x40000000 : saved + 4;
+            g_assert_true (g_file_set_contents (cache, contents, pass == 2 ? offset : length, NULL));
+            *word = saved;
+
+            schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+            g_assert_nonnull (schema);
+            apteryx_schema_get_stats (schema, &stats);
+            if (!stats.load_cached)
+            {
+                rejected++;
+                dump = dump_schema (schema);
+                g_assert_cmpstr (dump, ==, expected);
+                free (dump);
+            }
+            apteryx_schema_dump_full (null, schema, NULL, -1, true);
+            node = apteryx_schema_lookup (schema, "/test/debug");
+            if (node)
+            {
+                apteryx_schema_translate_to_const (node, "enable");
+                apteryx_schema_translate_from_const (node, "1");
+                apteryx_schema_validate (node, "1");
+            }
+            apteryx_schema_lookup (schema, "/test/list/cat-nip/sub-list/dog/i-d");
+            for (uint32_t id = 0; id < apteryx_schema_node_count (schema); id++)
+                g_assert_cmpint (apteryx_schema_node_id (schema, apteryx_schema_node_by_id (schema, id)), ==, id);
+            apteryx_schema_free (schema);
+        }
     }
-    printf ("%"PRIu64"us ... ", (get_time_us () - start) / 10);
-    g_assert_true (assert_apteryx_empty ());
+    g_assert_cmpint (rejected, >, 0);
+
+    fclose (null);
+    g_free (contents);
+    free (expected);
+    unlink (cache);
 }
 
-void
-test_lua_api_perf_get (gpointer fixture, gconstpointer data)
+static void
+test_api_translate (gpointer fixture, gconstpointer data)
 {
-    lua_State *L;
-    uint64_t start;
-    int i;
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_node *node;
+    const char *value = "7";
+    char *translated;
 
-    for (i = 0; i < TEST_ITERATIONS; i++)
-    {
-        char *path = NULL;
-        g_assert_true (asprintf(&path, TEST_APTERYX_PATH"/list/%d/name", i) > 0);
-        apteryx_set (path, "private");
-        free (path);
-    }
-    L = luaL_newstate ();
-    luaL_openlibs (L);
-    luaopen_libapteryx_schema (L);
-    lua_setglobal (L, "apteryx");
-    g_assert_true (luaL_loadstring (L, "api = apteryx.api('"TEST_SCHEMA_PATH"')") == 0);
-    g_assert_true (lua_pcall (L, 0, 0, 0) == 0);
-    start = get_time_us ();
-    for (i = 0; i < TEST_ITERATIONS; i++)
-    {
+    g_assert_nonnull (schema);
+    node = apteryx_schema_lookup (schema, "/test/debug");
+    g_assert_nonnull (node);
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "1"), ==, "enable");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, NULL), ==, "disable");
+    g_assert_true (apteryx_schema_translate_to_const (node, value) == value);
+    g_assert_cmpstr (apteryx_schema_translate_from_const (node, "enable"), ==, "1");
+    g_assert_true (apteryx_schema_translate_from_const (node, value) == value);
+    translated = apteryx_schema_translate_to (node, g_strdup ("0"));
+    g_assert_cmpstr (translated, ==, "disable");
+    translated = apteryx_schema_translate_from (node, translated);
+    g_assert_cmpstr (translated, ==, "0");
+    free (translated);
+    node = apteryx_schema_lookup (schema, "/test/list/cat/type");
+    g_assert_nonnull (node);
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "2"), ==, "little");
+    g_assert_cmpstr (apteryx_schema_translate_from_const (node, "big"), ==, "1");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "02"), ==, "02");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "-1"), ==, "-1");
+    apteryx_schema_free (schema);
+}
+
+#ifdef HAVE_LIBXML
+static void
+test_api_translate_sparse (gpointer fixture, gconstpointer data)
+{
+    char *folder = g_dir_make_tmp ("apteryx-schema-XXXXXX", NULL);
+    char *filename = g_strdup_printf ("%s/enum.xml", folder);
+    apteryx_schema_instance *schema;
+    apteryx_schema_node *node;
+
+    g_assert_true (g_file_set_contents (filename,
+            "<MODULE><NODE name=\"enum\">"
+            "<NODE name=\"colour\" mode=\"rw\"><VALUE name=\"red\" value=\"r\"/>"
+            "<VALUE name=\"green\" value=\"g\"/><VALUE name=\"blue\" value=\"g\"/></NODE>"
+            "<NODE name=\"sparse\" mode=\"rw\"><VALUE name=\"low\" value=\"-5\"/>"
+            "<VALUE name=\"high\" value=\"100000\"/></NODE>"
+            "</NODE></MODULE>", -1, NULL));
+    schema = apteryx_schema_load (folder);
+    g_assert_nonnull (schema);
+    node = apteryx_schema_lookup (schema, "/enum/colour");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "r"), ==, "red");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "g"), ==, "green");
+    g_assert_cmpstr (apteryx_schema_translate_from_const (node, "blue"), ==, "g");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "b"), ==, "b");
+    node = apteryx_schema_lookup (schema, "/enum/sparse");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "-5"), ==, "low");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "100000"), ==, "high");
+    g_assert_cmpstr (apteryx_schema_translate_to_const (node, "7"), ==, "7");
+    apteryx_schema_free (schema);
+    unlink (filename);
+    rmdir (folder);
+    g_free (filename);
+    g_free (folder);
+}
+#endif
+
+#ifdef __GLIBC__
+static void
+test_api_lookup_allocations (gpointer fixture, gconstpointer data)
+{
+    const char *paths[] = {
+        "/test",
+        "/test/debug",
+        "/test/list/cat-nip/sub-list/dog/i-d",
+        "/test/list/cat_nip/sub_list/dog/i_d",
+        "/test/list/cat-nip/missing/dog/i-d",
+        "/test/missing",
+        "/missing",
+    };
+    bool debug = apteryx_schema_debug;
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    g_assert_nonnull (schema);
+    apteryx_schema_debug = false;
+    allocations = 0;
+    count_allocations = true;
+    for (int i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+        apteryx_schema_node *node = apteryx_schema_lookup (schema, paths[i]);
+        if (node)
+        {
+            apteryx_schema_translate_to_const (node, "1");
+            apteryx_schema_translate_from_const (node, "enable");
+        }
+    }
+    count_allocations = false;
+    apteryx_schema_debug = debug;
+    g_assert_cmpint (allocations, ==, 0);
+    apteryx_schema_free (schema);
+}
+#endif /* __GLIBC__ */
+
+static void
+test_api_perf_cache (gpointer fixture, gconstpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    char *paths[TEST_ITERATIONS];
+    uint64_t start;
+    int i, pass;
+
+    g_assert_nonnull (schema);
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        paths[i] = g_strdup_printf ("/test/list/%d/sub-list/%d/i-d", i % 100, i);
+    }
+    for (pass = 0; pass < 2; pass++)
+    {
+        /* Second pass is cached and warm */
+        if (pass)
+        {
+            g_assert_true (apteryx_schema_cache_enable (schema, 256 * 1024));
+            for (i = 0; i < TEST_ITERATIONS; i++)
+                apteryx_schema_lookup (schema, paths[i]);
+        }
+        start = get_time_us ();
+        for (i = 0; i < TEST_ITERATIONS; i++)
+        {
+            if (!apteryx_schema_lookup (schema, paths[i]))
+                break;
+        }
+        printf ("%s:%.3fus ", pass ? "cached" : "uncached",
+                (double) (get_time_us () - start) / TEST_ITERATIONS);
+        g_assert_true (i == TEST_ITERATIONS);
+    }
+    printf ("... ");
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        g_free (paths[i]);
+    }
+    apteryx_schema_free (schema);
+}
+
+static void
+test_api_perf_load_cached (gpointer fixture, gconstpointer data)
+{
+    const char *cache = "./test.cache";
+    apteryx_schema_instance *schema;
+    uint64_t start;
+    int i;
+
+    start = get_time_us ();
+    for (i = 0; i < 10; i++)
+    {
+        schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+        g_assert_nonnull (schema);
+        apteryx_schema_free (schema);
+    }
+    printf ("parse:%"PRIu64"us ", (get_time_us () - start) / 10);
+    unlink (cache);
+    schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+    g_assert_nonnull (schema);
+    apteryx_schema_free (schema);
+    start = get_time_us ();
+    for (i = 0; i < 10; i++)
+    {
+        schema = apteryx_schema_load_cached (TEST_SCHEMA_PATH, cache);
+        g_assert_nonnull (schema);
+        apteryx_schema_free (schema);
+    }
+    printf ("cached:%"PRIu64"us ... ", (get_time_us () - start) / 10);
+    unlink (cache);
+}
+
+/* Generated schema files are written to their own temporary folder */
+static char *
+schema_folder_new (void)
+{
+    char *folder = g_dir_make_tmp ("apteryx-schema-XXXXXX", NULL);
+    g_assert_nonnull (folder);
+    return folder;
+}
+
+static void __attribute__ ((format (printf, 3, 4)))
+schema_folder_add (const char *folder, const char *name, const char *format, ...)
+{
+    char *filename = g_strdup_printf ("%s/%s", folder, name);
+    FILE *schema = fopen (filename, "w");
+    va_list args;
+
+    g_assert_nonnull (schema);
+    va_start (args, format);
+    vfprintf (schema, format, args);
+    va_end (args);
+    fclose (schema);
+    g_free (filename);
+}
+
+/* Remove a generated folder and everything written to it */
+static void
+schema_folder_free (char *folder)
+{
+    DIR *dp = opendir (folder);
+    struct dirent *ep;
+
+    g_assert_nonnull (dp);
+    while ((ep = readdir (dp)))
+    {
+        if (ep->d_name[0] != '.')
+        {
+            char *filename = g_strdup_printf ("%s/%s", folder, ep->d_name);
+            unlink (filename);
+            g_free (filename);
+        }
+    }
+    closedir (dp);
+    rmdir (folder);
+    g_free (folder);
+}
+
+#ifdef HAVE_LIBXML
+static char *
+generate_fanout_schema (int fanout)
+{
+    char *folder = schema_folder_new ();
+    GString *children = g_string_new (NULL);
+
+    for (int i = 0; i < fanout; i++)
+    {
+        g_string_append_printf (children, "<NODE name=\"child-%d\" mode=\"rw\"/>\n", i);
+    }
+    schema_folder_add (folder, "fanout.xml", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<MODULE>\n<NODE name=\"fanout\">\n%s</NODE>\n</MODULE>\n", children->str);
+    g_string_free (children, true);
+    return folder;
+}
+
+/* Files of nodes with two enum values each - pairs of files share a root */
+static char *
+generate_module_schemas (int files, int nodes)
+{
+    char *folder = schema_folder_new ();
+
+    for (int f = 0; f < files; f++)
+    {
+        GString *children = g_string_new (NULL);
+        char *name = g_strdup_printf ("module-%03d.xml", f);
+        for (int i = 0; i < nodes; i++)
+        {
+            g_string_append_printf (children, "<NODE name=\"child-%d-%d\" mode=\"rw\" help=\"child %d\" default=\"0\">\n"
+                                    "<VALUE name=\"off\" value=\"0\"/><VALUE name=\"on\" value=\"1\"/>\n"
+                                    "</NODE>\n", f, i, i);
+        }
+        schema_folder_add (folder, name, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n"
+                           "<NODE name=\"module-%d\" help=\"module %d\">\n%s</NODE>\n</MODULE>\n",
+                           f % (files / 2 + 1), f, children->str);
+        g_string_free (children, true);
+        g_free (name);
+    }
+    return folder;
+}
+
+/* Check a handle matches a full load of its folder */
+static void
+assert_watch_current (apteryx_schema_handle *handle, const char *folder, uint32_t parsed)
+{
+    apteryx_schema_instance *schema = apteryx_schema_acquire (handle);
+    apteryx_schema_instance *full = apteryx_schema_load (folder);
+    apteryx_schema_stats stats;
+    char *expected = dump_schema (full);
+    char *dump = dump_schema (schema);
+
+    g_assert_cmpstr (dump, ==, expected);
+    g_assert_cmpint (count_models (schema), ==, count_models (full));
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, parsed);
+    free (dump);
+    free (expected);
+    apteryx_schema_free (full);
+    apteryx_schema_free (schema);
+}
+
+static void
+test_api_watch (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (8, 10);
+    char *filename = g_strdup_printf ("%s/module-002.xml", folder);
+    apteryx_schema_handle *handle = apteryx_schema_handle_new (NULL);
+    apteryx_schema_instance *previous;
+    apteryx_schema_instance *schema;
+    apteryx_schema_node *node;
+    apteryx_schema_stats stats;
+    FILE *fp;
+
+    g_assert_true (apteryx_schema_watch (handle, folder, false));
+    assert_watch_current (handle, folder, 8);
+    g_assert_false (apteryx_schema_update (handle));
+
+    /* Only the changed file is parsed again (module-002 and module-007 merge into /module-2) */
+    fp = fopen (filename, "w");
+    g_assert_nonnull (fp);
+    fprintf (fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n"
+             "<NODE name=\"module-2\"><NODE name=\"extra\" mode=\"rw\"/></NODE>\n</MODULE>\n");
+    fclose (fp);
+    g_assert_true (apteryx_schema_update (handle));
+    assert_watch_current (handle, folder, 1);
+    schema = apteryx_schema_acquire (handle);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-2/extra"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-2/child-7-0"));
+    g_assert_null (apteryx_schema_lookup (schema, "/module-2/child-2-0"));
+    apteryx_schema_free (schema);
+
+    /* Removed files take their nodes with them */
+    previous = apteryx_schema_acquire (handle);
+    unlink (filename);
+    g_assert_true (apteryx_schema_update (handle));
+    assert_watch_current (handle, folder, 0);
+    schema = apteryx_schema_acquire (handle);
+    g_assert_null (apteryx_schema_lookup (schema, "/module-2/extra"));
+
+    /* Roots that did not change are shared but count for the instance looked up in */
+    node = apteryx_schema_lookup (previous, "/module-3/child-3-0");
+    g_assert_true (apteryx_schema_validate (node, "1"));
+    apteryx_schema_get_stats (previous, &stats);
+    g_assert_cmpint (stats.validations, ==, 1);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.validations, ==, 0);
+    g_assert_true (apteryx_schema_lookup (schema, "/module-3/child-3-0") == node);
+    g_assert_true (apteryx_schema_validate (node, "1"));
+    g_assert_true (apteryx_schema_validate (node, "1"));
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.validations, ==, 2);
+    apteryx_schema_get_stats (previous, &stats);
+    g_assert_cmpint (stats.validations, ==, 1);
+    apteryx_schema_free (previous);
+    apteryx_schema_free (schema);
+
+    apteryx_schema_handle_free (handle);
+    g_free (filename);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_watch_notify (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (4, 10);
+    char *filename = g_strdup_printf ("%s/module-001.xml", folder);
+    apteryx_schema_handle *handle = apteryx_schema_handle_new (NULL);
+    apteryx_schema_instance *schema;
+    FILE *fp;
+    int i;
+
+    g_assert_true (apteryx_schema_watch (handle, folder, true));
+    schema = apteryx_schema_acquire (handle);
+    g_assert_null (apteryx_schema_lookup (schema, "/module-1/extra"));
+
+    /* The change is picked up without being asked */
+    fp = fopen (filename, "w");
+    g_assert_nonnull (fp);
+    fprintf (fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n"
+             "<NODE name=\"module-1\"><NODE name=\"extra\" mode=\"rw\"/></NODE>\n</MODULE>\n");
+    fclose (fp);
+    for (i = 0; i < 200 && apteryx_schema_is_current (handle, schema); i++)
+    {
+        usleep (10000);
+    }
+    g_assert_false (apteryx_schema_is_current (handle, schema));
+    apteryx_schema_free (schema);
+    assert_watch_current (handle, folder, 1);
+
+    apteryx_schema_handle_free (handle);
+    g_free (filename);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_load_file (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (4, 10);
+    char *files = g_strdup_printf ("%s/module-000.xml:%s/module-003.xml", folder, folder);
+    apteryx_schema_instance *schema = apteryx_schema_load (files);
+
+    /* Only the files given (module-003 merges with module-000 into /module-0) */
+    g_assert_nonnull (schema);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-0/child-0-0"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-0/child-3-0"));
+    g_assert_null (apteryx_schema_lookup (schema, "/module-1"));
+    apteryx_schema_free (schema);
+    g_free (files);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_node_ids (gpointer fixture, gconstpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_node *node;
+    const uint32_t *flags;
+    const uint32_t *parents;
+    uint32_t count;
+
+    g_assert_nonnull (schema);
+    count = apteryx_schema_node_count (schema);
+    flags = apteryx_schema_node_flags (schema);
+    parents = apteryx_schema_node_parents (schema);
+    g_assert_cmpint (count, >, 0);
+    g_assert_true (apteryx_schema_node_by_id (schema, 0) == apteryx_schema_lookup (schema, "/test"));
+    g_assert_cmpint (parents[0], ==, APTERYX_SCHEMA_NO_ID);
+    for (uint32_t id = 0; id < count; id++)
+    {
+        node = apteryx_schema_node_by_id (schema, id);
+        g_assert_nonnull (node);
+        g_assert_cmpint (apteryx_schema_node_id (schema, node), ==, id);
+        g_assert_cmpint (!!(flags[id] & APTERYX_SCHEMA_FLAG_LEAF), ==, apteryx_schema_is_leaf (node));
+        g_assert_cmpint (!!(flags[id] & APTERYX_SCHEMA_FLAG_WRITE), ==, apteryx_schema_is_writable (node));
+        if (parents[id] != APTERYX_SCHEMA_NO_ID)
+        {
+            /* Parents come first */
+            g_assert_cmpint (parents[id], <, id);
+            g_assert_true (apteryx_schema_lookup_child (schema, apteryx_schema_node_by_id (schema, parents[id]),
+                                                        apteryx_schema_name_const (node)) == node);
+        }
+    }
+    g_assert_null (apteryx_schema_node_by_id (schema, count));
+
+    /* Enum values are not numbered */
+    node = apteryx_schema_lookup (schema, "/test/debug");
+    g_assert_cmpint (apteryx_schema_node_id (schema, apteryx_schema_first_child (node)), ==, APTERYX_SCHEMA_NO_ID);
+    apteryx_schema_free (schema);
+}
+
+/* Every node has the same ID as in a full load */
+static void
+assert_same_ids (apteryx_schema_instance *schema, apteryx_schema_instance *full)
+{
+    uint32_t count = apteryx_schema_node_count (full);
+
+    g_assert_cmpint (apteryx_schema_node_count (schema), ==, count);
+    for (uint32_t id = 0; id < count; id++)
+    {
+        g_assert_cmpstr (apteryx_schema_name_const (apteryx_schema_node_by_id (schema, id)), ==,
+                         apteryx_schema_name_const (apteryx_schema_node_by_id (full, id)));
+        g_assert_cmpint (apteryx_schema_node_parents (schema)[id], ==, apteryx_schema_node_parents (full)[id]);
+        g_assert_cmpint (apteryx_schema_node_flags (schema)[id], ==, apteryx_schema_node_flags (full)[id]);
+    }
+}
+
+static void
+test_api_node_ids_stable (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (8, 10);
+    apteryx_schema_handle *handle = apteryx_schema_handle_new (NULL);
+    char *filename = g_strdup_printf ("%s/module-001.xml", folder);
+    apteryx_schema_instance *full = apteryx_schema_load (folder);
+    apteryx_schema_instance *previous;
+    apteryx_schema_instance *schema;
+    apteryx_schema_node *node;
+    uint32_t id;
+    FILE *fp;
+
+    /* The same whether the roots are packed together or apart */
+    g_assert_true (apteryx_schema_watch (handle, folder, false));
+    schema = apteryx_schema_acquire (handle);
+    assert_same_ids (schema, full);
+    apteryx_schema_free (schema);
+
+    /* A root changing size moves the roots after it but not in earlier instances */
+    previous = apteryx_schema_acquire (handle);
+    node = apteryx_schema_lookup (previous, "/module-3/child-3-0");
+    id = apteryx_schema_node_id (previous, node);
+    fp = fopen (filename, "w");
+    g_assert_nonnull (fp);
+    fprintf (fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n"
+             "<NODE name=\"module-1\"><NODE name=\"extra\" mode=\"rw\"/></NODE>\n</MODULE>\n");
+    fclose (fp);
+    g_assert_true (apteryx_schema_update (handle));
+    schema = apteryx_schema_acquire (handle);
+    g_assert_true (apteryx_schema_lookup (schema, "/module-3/child-3-0") == node);
+    apteryx_schema_free (full);
+    full = apteryx_schema_load (folder);
+    assert_same_ids (schema, full);
+    g_assert_cmpint (apteryx_schema_node_id (schema, node), !=, id);
+    g_assert_cmpint (apteryx_schema_node_id (schema, node), ==,
+                     apteryx_schema_node_id (full, apteryx_schema_lookup (full, "/module-3/child-3-0")));
+    g_assert_true (apteryx_schema_node_by_id (schema, apteryx_schema_node_id (schema, node)) == node);
+    g_assert_cmpint (apteryx_schema_node_id (previous, node), ==, id);
+    apteryx_schema_free (previous);
+    apteryx_schema_free (schema);
+
+    /* Lazy loads are not numbered */
+    schema = apteryx_schema_load_lazy (folder);
+    g_assert_cmpint (apteryx_schema_node_count (schema), ==, 0);
+    g_assert_cmpint (apteryx_schema_node_id (schema, apteryx_schema_lookup (schema, "/module-2/child-7-0")), ==,
+                     APTERYX_SCHEMA_NO_ID);
+    g_assert_null (apteryx_schema_node_by_id (schema, 0));
+    apteryx_schema_free (schema);
+
+    apteryx_schema_free (full);
+    apteryx_schema_handle_free (handle);
+    g_free (filename);
+    schema_folder_free (folder);
+}
+
+/* The header xml2c generated from the test data at build time agrees with the library */
+static void
+test_api_xml2c (gpointer fixture, gconstpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_DATA);
+    apteryx_schema_node *node;
+    apteryx_schema_node *child;
+    char path[64];
+
+    g_assert_nonnull (schema);
+    g_assert_cmpint (apteryx_schema_node_count (schema), ==, GEN_NODE_COUNT);
+    for (uint32_t id = 0; id < GEN_NODE_COUNT; id++)
+    {
+        int enums = 0;
+
+        /* The table holds the path macros by ID */
+        node = apteryx_schema_lookup (schema, gen_nodes[id].path);
+        g_assert_nonnull (node);
+        g_assert_cmpint (apteryx_schema_node_id (schema, node), ==, id);
+        g_assert_cmpint ((uint32_t) gen_nodes[id].parent, ==, apteryx_schema_node_parents (schema)[id]);
+        g_assert_cmpstr (gen_nodes[id].defvalue, ==, NODE_STR (node, defvalue));
+        g_assert_cmpstr (gen_nodes[id].pattern, ==, NODE_STR (node, pattern));
+
+        /* Every enum name and value both ways */
+        for (child = apteryx_schema_first_child (node); child; child = apteryx_schema_next_child (node, child))
+        {
+            const char *name = NODE_STR (child, name);
+            const char *value = NODE_STR (child, value);
+
+            if (!(child->flags & NODE_FLAGS_ENUM))
+                continue;
+            enums++;
+            g_assert_cmpstr (gen_translate_from (id, name), ==, apteryx_schema_translate_from_const (node, name));
+            g_assert_cmpstr (gen_translate_to (id, value), ==, apteryx_schema_translate_to_const (node, value));
+            g_assert_true (gen_enum_valid (id, value));
+        }
+        g_assert_true ((gen_nodes[id].enums != NULL) == (enums > 0));
+
+        /* Anything else passes through and NULL is the default */
+        g_assert_cmpstr (gen_translate_from (id, "bogus"), ==, apteryx_schema_translate_from_const (node, "bogus"));
+        g_assert_cmpstr (gen_translate_to (id, "bogus"), ==, apteryx_schema_translate_to_const (node, "bogus"));
+        g_assert_cmpstr (gen_translate_to (id, NULL), ==, apteryx_schema_translate_to_const (node, NULL));
+        g_assert_true (gen_enum_valid (id, "bogus") == (enums == 0));
+    }
+
+    /* The macros name the same nodes */
+    g_assert_cmpint (TEST_DEBUG_ID, ==, apteryx_schema_node_id (schema, apteryx_schema_lookup (schema, TEST_DEBUG)));
+    g_assert_cmpint (ENUMS_MONTH_ID, ==, apteryx_schema_node_id (schema, apteryx_schema_lookup (schema, ENUMS_MONTH)));
+    test_list_sub_list_i_d_path (path, sizeof (path), "cat-nip", "dog");
+    g_assert_cmpstr (path, ==, "/test/list/cat-nip/sub-list/dog/i-d");
+    g_assert_cmpint (TEST_LIST_SUB_LIST_I_D_ID, ==, apteryx_schema_node_id (schema, apteryx_schema_lookup (schema, path)));
+
+    /* The first of any duplicate names or values wins (a later value is still mapped) */
+    g_assert_cmpstr (gen_translate_to (ENUMS_DUPLICATES_ID, "1"), ==, "on");
+    g_assert_cmpstr (gen_translate_from (ENUMS_DUPLICATES_ID, "on"), ==, "1");
+    g_assert_cmpstr (gen_translate_from (ENUMS_DUPLICATES_ID, "enabled"), ==, "1");
+    g_assert_cmpstr (gen_translate_to (ENUMS_DUPLICATES_ID, "2"), ==, "on");
+    apteryx_schema_free (schema);
+}
+
+/* Look up a key as the generated headers do (0 if not there) */
+static uint16_t
+phash_lookup (struct enum_phash *hash, const char *key)
+{
+    uint32_t h = enum_phash_hash (0, key);
+    return hash->slots[enum_phash_hash (hash->seeds[h & (hash->n_buckets - 1)], key) & (hash->size - 1)];
+}
+
+static void
+test_api_xml2c_hash (gpointer fixture, gconstpointer data)
+{
+    const char *keys[] = { "on", "enabled", NULL, "on", "off", NULL };
+    const char *none[] = { NULL, NULL };
+    GPtrArray *array = g_ptr_array_new ();
+    struct enum_phash hash;
+    int placed = 0;
+
+    /* Duplicates keep the first and NULL keys are left out */
+    for (int i = 0; i < G_N_ELEMENTS (keys); i++)
+        g_ptr_array_add (array, (gpointer) keys[i]);
+    hash = enum_phash_build (array);
+    for (uint32_t i = 0; i < hash.size; i++)
+    {
+        if (hash.slots[i])
+        {
+            g_assert_nonnull (keys[hash.slots[i] - 1]);
+            placed++;
+        }
+    }
+    g_assert_cmpint (placed, ==, 3);
+    g_assert_cmpint (phash_lookup (&hash, "on"), ==, 1);
+    g_assert_cmpint (phash_lookup (&hash, "enabled"), ==, 2);
+    g_assert_cmpint (phash_lookup (&hash, "off"), ==, 5);
+    enum_phash_free (&hash);
+    g_ptr_array_free (array, true);
+
+    /* Nothing to place */
+    array = g_ptr_array_new ();
+    for (int i = 0; i < G_N_ELEMENTS (none); i++)
+        g_ptr_array_add (array, (gpointer) none[i]);
+    hash = enum_phash_build (array);
+    for (uint32_t i = 0; i < hash.size; i++)
+        g_assert_cmpint (hash.slots[i], ==, 0);
+    enum_phash_free (&hash);
+    g_ptr_array_free (array, true);
+}
+
+static void
+test_api_lazy (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (8, 10);
+    apteryx_schema_instance *schema = apteryx_schema_load_lazy (folder);
+    apteryx_schema_instance *full = apteryx_schema_load (folder);
+    apteryx_schema_stats stats;
+    char *expected;
+    char *dump;
+
+    g_assert_nonnull (schema);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_files, ==, 8);
+    g_assert_cmpint (stats.load_parsed, ==, 0);
+
+    /* Only the files for the root are parsed (module-002 and module-007 merge into /module-2) */
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-2/child-7-0"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-2/child-2-0"));
+    g_assert_null (apteryx_schema_lookup (schema, "/module-9"));
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 2);
+    g_assert_cmpint (stats.lookups, ==, 3);
+
+    /* Everything is there once dumped */
+    expected = dump_schema (full);
+    dump = dump_schema (schema);
+    g_assert_cmpstr (dump, ==, expected);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 8);
+
+    free (dump);
+    free (expected);
+    apteryx_schema_free (full);
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_watch (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (256, 100);
+    char *filename = g_strdup_printf ("%s/module-100.xml", folder);
+    apteryx_schema_handle *handle = apteryx_schema_handle_new (NULL);
+    apteryx_schema_instance *schema;
+    uint64_t full, update;
+    FILE *fp;
+
+    full = get_time_us ();
+    schema = apteryx_schema_load (folder);
+    full = get_time_us () - full;
+    g_assert_nonnull (schema);
+    apteryx_schema_free (schema);
+    g_assert_true (apteryx_schema_watch (handle, folder, false));
+
+    fp = fopen (filename, "a");
+    g_assert_nonnull (fp);
+    fprintf (fp, "\n");
+    fclose (fp);
+    update = get_time_us ();
+    g_assert_true (apteryx_schema_update (handle));
+    update = get_time_us () - update;
+    printf ("full:%"PRIu64"us update:%"PRIu64"us ... ", full, update);
+
+    apteryx_schema_handle_free (handle);
+    g_free (filename);
+    schema_folder_free (folder);
+}
+
+/* Heap held after running a load (and lookups) while counting allocations */
+static ssize_t
+lazy_heap (const char *folder, int roots, apteryx_schema_instance **schema)
+{
+    ssize_t held = 0;
+
+#ifdef __GLIBC__
+    heap_bytes = heap_peak = 0;
+    count_allocations = true;
+#endif
+    *schema = roots < 0 ? apteryx_schema_load (folder) : apteryx_schema_load_lazy (folder);
+    for (int r = 0; r < MAX (roots, 1); r++)
+    {
+        char *path = g_strdup_printf ("/module-%d/child-%d-0", r, r);
+        g_assert_nonnull (apteryx_schema_lookup (*schema, path));
+        g_free (path);
+    }
+#ifdef __GLIBC__
+    count_allocations = false;
+    held = heap_bytes;
+#endif
+    return held;
+}
+
+static void
+test_api_perf_lazy (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (256, 100);
+    apteryx_schema_instance *schema;
+    const int used[] = { 1, 8, 32, 129 };
+    uint64_t full, lazy;
+
+    full = get_time_us ();
+    schema = apteryx_schema_load (folder);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-100/child-100-0"));
+    full = get_time_us () - full;
+    apteryx_schema_free (schema);
+
+    lazy = get_time_us ();
+    schema = apteryx_schema_load_lazy (folder);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-100/child-100-0"));
+    lazy = get_time_us () - lazy;
+    apteryx_schema_free (schema);
+    printf ("full:%"PRIu64"us lazy:%"PRIu64"us ", full, lazy);
+
+    /* Memory held grows with the roots used (129 roots in all) */
+    printf ("full:%zdKB", lazy_heap (folder, -1, &schema) / 1024);
+    apteryx_schema_free (schema);
+    for (size_t i = 0; i < G_N_ELEMENTS (used); i++)
+    {
+        printf (" %d:%zdKB", used[i], lazy_heap (folder, used[i], &schema) / 1024);
+        apteryx_schema_free (schema);
+    }
+    printf (" ... ");
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_node_flags (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (64, 200);
+    apteryx_schema_instance *schema = apteryx_schema_load (folder);
+    const uint32_t *flags = apteryx_schema_node_flags (schema);
+    uint32_t count = apteryx_schema_node_count (schema);
+    uint64_t walk, scan;
+    uint32_t nodes = 0;
+    uint32_t writable = 0;
+    int i;
+
+    /* Writable leaves by node and then from the flags */
+    walk = get_time_us ();
+    for (i = 0; i < 100; i++)
+    {
+        nodes = 0;
+        for (uint32_t id = 0; id < count; id++)
+        {
+            apteryx_schema_node *node = apteryx_schema_node_by_id (schema, id);
+            if (apteryx_schema_is_leaf (node) && apteryx_schema_is_writable (node))
+                nodes++;
+        }
+    }
+    walk = get_time_us () - walk;
+    scan = get_time_us ();
+    for (i = 0; i < 100; i++)
+    {
+        writable = 0;
+        for (uint32_t id = 0; id < count; id++)
+            writable += (flags[id] & (APTERYX_SCHEMA_FLAG_LEAF | APTERYX_SCHEMA_FLAG_WRITE)) ==
+                (APTERYX_SCHEMA_FLAG_LEAF | APTERYX_SCHEMA_FLAG_WRITE);
+    }
+    scan = get_time_us () - scan;
+    g_assert_cmpint (writable, ==, nodes);
+    g_assert_cmpint (writable, ==, 64 * 200);
+    printf ("%u nodes walk:%.3fus scan:%.3fus ... ", count, walk / 100.0, scan / 100.0);
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_load_parallel (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (64, 200);
+    apteryx_schema_instance *schema;
+    uint64_t serial, parallel;
+    char *expected;
+    char *dump;
+
+    apteryx_schema_load_threads = 1;
+    serial = get_time_us ();
+    schema = apteryx_schema_load (folder);
+    serial = get_time_us () - serial;
+    g_assert_nonnull (schema);
+    expected = dump_schema (schema);
+    apteryx_schema_free (schema);
+
+    apteryx_schema_load_threads = 0;
+    parallel = get_time_us ();
+    schema = apteryx_schema_load (folder);
+    parallel = get_time_us () - parallel;
+    g_assert_nonnull (schema);
+    dump = dump_schema (schema);
+    apteryx_schema_free (schema);
+
+    /* Merged in the same order */
+    g_assert_cmpstr (dump, ==, expected);
+    printf ("serial:%"PRIu64"us parallel:%"PRIu64"us (%.1fx) ... ", serial, parallel,
+            (double) serial / parallel);
+    free (dump);
+    free (expected);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_load_xml (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (1, 40000);
+    char *filename = g_strdup_printf ("%s/module-000.xml", folder);
+    struct schema_node *root;
+    uint64_t dom, stream;
+    ssize_t dom_peak = 0;
+    ssize_t stream_peak = 0;
+    struct stat st;
+    xmlDoc *doc;
+
+    g_assert_true (stat (filename, &st) == 0);
+    xml_schema_init ();
+
+    /* Building the DOM alone (the previous loader then walked it twice) */
+#ifdef __GLIBC__
+    heap_bytes = heap_peak = 0;
+    count_allocations = true;
+#endif
+    dom = get_time_us ();
+    doc = xmlReadFile (filename, NULL, 0);
+    g_assert_nonnull (doc);
+    xmlFreeDoc (doc);
+    dom = get_time_us () - dom;
+#ifdef __GLIBC__
+    count_allocations = false;
+    dom_peak = heap_peak;
+#endif
+
+    /* Streaming straight to schema nodes */
+#ifdef __GLIBC__
+    heap_bytes = heap_peak = 0;
+    count_allocations = true;
+#endif
+    stream = get_time_us ();
+    root = xml_schema_load (filename);
+    g_assert_nonnull (root);
+    node_destroy (root);
+    stream = get_time_us () - stream;
+#ifdef __GLIBC__
+    count_allocations = false;
+    stream_peak = heap_peak;
+    g_assert_cmpint (stream_peak, <, dom_peak);
+#endif
+
+    printf ("%"PRIu64"KB: dom:%"PRIu64"us/%zdKB stream:%"PRIu64"us/%zdKB ... ",
+            (uint64_t) st.st_size / 1024, dom, dom_peak / 1024, stream, stream_peak / 1024);
+    g_free (filename);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_dump (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_module_schemas (64, 200);
+    apteryx_schema_instance *schema;
+    ssize_t peak = 0;
+    uint64_t start;
+    long bytes;
+    FILE *fp;
+
+    schema = apteryx_schema_load (folder);
+    g_assert_nonnull (schema);
+    fp = tmpfile ();
+    g_assert_nonnull (fp);
+
+    /* Written straight to the file so the heap does not grow with the output */
+#ifdef __GLIBC__
+    heap_bytes = heap_peak = 0;
+    count_allocations = true;
+#endif
+    start = get_time_us ();
+    g_assert_true (apteryx_schema_dump_full (fp, schema, NULL, -1, true));
+    start = get_time_us () - start;
+#ifdef __GLIBC__
+    count_allocations = false;
+    peak = heap_peak;
+#endif
+    bytes = ftell (fp);
+    g_assert_cmpint (peak, <, bytes / 4);
+    printf ("%ldKB: %"PRIu64"us/%zdKB ... ", bytes / 1024, start, peak / 1024);
+    fclose (fp);
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+
+static char *
+generate_pattern_schema (void)
+{
+    char *folder = schema_folder_new ();
+
+    schema_folder_add (folder, "pattern.xml", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n<NODE name=\"pattern\">\n"
+                       "<NODE name=\"address\" mode=\"rw\" pattern=\"^(([0-9]|[1-9][0-9]|1[0-9]{2}|2[0-4][0-9]|25[0-5])\\.){3}"
+                       "([0-9]|[1-9][0-9]|1[0-9]{2}|2[0-4][0-9]|25[0-5])$\"/>\n"
+                       "<NODE name=\"broken\" mode=\"rw\" pattern=\"^(0|1$\"/>\n"
+                       "<NODE name=\"any\" mode=\"rw\"/>\n"
+                       "</NODE>\n</MODULE>\n");
+    return folder;
+}
+
+static void
+test_api_validate (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_pattern_schema ();
+    apteryx_schema_instance *schema = apteryx_schema_load (folder);
+    apteryx_schema_node *node;
+
+    g_assert_nonnull (schema);
+    node = apteryx_schema_lookup (schema, "/pattern/address");
+    g_assert_nonnull (node);
+    g_assert_true (apteryx_schema_validate (node, "192.168.1.1"));
+    g_assert_true (apteryx_schema_validate (node, "192.168.1.1"));
+    g_assert_false (apteryx_schema_validate (node, "192.168.1.256"));
+    g_assert_false (apteryx_schema_validate (node, "cat"));
+    g_assert_true (apteryx_schema_validate (node, NULL));
+    node = apteryx_schema_lookup (schema, "/pattern/any");
+    g_assert_true (apteryx_schema_validate (node, "cat"));
+    node = apteryx_schema_lookup (schema, "/pattern/broken");
+    g_assert_true (apteryx_schema_validate (node, "cat"));
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_validate (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_pattern_schema ();
+    apteryx_schema_instance *schema = apteryx_schema_load (folder);
+    apteryx_schema_node *node;
+    const char *pattern;
+    uint64_t start;
+    int i;
+
+    g_assert_nonnull (schema);
+    node = apteryx_schema_lookup (schema, "/pattern/address");
+    g_assert_nonnull (node);
+    pattern = NODE_STR (node, pattern);
+
+    /* Compiling the pattern for every value */
+    start = get_time_us ();
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        GRegex *regex = g_regex_new (pattern, 0, 0, NULL);
+        bool valid = g_regex_match (regex, "192.168.1.1", 0, NULL);
+        g_regex_unref (regex);
+        if (!valid)
+            break;
+    }
+    g_assert_cmpint (i, ==, TEST_ITERATIONS);
+    printf ("compile:%.0f/s ", TEST_ITERATIONS * 1000000.0 / (get_time_us () - start));
+
+    /* Using the pattern compiled on first use */
+    start = get_time_us ();
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        if (!apteryx_schema_validate (node, "192.168.1.1"))
+            break;
+    }
+    g_assert_cmpint (i, ==, TEST_ITERATIONS);
+    printf ("cached:%.0f/s ... ", TEST_ITERATIONS * 1000000.0 / (get_time_us () - start));
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+
+static void
+test_api_perf_lookup (gpointer fixture, gconstpointer data)
+{
+    int fanouts[] = { 10, 100, 1000, 10000 };
+    char *paths[TEST_ITERATIONS];
+    uint64_t start;
+    int i, f;
+
+    for (f = 0; f < G_N_ELEMENTS (fanouts); f++)
+    {
+        char *folder = generate_fanout_schema (fanouts[f]);
+        apteryx_schema_instance *schema = apteryx_schema_load (folder);
+        g_assert_nonnull (schema);
+        for (i = 0; i < TEST_ITERATIONS; i++)
+        {
+            paths[i] = g_strdup_printf ("/fanout/child_%d", (i * 7919) % fanouts[f]);
+        }
+        start = get_time_us ();
+        for (i = 0; i < TEST_ITERATIONS; i++)
+        {
+            if (!apteryx_schema_lookup (schema, paths[i]))
+                break;
+        }
+        printf ("%d:%.3fus ", fanouts[f], (double) (get_time_us () - start) / TEST_ITERATIONS);
+        g_assert_true (i == TEST_ITERATIONS);
+        for (i = 0; i < TEST_ITERATIONS; i++)
+        {
+            g_free (paths[i]);
+        }
+        apteryx_schema_free (schema);
+        schema_folder_free (folder);
+    }
+    printf ("... ");
+}
+
+static void
+test_api_perf_compile (gpointer fixture, gconstpointer data)
+{
+    apteryx_schema_instance *schema = apteryx_schema_load (TEST_SCHEMA_PATH);
+    apteryx_schema_path *compiled = apteryx_schema_compile (schema, "/test/list/*/sub-list/*/i-d");
+    char *paths[TEST_ITERATIONS];
+    apteryx_schema_key keys[2];
+    uint64_t lookup, match;
+    int i;
+
+    g_assert_nonnull (compiled);
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        paths[i] = g_strdup_printf ("/test/list/entry-%d/sub-list/item-%d/i-d", i % 100, i);
+    }
+    lookup = get_time_us ();
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        if (!apteryx_schema_lookup (schema, paths[i]))
+            break;
+    }
+    lookup = get_time_us () - lookup;
+    g_assert_true (i == TEST_ITERATIONS);
+    match = get_time_us ();
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        if (!apteryx_schema_match (compiled, paths[i], keys))
+            break;
+    }
+    match = get_time_us () - match;
+    g_assert_true (i == TEST_ITERATIONS);
+    printf ("lookup:%.3fus match:%.3fus ... ", (double) lookup / TEST_ITERATIONS,
+            (double) match / TEST_ITERATIONS);
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        g_free (paths[i]);
+    }
+    apteryx_schema_path_free (compiled);
+    apteryx_schema_free (schema);
+}
+
+struct lookup_thread
+{
+    apteryx_schema_handle *handle;
+    char **paths;
+    int found;
+};
+
+static gpointer
+lookup_thread (gpointer data)
+{
+    struct lookup_thread *thread = (struct lookup_thread *) data;
+    apteryx_schema_instance *schema = NULL;
+
+    for (int i = 0; i < TEST_ITERATIONS * 10; i++)
+    {
+        /* Move to the latest instance every so often */
+        if (i % 100 == 0)
+        {
+            if (schema)
+                apteryx_schema_free (schema);
+            schema = apteryx_schema_acquire (thread->handle);
+        }
+        if (apteryx_schema_lookup (schema, thread->paths[i % TEST_ITERATIONS]))
+            thread->found++;
+    }
+    apteryx_schema_free (schema);
+    return NULL;
+}
+
+static void
+test_api_perf_threads (gpointer fixture, gconstpointer data)
+{
+    int counts[] = { 1, 2, 4, 8 };
+    char *folder = generate_fanout_schema (1000);
+    apteryx_schema_handle *handle;
+    char *paths[TEST_ITERATIONS];
+    uint64_t start;
+    int i, c;
+
+    handle = apteryx_schema_handle_new (apteryx_schema_load (folder));
+    g_assert_nonnull (handle);
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        paths[i] = g_strdup_printf ("/fanout/child_%d", (i * 7919) % 1000);
+    }
+    for (c = 0; c < G_N_ELEMENTS (counts); c++)
+    {
+        struct lookup_thread threads[8] = {};
+        GThread *ids[8];
+
+        /* Lookups carry on while the schema is swapped underneath them */
+        start = get_time_us ();
+        for (i = 0; i < counts[c]; i++)
+        {
+            threads[i].handle = handle;
+            threads[i].paths = paths;
+            ids[i] = g_thread_new ("lookup", lookup_thread, &threads[i]);
+        }
+        g_assert_true (apteryx_schema_reload (handle, folder, NULL, false));
+        for (i = 0; i < counts[c]; i++)
+        {
+            g_thread_join (ids[i]);
+            g_assert_cmpint (threads[i].found, ==, TEST_ITERATIONS * 10);
+        }
+        printf ("%d:%.3fus ", counts[c], (double) (get_time_us () - start) / (counts[c] * TEST_ITERATIONS * 10));
+    }
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        g_free (paths[i]);
+    }
+    apteryx_schema_handle_free (handle);
+    schema_folder_free (folder);
+    printf ("... ");
+}
+#endif /* HAVE_LIBXML */
+
+#ifdef HAVE_LIBYANG
+static char *
+generate_yang_modules (int modules, int leaves)
+{
+    char *folder = schema_folder_new ();
+
+    schema_folder_add (folder, "common.yang", "module common { namespace \"urn:common\"; prefix common;"
+                       "typedef label { type string { length \"1..64\"; } }"
+                       "container common { leaf label { type label; } } }");
+    for (int m = 0; m < modules; m++)
+    {
+        GString *body = g_string_new (NULL);
+        char *name = g_strdup_printf ("module-%03d.yang", m);
+        if (m > 0)
+            g_string_append_printf (body, "import module-%03d { prefix p; }", m - 1);
+        g_string_append_printf (body, "container module-%03d {", m);
+        for (int i = 0; i < leaves; i++)
+        {
+            g_string_append_printf (body, "leaf leaf-%d { type common:label; }", i);
+        }
+        schema_folder_add (folder, name, "module module-%03d { namespace \"urn:module-%03d\"; prefix m%d;"
+                           "import common { prefix common; }%s} }", m, m, m, body->str);
+        g_string_free (body, true);
+        g_free (name);
+    }
+    return folder;
+}
+
+/* Modules convert as they did when each was parsed on its own - augments
+ * from other modules in the same load do not change their trees */
+static void
+test_api_yang_augment (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_yang_modules (2, 1);
+    char *filename = g_strdup_printf ("%s/augment.yang", folder);
+    apteryx_schema_instance *schema;
+    char *before = NULL;
+    char *after = NULL;
+    size_t size = 0;
+    FILE *fp;
+
+    schema = apteryx_schema_load (folder);
+    g_assert_nonnull (schema);
+    fp = open_memstream (&before, &size);
+    g_assert_true (apteryx_schema_dump_full (fp, schema, "/module-001", -1, false));
+    fclose (fp);
+    apteryx_schema_free (schema);
+
+    fp = fopen (filename, "w");
+    g_assert_nonnull (fp);
+    fprintf (fp, "module augment { namespace \"urn:augment\"; prefix aug;"
+             "import module-001 { prefix m; }"
+             "augment \"/m:module-001\" { leaf extra { type string; } }"
+             "container augment { leaf own { type string; } } }");
+    fclose (fp);
+    schema = apteryx_schema_load (folder);
+    g_assert_nonnull (schema);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/augment/own"));
+    g_assert_null (apteryx_schema_lookup (schema, "/module-001/extra"));
+    fp = open_memstream (&after, &size);
+    g_assert_true (apteryx_schema_dump_full (fp, schema, "/module-001", -1, false));
+    fclose (fp);
+    apteryx_schema_free (schema);
+    g_assert_cmpstr (after, ==, before);
+    free (before);
+    free (after);
+
+    unlink (filename);
+    g_free (filename);
+    schema_folder_free (folder);
+}
+
+/* YANG modules are only parsed when their root is first looked up */
+static void
+test_api_yang_lazy (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_yang_modules (3, 1);
+    apteryx_schema_instance *schema;
+    apteryx_schema_stats stats;
+
+    schema_folder_add (folder, "grouped.yang", "module grouped { namespace \"urn:grouped\"; prefix g;"
+                       "grouping top { container grouped { leaf name { type string; } } } uses top; }");
+    schema = apteryx_schema_load_lazy (folder);
+    g_assert_nonnull (schema);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_files, ==, 5);
+    g_assert_cmpint (stats.load_parsed, ==, 1);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/grouped/name"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-002/leaf-0"));
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 2);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/common/label"));
+    g_assert_null (apteryx_schema_lookup (schema, "/module-000/leaf-1"));
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 4);
+    apteryx_schema_free (schema);
+
+    /* A deviation may change any module so they are all parsed up front */
+    schema_folder_add (folder, "deviate.yang", "module deviate { namespace \"urn:deviate\"; prefix d;"
+                       "import module-000 { prefix m; }"
+                       "deviation /m:module-000/m:leaf-0 { deviate not-supported; }"
+                       "container deviate { leaf name { type string; } } }");
+    schema = apteryx_schema_load_lazy (folder);
+    g_assert_nonnull (schema);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 6);
+    g_assert_null (apteryx_schema_lookup (schema, "/module-000/leaf-0"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/deviate/name"));
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+
+#ifdef HAVE_LIBXML
+/* XML files for a root that a YANG module also provides are parsed with it */
+static void
+test_api_yang_lazy_merge (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_yang_modules (2, 1);
+    apteryx_schema_instance *schema;
+    apteryx_schema_stats stats;
+
+    schema_folder_add (folder, "extra.xml", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<MODULE>\n"
+                       "<NODE name=\"module-000\"><NODE name=\"extra\" mode=\"rw\"/></NODE>\n</MODULE>\n");
+    schema = apteryx_schema_load_lazy (folder);
+    g_assert_nonnull (schema);
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 0);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-000/extra"));
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-000/leaf-0"));
+    apteryx_schema_get_stats (schema, &stats);
+    g_assert_cmpint (stats.load_parsed, ==, 2);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-001/leaf-0"));
+    apteryx_schema_free (schema);
+    schema_folder_free (folder);
+}
+#endif
+
+static void
+test_api_perf_load_yang (gpointer fixture, gconstpointer data)
+{
+    char *folder = generate_yang_modules (60, 20);
+    apteryx_schema_instance *schema;
+    ssize_t peak = 0;
+    uint64_t start;
+
+#ifdef __GLIBC__
+    heap_bytes = heap_peak = 0;
+    count_allocations = true;
+#endif
+    start = get_time_us ();
+    schema = apteryx_schema_load (folder);
+    start = get_time_us () - start;
+#ifdef __GLIBC__
+    count_allocations = false;
+    peak = heap_peak;
+#endif
+    g_assert_nonnull (schema);
+    g_assert_cmpint (count_models (schema), ==, 61);
+    g_assert_nonnull (apteryx_schema_lookup (schema, "/module-059/leaf-19"));
+    apteryx_schema_free (schema);
+    printf ("%"PRIu64"us/%zdKB ... ", start, peak / 1024);
+    schema_folder_free (folder);
+}
+#endif /* HAVE_LIBYANG */
+
+#ifdef HAVE_LUA
+int luaopen_libapteryx_schema (lua_State *L);
+static bool
+_run_lua (char *script)
+{
+    char *buffer = strdup (script);
+    lua_State *L;
+    char *line;
+    int res = -1;
+
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    line = strtok (buffer, "\n");
+    while (line != NULL)
+    {
+        res = luaL_loadstring (L, line);
+        if (res == 0)
+            res = lua_pcall (L, 0, 0, 0);
+        if (res != 0)
+            fprintf (stderr, "%s\n", lua_tostring(L, -1));
+        g_assert_true (res == 0);
+        line = strtok (NULL,"\n");
+    }
+    lua_close (L);
+    free (buffer);
+    return res == 0;
+}
+
+void
+test_lua_api_parse (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua ("api = apteryx.api('"TEST_SCHEMA_PATH"')"));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_set_get (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.debug = 'enable'                                        \n"
+        "assert(api.test.debug == 'enable')                               \n"
+        "api.test.debug = nil                                             \n"
+        "assert(api.test.debug == 'disable')                              \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_reload (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "test = api.test                                                  \n"
+        "item = api.test.list('cat-nip')                                  \n"
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "test.debug = 'enable'                                            \n"
+        "assert(test.debug == 'enable')                                   \n"
+        "test.debug = nil                                                 \n"
+        "item.sub_list('dog').i_d = '1'                                   \n"
+        "assert(api.test.list('cat-nip').sub_list('dog').i_d == '1')      \n"
+        "item.sub_list('dog').i_d = nil                                   \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_get_tree (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.list('cat-nip').name = 'cat-nip'                        \n"
+        "api.test.list('cat-nip').type = 'little'                         \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = '1'               \n"
+        "entry = api.test.list('cat-nip'):get()                           \n"
+        "assert(entry.name == 'cat-nip')                                  \n"
+        "assert(entry.type == 'little')                                   \n"
+        "assert(entry['sub-list'].dog['i-d'] == '1')                      \n"
+        "test = api.test:get()                                            \n"
+        "assert(test.debug == 'disable')                                  \n"
+        "assert(test.list['cat-nip'].type == 'little')                    \n"
+        "assert(api.test.list('dog'):get().type == 'big')                 \n"
+        "api.test.list('cat-nip').name = nil                              \n"
+        "api.test.list('cat-nip').type = nil                              \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = nil               \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_method_keys (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.list('get').type = 'little'                             \n"
+        "api.test.list('keys').type = 'little'                            \n"
+        "assert(type(api.test.list.get) == 'function')                    \n"
+        "assert(type(api.test.list.keys) == 'function')                   \n"
+        "assert(api.test.list('get').type == 'little')                    \n"
+        "assert(api.test.list('keys').type == 'little')                   \n"
+        "assert(api.test.list:get().get.type == 'little')                 \n"
+        "api.test.list('get').type = nil                                  \n"
+        "api.test.list('keys').type = nil                                 \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_transaction (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "tx = apteryx.transaction()                                       \n"
+        "tx.test.debug = 'enable'                                         \n"
+        "tx.test.list('cat-nip').type = 'little'                          \n"
+        "tx.test.list('cat-nip').sub_list('dog').i_d = '1'                \n"
+        "assert(tx.test.debug == 'enable')                                \n"
+        "assert(tx.test.list('cat-nip'):get().type == 'little')           \n"
+        "assert(api.test.debug == 'disable')                              \n"
+        "assert(api.test.list('cat-nip').type == 'big')                   \n"
+        "assert(not pcall(function() tx.test.debug = 'cat' end))          \n"
+        "assert(tx:commit())                                              \n"
+        "assert(api.test.debug == 'enable')                               \n"
+        "assert(api.test.list('cat-nip').type == 'little')                \n"
+        "assert(api.test.list('cat-nip').sub_list('dog').i_d == '1')      \n"
+        "tx.test.debug = 'disable'                                        \n"
+        "tx:cancel()                                                      \n"
+        "assert(tx.test.debug == 'enable')                                \n"
+        "tx.test.debug = nil                                              \n"
+        "tx.test.list('cat-nip').type = nil                               \n"
+        "tx.test.list('cat-nip').sub_list('dog').i_d = nil                \n"
+        "assert(tx.test.list('cat-nip'):get()['sub-list'] == nil)         \n"
+        "assert(tx:commit())                                              \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_keys (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = '1'               \n"
+        "api.test.list('cat-nip').sub_list('cat').i_d = '2'               \n"
+        "api.test.list('cat-nip').sub_list('mouse').i_d = '3'             \n"
+        "keys = {}                                                        \n"
+        "for k in api.test.list('cat-nip').sub_list:keys() do keys[#keys + 1] = k end\n"
+        "assert(table.concat(keys, ',') == 'cat,dog,mouse')               \n"
+        "keys = {}                                                        \n"
+        "for k in api.test.list('cat-nip').sub_list:keys('cat', 1) do keys[#keys + 1] = k end\n"
+        "assert(table.concat(keys, ',') == 'dog')                         \n"
+        "assert(api.test.list('cat-nip').sub_list:keys('mouse')() == nil) \n"
+        "api.test.list('cat-nip').sub_list('eel').i_d = '4'               \n"
+        "assert(api.test.list('cat-nip').sub_list:keys('dog', 1)() == 'eel')\n"
+        "api.test.list('cat-nip').sub_list('eel').i_d = nil               \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = nil               \n"
+        "api.test.list('cat-nip').sub_list('cat').i_d = nil               \n"
+        "api.test.list('cat-nip').sub_list('mouse').i_d = nil             \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_cache (gpointer fixture, gconstpointer data)
+{
+    lua_State *L;
+    int i;
+
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    g_assert_true (luaL_dostring (L,
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test:cache()                                                 \n"
+        "assert(api.test.debug == 'disable')                              \n"
+        "hits = apteryx.cache_stats().hits                                \n"
+        "assert(api.test.debug == 'disable')                              \n"
+        "assert(apteryx.cache_stats().hits == hits + 1)                   \n"
+        "api.test.debug = 'enable'                                        \n"
+        "assert(api.test.debug == 'enable')                               \n"
+    ) == 0);
+
+    /* Changes made elsewhere arrive through the watch */
+    apteryx_set (TEST_APTERYX_PATH"/debug", "0");
+    for (i = 0; i < 100; i++)
+    {
+        g_assert_true (luaL_dostring (L, "return api.test.debug") == 0);
+        if (g_strcmp0 (lua_tostring (L, -1), "disable") == 0)
+            break;
+        lua_pop (L, 1);
+        usleep (10000);
+    }
+    g_assert_cmpint (i, <, 100);
+
+    /* Each node has its own bound and evicts the least recently used */
+    g_assert_true (luaL_dostring (L,
+        "api.test:cache(false)                                            \n"
+        "assert(apteryx.cache_stats().entries == 0)                       \n"
+        "api.test.list:cache()                                            \n"
+        "for _, k in ipairs({'a', 'b', 'c'}) do                           \n"
+        "  assert(api.test.list(k).name == nil)                           \n"
+        "end                                                              \n"
+        "stats = apteryx.cache_stats()                                    \n"
+        "assert(stats.entries == 3 and stats.misses == 3)                 \n"
+        "api.test.list:cache(math.floor(2 * stats.bytes / 3))             \n"
+        "assert(apteryx.cache_stats().entries == 2)                       \n"
+        "assert(api.test.list('b').name == nil)                           \n"
+        "assert(api.test.list('a').name == nil)                           \n"
+        "assert(api.test.list('b').name == nil)                           \n"
+        "stats = apteryx.cache_stats()                                    \n"
+        "assert(stats.hits == 2 and stats.misses == 4)                    \n"
+        "assert(api.test.list('c').name == nil)                           \n"
+        "assert(apteryx.cache_stats().misses == 5)                        \n"
+        "api.test.debug = nil                                             \n"
+    ) == 0);
+
+    /* Watches go with the state */
+    lua_close (L);
+    apteryx_set (TEST_APTERYX_PATH"/list/a/name", "a");
+    apteryx_set (TEST_APTERYX_PATH"/list/a/name", NULL);
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_stats (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "apteryx.reset_stats()                                            \n"
+        "assert(api.test.debug == 'disable')                              \n"
+        "stats = apteryx.stats()                                          \n"
+        "assert(stats.load_files > 0)                                     \n"
+        "assert(stats.lookups > 0 and stats.translations > 0)             \n"
+        "assert(#stats.lookup_ns == 32)                                   \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_lazy (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"', { lazy = true })         \n"
+        "parsed = apteryx.stats().load_parsed                             \n"
+        "assert(parsed < apteryx.stats().load_files)                      \n"
+        "api.test.debug = 'enable'                                        \n"
+        "assert(api.test.debug == 'enable')                               \n"
+        "api.test.debug = nil                                             \n"
+        "assert(apteryx.stats().load_parsed > parsed)                     \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_compile (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "i_d = api.compile('/test/list/*/sub-list/*/i-d')                 \n"
+        "assert(i_d:set('cat-nip', 'dog', '1'))                           \n"
+        "assert(i_d:get('cat-nip', 'dog') == '1')                         \n"
+        "assert(api.test.list('cat-nip').sub_list('dog').i_d == '1')      \n"
+        "list, sub = i_d:match('/test/list/cat-nip/sub-list/dog/i-d')     \n"
+        "assert(list == 'cat-nip' and sub == 'dog')                       \n"
+        "assert(i_d:match('/test/list/cat-nip/sub-list/dog') == nil)      \n"
+        "assert(not pcall(i_d.get, i_d, 'cat-nip', {}))                   \n"
+        "debug = api.compile('/test/debug')                               \n"
+        "assert(debug:get() == 'disable')                                 \n"
+        "assert(not pcall(debug.set, debug, 'bogus'))                     \n"
+        "assert(not pcall(api.compile, '/test/missing'))                  \n"
+        "i_d:set('cat-nip', 'dog', nil)                                   \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_list (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = '1'               \n"
+        "assert(api.test.list('cat-nip').sub_list('dog').i_d == '1')      \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = nil               \n"
+        "assert(api.test.list('cat-nip').sub_list('dog').i_d == nil)      \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_trivial_list (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.trivial_list('cat-nip', 'cat-nip')                      \n"
+        "assert(api.test.trivial_list('cat-nip') == 'cat-nip')            \n"
+        "api.test.trivial_list('cat-nip', nil)                            \n"
+        "assert(api.test.trivial_list('cat-nip') == nil)                  \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_search (gpointer fixture, gconstpointer data)
+{
+    g_assert_true (_run_lua (
+        "api = apteryx.api('"TEST_SCHEMA_PATH"')                          \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = '1'               \n"
+        "api.test.list('cat-nip').sub_list('cat').i_d = '2'               \n"
+        "api.test.list('cat-nip').sub_list('mouse').i_d = '3'             \n"
+        "api.test.list('cat_nip').sub_list('bat').i_d = '4'               \n"
+        "api.test.list('cat_nip').sub_list('frog').i_d = '5'              \n"
+        "api.test.list('cat_nip').sub_list('horse').i_d = '6'             \n"
+        "cats1 = api.test.list('cat-nip').sub_list()                      \n"
+        "assert(#cats1 == 3)                                              \n"
+        "cats2 = api.test.list('cat_nip').sub_list()                      \n"
+        "assert(#cats2 == 3)                                              \n"
+        "api.test.list('cat-nip').sub_list('dog').i_d = nil               \n"
+        "api.test.list('cat-nip').sub_list('cat').i_d = nil               \n"
+        "api.test.list('cat-nip').sub_list('mouse').i_d = nil             \n"
+        "api.test.list('cat_nip').sub_list('bat').i_d = nil               \n"
+        "api.test.list('cat_nip').sub_list('frog').i_d = nil              \n"
+        "api.test.list('cat_nip').sub_list('horse').i_d = nil             \n"
+    ));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_load_api_memory (gpointer fixture, gconstpointer data)
+{
+    lua_State *L;
+    unsigned long before;
+    unsigned long after;
+    int res = -1;
+
+    before = _memory_usage ();
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    res = luaL_loadstring (L, "apteryx.api('"TEST_SCHEMA_PATH"')");
+    if (res == 0)
+        res = lua_pcall (L, 0, 0, 0);
+    if (res != 0)
+        fprintf (stderr, "%s\n", lua_tostring(L, -1));
+    after = _memory_usage ();
+    lua_close (L);
+    printf ("%ldkb ... ", (after - before));
+    g_assert_true (res == 0);
+}
+
+void
+test_lua_load_api_performance (gpointer fixture, gconstpointer data)
+{
+    uint64_t start;
+    int i;
+
+    start = get_time_us ();
+    for (i = 0; i < 10; i++)
+    {
+        g_assert_true (_run_lua ("apteryx.api('"TEST_SCHEMA_PATH"')"));
+    }
+    printf ("%"PRIu64"us ... ", (get_time_us () - start) / 10);
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_perf_get (gpointer fixture, gconstpointer data)
+{
+    lua_State *L;
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        char *path = NULL;
+        g_assert_true (asprintf(&path, TEST_APTERYX_PATH"/list/%d/name", i) > 0);
+        apteryx_set (path, "private");
+        free (path);
+    }
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    g_assert_true (luaL_loadstring (L, "api = apteryx.api('"TEST_SCHEMA_PATH"')") == 0);
+    g_assert_true (lua_pcall (L, 0, 0, 0) == 0);
+    start = get_time_us ();
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
         char *cmd = NULL;
         int res;
         g_assert_true (asprintf(&cmd, "assert(api.test.list('%d').name == 'private')", i) > 0);
@@ -483,6 +2459,210 @@ exit:
     g_assert_true (assert_apteryx_empty ());
 }
 
+void
+test_lua_api_perf_get_cached (gpointer fixture, gconstpointer data)
+{
+    lua_State *L;
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        char *path = NULL;
+        g_assert_true (asprintf(&path, TEST_APTERYX_PATH"/list/%d/name", i) > 0);
+        apteryx_set (path, "private");
+        free (path);
+    }
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    g_assert_true (luaL_dostring (L, "api = apteryx.api('"TEST_SCHEMA_PATH"') api.test:cache()") == 0);
+
+    /* Read everything twice with the second read from the cache */
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        char *cmd = NULL;
+        g_assert_true (asprintf(&cmd, "assert(api.test.list('%d').name == 'private')", i) > 0);
+        g_assert_true (luaL_dostring (L, cmd) == 0);
+        free (cmd);
+    }
+    start = get_time_us ();
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        char *cmd = NULL;
+        g_assert_true (asprintf(&cmd, "assert(api.test.list('%d').name == 'private')", i) > 0);
+        g_assert_true (luaL_dostring (L, cmd) == 0);
+        free (cmd);
+    }
+    printf ("%"PRIu64"us ... ", (get_time_us () - start) / TEST_ITERATIONS);
+    g_assert_true (luaL_dostring (L, "return apteryx.cache_stats().hits") == 0);
+    g_assert_cmpint (lua_tointeger (L, -1), ==, TEST_ITERATIONS);
+    lua_close (L);
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        char *path = NULL;
+        g_assert_true (asprintf(&path, TEST_APTERYX_PATH"/list/%d/name", i) > 0);
+        g_assert_true (apteryx_set (path, NULL));
+        free (path);
+    }
+    g_assert_true (assert_apteryx_empty ());
+}
+
+#define TEST_LIST_ENTRIES   100000
+static double
+_run_lua_timed (lua_State *L, const char *script)
+{
+    uint64_t start = get_time_us ();
+    int res = luaL_loadstring (L, script);
+    if (res == 0)
+        res = lua_pcall (L, 0, 0, 0);
+    if (res != 0)
+    {
+        fprintf (stderr, "%s\n", lua_tostring (L, -1));
+        lua_pop (L, 1);
+        return -1;
+    }
+    return (get_time_us () - start) / 1000.0;
+}
+
+/* Nested list reads from a single chunk so that only the proxy tables are timed */
+void
+test_lua_api_perf_get_nested (gpointer fixture, gconstpointer data)
+{
+    lua_State *L;
+    double elapsed;
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS; i++)
+    {
+        char *path = g_strdup_printf (TEST_APTERYX_PATH"/list/%d/sub-list/dog/i-d", i);
+        apteryx_set (path, "1");
+        g_free (path);
+    }
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    g_assert_true (_run_lua_timed (L, "api = apteryx.api('"TEST_SCHEMA_PATH"')") >= 0);
+    lua_pushinteger (L, TEST_ITERATIONS);
+    lua_setglobal (L, "iterations");
+    elapsed = _run_lua_timed (L,
+        "for i = 0, iterations - 1 do                                     \n"
+        "  assert(api.test.list(tostring(i)).sub_list('dog').i_d == '1')  \n"
+        "end                                                              \n");
+    g_assert_true (elapsed >= 0);
+    printf ("%.3fus ... ", elapsed * 1000 / TEST_ITERATIONS);
+    lua_close (L);
+    g_assert_true (apteryx_prune (TEST_APTERYX_PATH));
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_reload_shared (gpointer fixture, gconstpointer data)
+{
+    lua_State *states[2];
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        states[i] = luaL_newstate ();
+        luaL_openlibs (states[i]);
+        luaopen_libapteryx_schema (states[i]);
+        lua_setglobal (states[i], "apteryx");
+    }
+
+    /* One state keeps its proxies while another loads a new schema */
+    g_assert_true (_run_lua_timed (states[0], "api = apteryx.api('"TEST_SCHEMA_PATH"') test = api.test") >= 0);
+    g_assert_true (_run_lua_timed (states[1], "api = apteryx.api('"TEST_SCHEMA_PATH"')") >= 0);
+    g_assert_true (_run_lua_timed (states[0], "test.debug = 'enable' assert(test.debug == 'enable')") >= 0);
+    g_assert_true (_run_lua_timed (states[1], "assert(api.test.debug == 'enable') api.test.debug = nil") >= 0);
+    lua_close (states[0]);
+    g_assert_true (_run_lua_timed (states[1], "assert(api.test.debug == 'disable')") >= 0);
+    lua_close (states[1]);
+    g_assert_true (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_perf_keys (gpointer fixture, gconstpointer data)
+{
+    GNode *root;
+    GNode *list;
+    lua_State *L;
+    double search, keys, paged;
+    ssize_t page_kb = 0;
+    int i;
+
+    root = APTERYX_NODE (NULL, strdup (TEST_APTERYX_PATH));
+    list = APTERYX_NODE (root, strdup ("list"));
+    for (i = 0; i < TEST_LIST_ENTRIES; i++)
+    {
+        char *key = g_strdup_printf ("%d", i);
+        APTERYX_LEAF (APTERYX_NODE (list, key), strdup ("name"), strdup (key));
+    }
+    g_assert_true (apteryx_set_tree (root));
+    apteryx_free_tree (root);
+
+    L = luaL_newstate ();
+    luaL_openlibs (L);
+    luaopen_libapteryx_schema (L);
+    lua_setglobal (L, "apteryx");
+    g_assert_true (_run_lua_timed (L, "api = apteryx.api('"TEST_SCHEMA_PATH"')") >= 0);
+    lua_pushinteger (L, TEST_LIST_ENTRIES);
+    lua_setglobal (L, "entries");
+
+    /* Whole search table versus lazy keys, tracking the Lua heap */
+    search = _run_lua_timed (L,
+        "collectgarbage() base = collectgarbage('count') n = 0            \n"
+        "list = api.test.list()                                           \n"
+        "search_kb = collectgarbage('count') - base                       \n"
+        "for _, key in ipairs(list) do n = n + 1 end                      \n"
+        "list = nil                                                       \n"
+        "assert(n == entries)                                             \n");
+    keys = _run_lua_timed (L,
+        "collectgarbage() base = collectgarbage('count') n = 0 peak = 0   \n"
+        "for key in api.test.list:keys() do                               \n"
+        "  n = n + 1                                                      \n"
+        "  if n % 1000 == 0 then                                          \n"
+        "    peak = math.max(peak, collectgarbage('count') - base)        \n"
+        "  end                                                            \n"
+        "end                                                              \n"
+        "keys_kb = peak                                                   \n"
+        "assert(n == entries)                                             \n");
+    paged = _run_lua_timed (L,
+        "n = 0 last = nil                                                 \n"
+        "repeat                                                           \n"
+        "  page = 0                                                       \n"
+        "  for key in api.test.list:keys(last, 10000) do                  \n"
+        "    last = key page = page + 1 n = n + 1                         \n"
+        "  end                                                            \n"
+        "until page == 0                                                  \n"
+        "assert(n == entries)                                             \n");
+    g_assert_true (search >= 0 && keys >= 0 && paged >= 0);
+
+    /* Heap held by an iterator over one page of 100 keys */
+#ifdef __GLIBC__
+    heap_bytes = heap_peak = 0;
+    count_allocations = true;
+#endif
+    g_assert_true (_run_lua_timed (L, "page = api.test.list:keys(nil, 100)") >= 0);
+#ifdef __GLIBC__
+    count_allocations = false;
+    page_kb = heap_bytes / 1024;
+#endif
+    g_assert_true (_run_lua_timed (L, "assert(page() == '0') page = nil collectgarbage()") >= 0);
+
+    lua_getglobal (L, "search_kb");
+    lua_getglobal (L, "keys_kb");
+    printf ("search:%.0fms/%.0fkb keys:%.0fms/%.0fkb paged:%.0fms page:%zdkb ... ",
+            search, lua_tonumber (L, -2), keys, lua_tonumber (L, -1), paged, page_kb);
+    lua_pop (L, 2);
+    lua_close (L);
+
+    g_assert_true (apteryx_prune (TEST_APTERYX_PATH));
+    g_assert_true (assert_apteryx_empty ());
+}
+
 void
 test_lua_api_perf_set (gpointer fixture, gconstpointer data)
 {
@@ -532,12 +2712,73 @@ add_tests (GTestSuite *suite, GTestFixtureFunc setup, GTestFixtureFunc teardown)
     g_test_suite_add_suite (suite, api);
     g_test_suite_add (api, g_test_create_case ("parse", 0, NULL, setup, test_api_parse, teardown));
     g_test_suite_add (api, g_test_create_case ("model", 0, NULL, setup, test_api_models, teardown));
+    g_test_suite_add (api, g_test_create_case ("lookup", 0, NULL, setup, test_api_lookup, teardown));
+    g_test_suite_add (api, g_test_create_case ("lookup_child", 0, NULL, setup, test_api_lookup_child, teardown));
+    g_test_suite_add (api, g_test_create_case ("compile", 0, NULL, setup, test_api_compile, teardown));
+    g_test_suite_add (api, g_test_create_case ("cache", 0, NULL, setup, test_api_cache, teardown));
+    g_test_suite_add (api, g_test_create_case ("load_cached", 0, NULL, setup, test_api_load_cached, teardown));
+    g_test_suite_add (api, g_test_create_case ("load_cached_corrupt", 0, NULL, setup, test_api_load_cached_corrupt, teardown));
+    g_test_suite_add (api, g_test_create_case ("dump", 0, NULL, setup, test_api_dump, teardown));
+    g_test_suite_add (api, g_test_create_case ("stats", 0, NULL, setup, test_api_stats, teardown));
+    g_test_suite_add (api, g_test_create_case ("reload", 0, NULL, setup, test_api_reload, teardown));
+    g_test_suite_add (api, g_test_create_case ("translate", 0, NULL, setup, test_api_translate, teardown));
+#ifdef HAVE_LIBXML
+    g_test_suite_add (api, g_test_create_case ("translate_sparse", 0, NULL, setup, test_api_translate_sparse, teardown));
+    g_test_suite_add (api, g_test_create_case ("validate", 0, NULL, setup, test_api_validate, teardown));
+    g_test_suite_add (api, g_test_create_case ("watch", 0, NULL, setup, test_api_watch, teardown));
+    g_test_suite_add (api, g_test_create_case ("watch_notify", 0, NULL, setup, test_api_watch_notify, teardown));
+    g_test_suite_add (api, g_test_create_case ("load_file", 0, NULL, setup, test_api_load_file, teardown));
+    g_test_suite_add (api, g_test_create_case ("lazy", 0, NULL, setup, test_api_lazy, teardown));
+    g_test_suite_add (api, g_test_create_case ("node_ids", 0, NULL, setup, test_api_node_ids, teardown));
+    g_test_suite_add (api, g_test_create_case ("node_ids_stable", 0, NULL, setup, test_api_node_ids_stable, teardown));
+    g_test_suite_add (api, g_test_create_case ("xml2c", 0, NULL, setup, test_api_xml2c, teardown));
+    g_test_suite_add (api, g_test_create_case ("xml2c_hash", 0, NULL, setup, test_api_xml2c_hash, teardown));
+#endif
+#ifdef HAVE_LIBYANG
+    g_test_suite_add (api, g_test_create_case ("yang_augment", 0, NULL, setup, test_api_yang_augment, teardown));
+    g_test_suite_add (api, g_test_create_case ("yang_lazy", 0, NULL, setup, test_api_yang_lazy, teardown));
+#ifdef HAVE_LIBXML
+    g_test_suite_add (api, g_test_create_case ("yang_lazy_merge", 0, NULL, setup, test_api_yang_lazy_merge, teardown));
+#endif
+#endif
+#ifdef __GLIBC__
+    g_test_suite_add (api, g_test_create_case ("lookup_alloc", 0, NULL, setup, test_api_lookup_allocations, teardown));
+#endif
+    GTestSuite *api_perf = g_test_create_suite ("perf");
+    g_test_suite_add_suite (api, api_perf);
+#ifdef HAVE_LIBXML
+    g_test_suite_add (api_perf, g_test_create_case ("lookup", 0, NULL, setup, test_api_perf_lookup, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("compile", 0, NULL, setup, test_api_perf_compile, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("load_parallel", 0, NULL, setup, test_api_perf_load_parallel, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("load_xml", 0, NULL, setup, test_api_perf_load_xml, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("validate", 0, NULL, setup, test_api_perf_validate, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("dump", 0, NULL, setup, test_api_perf_dump, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("threads", 0, NULL, setup, test_api_perf_threads, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("watch", 0, NULL, setup, test_api_perf_watch, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("lazy", 0, NULL, setup, test_api_perf_lazy, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("node_flags", 0, NULL, setup, test_api_perf_node_flags, teardown));
+#endif
+#ifdef HAVE_LIBYANG
+    g_test_suite_add (api_perf, g_test_create_case ("load_yang", 0, NULL, setup, test_api_perf_load_yang, teardown));
+#endif
+    g_test_suite_add (api_perf, g_test_create_case ("cache", 0, NULL, setup, test_api_perf_cache, teardown));
+    g_test_suite_add (api_perf, g_test_create_case ("load_cached", 0, NULL, setup, test_api_perf_load_cached, teardown));
 #ifdef HAVE_LUA
     GTestSuite *lua = g_test_create_suite ("lua");
     g_test_suite_add_suite (suite, lua);
     g_test_suite_add (lua, g_test_create_case ("parse", 0, NULL, setup, test_lua_api_parse, teardown));
     g_test_suite_add (lua, g_test_create_case ("setget", 0, NULL, setup, test_lua_api_set_get, teardown));
+    g_test_suite_add (lua, g_test_create_case ("reload", 0, NULL, setup, test_lua_api_reload, teardown));
+    g_test_suite_add (lua, g_test_create_case ("reload_shared", 0, NULL, setup, test_lua_api_reload_shared, teardown));
     g_test_suite_add (lua, g_test_create_case ("list", 0, NULL, setup, test_lua_api_list, teardown));
+    g_test_suite_add (lua, g_test_create_case ("get_tree", 0, NULL, setup, test_lua_api_get_tree, teardown));
+    g_test_suite_add (lua, g_test_create_case ("method_keys", 0, NULL, setup, test_lua_api_method_keys, teardown));
+    g_test_suite_add (lua, g_test_create_case ("transaction", 0, NULL, setup, test_lua_api_transaction, teardown));
+    g_test_suite_add (lua, g_test_create_case ("keys", 0, NULL, setup, test_lua_api_keys, teardown));
+    g_test_suite_add (lua, g_test_create_case ("cache", 0, NULL, setup, test_lua_api_cache, teardown));
+    g_test_suite_add (lua, g_test_create_case ("stats", 0, NULL, setup, test_lua_api_stats, teardown));
+    g_test_suite_add (lua, g_test_create_case ("lazy", 0, NULL, setup, test_lua_api_lazy, teardown));
+    g_test_suite_add (lua, g_test_create_case ("compile", 0, NULL, setup, test_lua_api_compile, teardown));
     g_test_suite_add (lua, g_test_create_case ("trivial_list", 0, NULL, setup, test_lua_api_trivial_list, teardown));
     g_test_suite_add (lua, g_test_create_case ("search", 0, NULL, setup, test_lua_api_search, teardown));
     g_test_suite_add (lua, g_test_create_case ("memory", 0, NULL, setup, test_lua_load_api_memory, teardown));
@@ -545,7 +2786,10 @@ add_tests (GTestSuite *suite, GTestFixtureFunc setup, GTestFixtureFunc teardown)
     g_test_suite_add_suite (lua, lua_perf);
     g_test_suite_add (lua_perf, g_test_create_case ("load", 0, NULL, setup, test_lua_load_api_performance, teardown));
     g_test_suite_add (lua_perf, g_test_create_case ("get", 0, NULL, setup, test_lua_api_perf_get, teardown));
+    g_test_suite_add (lua_perf, g_test_create_case ("get_nested", 0, NULL, setup, test_lua_api_perf_get_nested, teardown));
+    g_test_suite_add (lua_perf, g_test_create_case ("get_cached", 0, NULL, setup, test_lua_api_perf_get_cached, teardown));
     g_test_suite_add (lua_perf, g_test_create_case ("set", 0, NULL, setup, test_lua_api_perf_set, teardown));
+    g_test_suite_add (lua_perf, g_test_create_case ("keys", 0, NULL, setup, test_lua_api_perf_keys, teardown));
 #endif
 }
 
@@ -19,157 +19,269 @@
  */
 #include "internal.h"
 #include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 
-/* Convert an XML node to apteryx_schema_node */
-static struct apteryx_schema_node *
-xml_to_node (xmlNode *xml, int depth)
+/* Element currently open while streaming */
+struct xml_element
 {
-    struct apteryx_schema_node *node;
-    char *field;
+    /* Node being built (NULL if the element is being skipped) */
+    struct schema_node *node;
+    /* Whether an element child has been seen yet */
+    bool has_children;
+};
 
-    /* NULL */
-    if (!xml)
+/* Convert the current reader element to a schema_node */
+static struct schema_node *
+xml_to_node (xmlTextReader *reader, const char *element)
+{
+    struct schema_node *node;
+    char *name = NULL;
+    char *defvalue = NULL;
+    char *pattern = NULL;
+    char *value = NULL;
+    char *help = NULL;
+    char *mode = NULL;
+
+    /* Single pass over the attributes (first occurrence wins) */
+    while (xmlTextReaderMoveToNextAttribute (reader) == 1)
     {
-        ERROR ("XML: Node NULL\n");
-        return NULL;
+        const char *attr = (const char *) xmlTextReaderConstLocalName (reader);
+        const char *field = (const char *) xmlTextReaderConstValue (reader);
+
+        if (xmlTextReaderIsNamespaceDecl (reader) == 1 || !field)
+            continue;
+        if (!name && strcmp (attr, "name") == 0)
+            name = g_strdup (field);
+        else if (!defvalue && strcmp (attr, "default") == 0)
+            defvalue = g_strdup (field);
+        else if (!pattern && strcmp (attr, "pattern") == 0)
+            pattern = g_strdup (field);
+        else if (!value && strcmp (attr, "value") == 0)
+            value = g_strdup (field);
+        else if (!help && strcmp (attr, "help") == 0)
+            help = g_strdup (field);
+        else if (!mode && strcmp (attr, "mode") == 0)
+            mode = g_strdup (field);
     }
+    xmlTextReaderMoveToElement (reader);
 
     /* Create a new node */
-    field = (char *) xmlGetProp (xml, (xmlChar *) "name");
-    if (!field)
+    if (!name)
     {
         ERROR ("XML: Node has no name\n");
+        g_free (defvalue);
+        g_free (pattern);
+        g_free (value);
+        g_free (help);
+        g_free (mode);
         return NULL;
     }
-    node = node_create (field);
-    xmlFree (field);
-
-    /* Default */
-    field = (char *) xmlGetProp (xml, (xmlChar *) "default");
-    if (field)
-    {
-        node->defvalue = g_strdup (field);
-        xmlFree (field);
-    }
-
-    /* Pattern */
-    field = (char *) xmlGetProp (xml, (xmlChar *) "pattern");
-    if (field)
-    {
-        node->pattern = g_strdup (field);
-        xmlFree (field);
-    }
+    node = node_create (name);
+    g_free (name);
+    node->defvalue = defvalue;
+    node->pattern = pattern;
+    node->description = help;
 
     /* Mode */
-    field = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (field)
+    if (mode)
     {
-        if (strchr (field, 'r') != NULL)
+        if (strchr (mode, 'r') != NULL)
         {
             node->flags |= NODE_FLAGS_READ;
         }
-        if (strchr (field, 'w') != NULL)
+        if (strchr (mode, 'w') != NULL)
         {
             node->flags |= NODE_FLAGS_WRITE;
         }
         //TODO config
         //TODO hidden
-        xmlFree (field);
+        g_free (mode);
     }
 
     /* Handle ENUMs */
-    if (g_strcmp0 (xml->name, "VALUE") == 0)
+    if (value && strcmp (element, "VALUE") == 0)
     {
-        /* Value */
-        field = (char *) xmlGetProp (xml, (xmlChar *) "value");
-        if (field)
-        {
-            node->value = g_strdup (field);
-            node->flags |= NODE_FLAGS_ENUM;
-            xmlFree (field);
-        }
+        node->value = value;
+        node->flags |= NODE_FLAGS_ENUM;
     }
-
-    /* Description */
-    field = (char *) xmlGetProp (xml, (xmlChar *) "help");
-    if (field)
+    else
     {
-        node->description = g_strdup (field);
-        xmlFree (field);
+        g_free (value);
     }
 
-    /* Leaf */
-    if (!xml->children || g_strcmp0 (xml->children->name, "VALUE") == 0)
-    {
-        node->flags |= NODE_FLAGS_LEAF;
-    }
+    return node;
+}
+
+/* Finish an element that has no more children */
+static void
+xml_close (GArray *open)
+{
+    struct xml_element *top = &g_array_index (open, struct xml_element, open->len - 1);
 
-    /* Process children */
-    for (xmlNode *child = xml->children; child; child = child->next)
+    /* Leaf */
+    if (top->node && !top->has_children)
     {
-        struct apteryx_schema_node *cn = xml_to_node (child, depth + 1);
-        if (cn)
-            node->children = g_list_append (node->children, cn);
+        top->node->flags |= NODE_FLAGS_LEAF;
     }
+    g_array_set_size (open, open->len - 1);
+}
 
-    return node;
+/* Initialise libxml before parsing from multiple threads */
+void
+xml_schema_init (void)
+{
+    xmlInitParser ();
 }
 
-/* Remove unwanted nodes and attributes from a parsed tree */
-static void
-cleanup_nodes (xmlNode *node)
+/* Name of the root node of an XML schema without parsing the rest of it */
+char *
+xml_schema_root (const char *filename)
 {
-    xmlNode *n, *next;
+    xmlTextReader *reader;
+    char *name = NULL;
 
-    n = node;
-    while (n)
+    reader = xmlReaderForFile (filename, NULL, XML_PARSE_NOBLANKS);
+    if (!reader)
     {
-        next = n->next;
-        if (n->type == XML_ELEMENT_NODE)
-        {
-            cleanup_nodes (n->children);
-            xmlSetNs (n, NULL);
-        }
-        else
+        return NULL;
+    }
+    while (xmlTextReaderRead (reader) == 1)
+    {
+        const char *element = (const char *) xmlTextReaderConstLocalName (reader);
+        int depth = xmlTextReaderDepth (reader);
+        xmlChar *attr;
+
+        if (xmlTextReaderNodeType (reader) != XML_READER_TYPE_ELEMENT)
+            continue;
+        if (depth == 0 && g_strcmp0 (element, "MODULE") != 0)
+            break;
+        if (depth != 1)
+            continue;
+
+        /* The first named node in the module is the root */
+        attr = xmlTextReaderGetAttribute (reader, (const xmlChar *) "name");
+        if (attr)
         {
-            xmlUnlinkNode (n);
-            xmlFreeNode (n);
+            name = strdup ((const char *) attr);
+            xmlFree (attr);
+            break;
         }
-        n = next;
     }
+    xmlFreeTextReader (reader);
+    return name;
 }
 
-/* Load an Apteryx schema in XML format */
-struct apteryx_schema_node *
+/* Load an Apteryx schema in XML format.
+ * Nodes are built directly from reader events so only the currently open
+ * elements are held in memory rather than the whole document. */
+struct schema_node *
 xml_schema_load (const char *filename)
 {
-    struct apteryx_schema_node *schema;
-    xmlDoc *doc;
-    xmlNode *root;
+    struct schema_node *schema = NULL;
+    xmlTextReader *reader;
+    bool module = false;
+    bool done = false;
+    GArray *open;
+    int ret;
 
-    /* Parse document */
-    doc = xmlParseFile (filename);
-    if (!doc)
+    /* Open document */
+    reader = xmlReaderForFile (filename, NULL, XML_PARSE_NOBLANKS);
+    if (!reader)
     {
         ERROR ("XML: Invalid XML\n");
         return NULL;
     }
 
-    /* Find root node */
-    root = xmlDocGetRootElement (doc);
-    if (!root || g_strcmp0 (root->name, "MODULE") != 0)
+    open = g_array_new (FALSE, FALSE, sizeof (struct xml_element));
+    while ((ret = xmlTextReaderRead (reader)) == 1)
+    {
+        int type = xmlTextReaderNodeType (reader);
+        int depth = xmlTextReaderDepth (reader);
+
+        if (type == XML_READER_TYPE_END_ELEMENT)
+        {
+            /* Ignore the end of skipped elements */
+            if (depth > 0 && depth == open->len)
+            {
+                xml_close (open);
+                done = (open->len == 0);
+            }
+            continue;
+        }
+        if (type != XML_READER_TYPE_ELEMENT)
+        {
+            continue;
+        }
+
+        /* Find root node */
+        const char *element = (const char *) xmlTextReaderConstLocalName (reader);
+        if (depth == 0)
+        {
+            if (g_strcmp0 (element, "MODULE") != 0)
+            {
+                break;
+            }
+            module = true;
+            continue;
+        }
+
+        /* Only the first node in the module is used and nothing below a skipped node */
+        if (done || depth - 1 > open->len)
+        {
+            continue;
+        }
+
+        /* Leaf if there are no children or they are VALUEs */
+        struct xml_element elem = { NULL, false };
+        if (open->len)
+        {
+            struct xml_element *parent = &g_array_index (open, struct xml_element, open->len - 1);
+            if (!parent->has_children)
+            {
+                parent->has_children = true;
+                if (g_strcmp0 (element, "VALUE") == 0)
+                {
+                    parent->node->flags |= NODE_FLAGS_LEAF;
+                }
+            }
+        }
+
+        /* Convert to schema_node */
+        elem.node = xml_to_node (reader, element);
+        if (elem.node)
+        {
+            if (open->len)
+                node_add_child (g_array_index (open, struct xml_element, open->len - 1).node, elem.node);
+            else
+                schema = elem.node;
+            g_array_append_val (open, elem);
+            if (xmlTextReaderIsEmptyElement (reader) == 1)
+            {
+                xml_close (open);
+            }
+        }
+        done = (open->len == 0);
+    }
+    g_array_free (open, TRUE);
+    xmlFreeTextReader (reader);
+
+    if (ret < 0)
+    {
+        ERROR ("XML: Invalid XML\n");
+        if (schema)
+            node_destroy (schema);
+        return NULL;
+    }
+    if (!module)
     {
         ERROR ("XML: No root MODULE element\n");
-        xmlFreeDoc (doc);
+        if (schema)
+            node_destroy (schema);
         return NULL;
     }
-
-    /* Remove TEXT etc */
-    cleanup_nodes (root->children);
-
-    /* Convert to apteryx_schema_node */
-    schema = xml_to_node (root->children, 0);
-    xmlFreeDoc (doc);
+    if (!schema && !done)
+    {
+        ERROR ("XML: Node NULL\n");
+    }
     return schema;
 }
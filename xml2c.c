@@ -0,0 +1,435 @@
+/**
+ * @file xml2c.c
+ * Generate a C header of paths, node IDs and enum tables from a schema
+ *
+ * Copyright 2019, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "internal.h"
+#include <ctype.h>
+
+/* Options */
+static char *prefix = NULL;
+static char *output = NULL;
+static GOptionEntry options[] = {
+    { "prefix", 'p', 0, G_OPTION_ARG_STRING, &prefix, "Prefix of the generated types and tables (default from the first file)", "NAME" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the header to a file instead of stdout", "FILE" },
+    { NULL }
+};
+
+/* Node as generated (in ID order) */
+struct gen_node
+{
+    struct apteryx_schema_node *node;
+    int32_t id;
+    int32_t parent;
+    /* Path with '*' for each list key */
+    char *path;
+    /* Macro and function names (and the start of its children's) */
+    char *macro;
+    char *func;
+    const char *child_macro;
+    const char *child_func;
+    /* Names of the keys in the path */
+    GPtrArray *keys;
+};
+
+/* Write a string as a C literal (or NULL) */
+static void
+emit_string (FILE *fp, const char *str)
+{
+    if (!str)
+    {
+        fputs ("NULL", fp);
+        return;
+    }
+    fputc ('"', fp);
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf (fp, "\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7f)
+            fprintf (fp, "\\%03o", *c);
+        else if (*c == '?')
+            fputs ("\\?", fp);
+        else
+            fputc (*c, fp);
+    }
+    fputc ('"', fp);
+}
+
+/* Append a name as a C identifier */
+static void
+append_ident (GString *ident, const char *name, bool upper)
+{
+    if (ident->len)
+        g_string_append_c (ident, '_');
+    if (ident->len == 0 && isdigit ((unsigned char) *name))
+        g_string_append (ident, upper ? "N_" : "n_");
+    for (const char *c = name; *c; c++)
+    {
+        if (isalnum ((unsigned char) *c))
+            g_string_append_c (ident, upper ? toupper ((unsigned char) *c) : tolower ((unsigned char) *c));
+        else
+            g_string_append_c (ident, '_');
+    }
+}
+
+static void
+gen_node_free (struct gen_node *gen)
+{
+    free (gen->path);
+    free (gen->macro);
+    free (gen->func);
+    g_ptr_array_free (gen->keys, true);
+    free (gen);
+}
+
+/* Name a node (added in ID order so its parent is already named) */
+static void
+add_node (GPtrArray *nodes, GHashTable *names, struct apteryx_schema_node *node,
+          struct gen_node *parent)
+{
+    struct gen_node *gen = calloc (1, sizeof (struct gen_node));
+    const char *name = NODE_STR (node, name);
+    bool wildcard = strcmp (name, "*") == 0;
+    GString *macro = g_string_new (parent ? parent->child_macro : NULL);
+    GString *func = g_string_new (parent ? parent->child_func : NULL);
+
+    gen->node = node;
+    gen->id = nodes->len;
+    gen->parent = parent ? parent->id : -1;
+    gen->path = g_strdup_printf ("%s/%s", parent ? parent->path : "", name);
+    gen->keys = g_ptr_array_new_with_free_func (free);
+    if (parent)
+    {
+        for (guint i = 0; i < parent->keys->len; i++)
+            g_ptr_array_add (gen->keys, strdup (parent->keys->pdata[i]));
+    }
+    if (wildcard)
+    {
+        /* Keys are named for their list */
+        GString *key = g_string_new (NULL);
+        append_ident (key, parent ? NODE_STR (parent->node, name) : "list", false);
+        g_string_append (key, "_key");
+        for (guint i = 0; i < gen->keys->len; i++)
+        {
+            if (strcmp (gen->keys->pdata[i], key->str) == 0)
+            {
+                g_string_append_printf (key, "_%u", gen->keys->len);
+                break;
+            }
+        }
+        g_ptr_array_add (gen->keys, g_string_free (key, false));
+        append_ident (macro, "ENTRY", true);
+        append_ident (func, "entry", false);
+    }
+    else
+    {
+        append_ident (macro, name, true);
+        append_ident (func, name, false);
+    }
+    if (g_hash_table_contains (names, macro->str))
+    {
+        fprintf (stderr, "xml2c: \"%s\" is also used by another node - appending its ID\n", macro->str);
+        g_string_append_printf (macro, "_%d", gen->id);
+        g_string_append_printf (func, "_%d", gen->id);
+    }
+    gen->macro = g_string_free (macro, false);
+    gen->func = g_string_free (func, false);
+    g_hash_table_add (names, gen->macro);
+    g_ptr_array_add (nodes, gen);
+
+    /* Children of a list entry are named as if it were not there */
+    gen->child_macro = wildcard && parent ? parent->child_macro : gen->macro;
+    gen->child_func = wildcard && parent ? parent->child_func : gen->func;
+}
+
+/* Path macros, IDs and key helpers of a node */
+static void
+emit_paths (FILE *fp, struct gen_node *gen)
+{
+    fprintf (fp, "#define %s ", gen->macro);
+    emit_string (fp, gen->path);
+    fprintf (fp, "\n#define %s_ID %d\n", gen->macro, gen->id);
+    if (gen->keys->len)
+    {
+        GString *fmt = g_string_new (NULL);
+        const char *segment = gen->path;
+        const char *end;
+
+        /* Every '*' is a key */
+        while (*segment == '/')
+        {
+            segment++;
+            end = strchrnul (segment, '/');
+            g_string_append_c (fmt, '/');
+            if (end - segment == 1 && *segment == '*')
+                g_string_append (fmt, "%s");
+            else
+            {
+                for (const char *c = segment; c < end; c++)
+                {
+                    if (*c == '%')
+                        g_string_append_c (fmt, '%');
+                    g_string_append_c (fmt, *c);
+                }
+            }
+            segment = end;
+        }
+        fprintf (fp, "#define %s_FMT ", gen->macro);
+        emit_string (fp, fmt->str);
+        fprintf (fp, "\nstatic inline int\n%s_path (char *buf, size_t size", gen->func);
+        for (guint i = 0; i < gen->keys->len; i++)
+            fprintf (fp, ", const char *%s", (char *) gen->keys->pdata[i]);
+        fprintf (fp, ")\n{\n    return snprintf (buf, size, %s_FMT", gen->macro);
+        for (guint i = 0; i < gen->keys->len; i++)
+            fprintf (fp, ", %s", (char *) gen->keys->pdata[i]);
+        fprintf (fp, ");\n}\n");
+        g_string_free (fmt, true);
+    }
+}
+
+static void
+emit_table (FILE *fp, const char *name, int id, const char *kind, uint16_t *table, uint32_t size)
+{
+    fprintf (fp, "static const uint16_t %s_enum_%d_%s[%u] = {", name, id, kind, size);
+    for (uint32_t i = 0; i < size; i++)
+        fprintf (fp, "%s%u", i ? ", " : " ", table[i]);
+    fprintf (fp, " };\n");
+}
+
+/* Enum values of a leaf with a perfect hash of their names and values */
+static void
+emit_enums (FILE *fp, const char *name, struct gen_node *gen)
+{
+    struct apteryx_schema_node *node = gen->node;
+    GPtrArray *names = g_ptr_array_new ();
+    GPtrArray *values = g_ptr_array_new ();
+    struct enum_phash by_name;
+    struct enum_phash by_value;
+
+    fprintf (fp, "static const struct %s_enum %s_enum_%d[] = {\n", name, name, gen->id);
+    for (uint32_t i = 0; i < node->n_children; i++)
+    {
+        struct apteryx_schema_node *child = NODE_CHILD (node, i);
+        if (child->flags & NODE_FLAGS_ENUM)
+        {
+            fprintf (fp, "    { ");
+            emit_string (fp, NODE_STR (child, name));
+            fprintf (fp, ", ");
+            emit_string (fp, NODE_STR (child, value) ? : "");
+            fprintf (fp, " },\n");
+            g_ptr_array_add (names, (gpointer) NODE_STR (child, name));
+            g_ptr_array_add (values, (gpointer) NODE_STR (child, value));
+        }
+    }
+    fprintf (fp, "};\n");
+    by_name = enum_phash_build (names);
+    by_value = enum_phash_build (values);
+    emit_table (fp, name, gen->id, "name_seeds", by_name.seeds, by_name.n_buckets);
+    emit_table (fp, name, gen->id, "by_name", by_name.slots, by_name.size);
+    emit_table (fp, name, gen->id, "value_seeds", by_value.seeds, by_value.n_buckets);
+    emit_table (fp, name, gen->id, "by_value", by_value.slots, by_value.size);
+    fprintf (fp, "static const struct %1$s_enums %1$s_enums_%2$d = {\n"
+             "    %1$s_enum_%2$d,\n"
+             "    %1$s_enum_%2$d_name_seeds, %3$uu, %1$s_enum_%2$d_by_name, %4$uu,\n"
+             "    %1$s_enum_%2$d_value_seeds, %5$uu, %1$s_enum_%2$d_by_value, %6$uu\n};\n",
+             name, gen->id, by_name.n_buckets - 1, by_name.size - 1,
+             by_value.n_buckets - 1, by_value.size - 1);
+    enum_phash_free (&by_name);
+    enum_phash_free (&by_value);
+    g_ptr_array_free (names, true);
+    g_ptr_array_free (values, true);
+}
+
+static void
+emit_header (FILE *fp, const char *name, GPtrArray *nodes, const char *sources)
+{
+    char *upper = g_ascii_strup (name, -1);
+
+    fprintf (fp, "/* Generated by xml2c from %s - do not edit */\n", sources);
+    fprintf (fp, "#ifndef _%s_SCHEMA_H_\n#define _%s_SCHEMA_H_\n", upper, upper);
+    fprintf (fp, "#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n"
+             "#include <stdio.h>\n#include <string.h>\n\n");
+
+    /* Types and lookups shared by every node */
+    fprintf (fp, "#define %s_NODE_COUNT %u\n", upper, nodes->len);
+    fprintf (fp, "#define %s_FLAG_LEAF %d\n#define %s_FLAG_READ %d\n#define %s_FLAG_WRITE %d\n\n",
+             upper, APTERYX_SCHEMA_FLAG_LEAF, upper, APTERYX_SCHEMA_FLAG_READ, upper, APTERYX_SCHEMA_FLAG_WRITE);
+    fprintf (fp,
+             "struct %1$s_enum\n{\n    const char *name;\n    const char *value;\n};\n\n"
+             "/* Perfect hash tables - each string's bucket has the seed for its slot */\n"
+             "struct %1$s_enums\n{\n    const struct %1$s_enum *enums;\n"
+             "    const uint16_t *name_seeds;\n    uint32_t name_buckets;\n"
+             "    const uint16_t *by_name;\n    uint32_t name_mask;\n"
+             "    const uint16_t *value_seeds;\n    uint32_t value_buckets;\n"
+             "    const uint16_t *by_value;\n    uint32_t value_mask;\n};\n\n"
+             "struct %1$s_node\n{\n    const char *path;\n    int32_t parent;\n    uint32_t flags;\n"
+             "    const char *defvalue;\n    const char *pattern;\n"
+             "    const struct %1$s_enums *enums;\n};\n\n"
+             "static inline uint32_t\n%1$s_hash (uint32_t seed, const char *str)\n{\n"
+             "    uint32_t h = 2166136261u ^ seed;\n"
+             "    while (*str)\n    {\n        h ^= (uint8_t) *str++;\n        h *= 16777619u;\n    }\n"
+             "    h ^= h >> 16;\n    h *= 0x7feb352du;\n    h ^= h >> 15;\n    return h;\n}\n\n",
+             name);
+
+    /* Paths */
+    for (guint i = 0; i < nodes->len; i++)
+        emit_paths (fp, nodes->pdata[i]);
+    fprintf (fp, "\n");
+
+    /* Enums and the node table */
+    for (guint i = 0; i < nodes->len; i++)
+    {
+        struct gen_node *gen = nodes->pdata[i];
+        if (gen->node->enums)
+            emit_enums (fp, name, gen);
+    }
+    fprintf (fp, "\nstatic const struct %s_node %s_nodes[%s_NODE_COUNT] = {\n", name, name, upper);
+    for (guint i = 0; i < nodes->len; i++)
+    {
+        struct gen_node *gen = nodes->pdata[i];
+        fprintf (fp, "    { %s, %d, %u, ", gen->macro, gen->parent, gen->node->flags);
+        emit_string (fp, NODE_STR (gen->node, defvalue));
+        fprintf (fp, ", ");
+        emit_string (fp, NODE_STR (gen->node, pattern));
+        if (gen->node->enums)
+            fprintf (fp, ", &%s_enums_%d },\n", name, gen->id);
+        else
+            fprintf (fp, ", NULL },\n");
+    }
+    fprintf (fp, "};\n\n");
+
+    /* Translation and validation by node ID as done by the library */
+    fprintf (fp,
+             "static inline const struct %1$s_enum *\n"
+             "%1$s_enum_lookup (const struct %1$s_enums *enums, const char *str, bool by_value)\n{\n"
+             "    const struct %1$s_enum *e;\n    uint32_t h;\n    uint16_t slot;\n\n"
+             "    if (!enums || !str)\n        return NULL;\n"
+             "    h = %1$s_hash (0, str);\n"
+             "    if (by_value)\n"
+             "        slot = enums->by_value[%1$s_hash (enums->value_seeds[h & enums->value_buckets], str) &\n"
+             "                               enums->value_mask];\n"
+             "    else\n"
+             "        slot = enums->by_name[%1$s_hash (enums->name_seeds[h & enums->name_buckets], str) &\n"
+             "                              enums->name_mask];\n"
+             "    if (!slot)\n        return NULL;\n"
+             "    e = &enums->enums[slot - 1];\n"
+             "    return strcmp (by_value ? e->value : e->name, str) == 0 ? e : NULL;\n}\n\n"
+             "/* The enum name of a value (or the default if NULL) */\n"
+             "static inline const char *\n%1$s_translate_to (uint32_t id, const char *value)\n{\n"
+             "    const struct %1$s_enum *e;\n\n"
+             "    if (!value)\n        value = %1$s_nodes[id].defvalue;\n"
+             "    e = %1$s_enum_lookup (%1$s_nodes[id].enums, value, true);\n"
+             "    return e ? e->name : value;\n}\n\n"
+             "/* The value of an enum name */\n"
+             "static inline const char *\n%1$s_translate_from (uint32_t id, const char *name)\n{\n"
+             "    const struct %1$s_enum *e = %1$s_enum_lookup (%1$s_nodes[id].enums, name, false);\n"
+             "    return e ? e->value : name;\n}\n\n"
+             "/* Check a value is one of the enum values (patterns are left to the caller) */\n"
+             "static inline bool\n%1$s_enum_valid (uint32_t id, const char *value)\n{\n"
+             "    return !value || !%1$s_nodes[id].enums ||\n"
+             "        %1$s_enum_lookup (%1$s_nodes[id].enums, value, true) != NULL;\n}\n\n",
+             name);
+    fprintf (fp, "#endif /* _%s_SCHEMA_H_ */\n", upper);
+    g_free (upper);
+}
+
+/* Default prefix from the name of the first file or folder */
+static char *
+default_prefix (const char *path)
+{
+    char *base = g_path_get_basename (path);
+    GString *ident = g_string_new (NULL);
+    char *dot = strchr (base, '.');
+
+    if (dot && dot != base)
+        *dot = '\0';
+    append_ident (ident, base[0] && base[0] != '.' && base[0] != '/' ? base : "schema", false);
+    g_free (base);
+    return g_string_free (ident, false);
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    apteryx_schema_instance *schema;
+    const uint32_t *parents;
+    uint32_t count;
+    GPtrArray *nodes;
+    GHashTable *names;
+    char *folders;
+    char *name;
+    FILE *fp = stdout;
+
+    context = g_option_context_new ("<module>.xml|folder ... - generate a C header from a schema");
+    g_option_context_add_main_entries (context, options, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error) || argc < 2)
+    {
+        fprintf (stderr, "%s\n", error ? error->message : "No schema files given");
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    /* Every file or folder is loaded as one schema */
+    folders = g_strjoinv (":", argv + 1);
+    schema = apteryx_schema_load (folders);
+    if (!schema)
+    {
+        fprintf (stderr, "xml2c: failed to load \"%s\"\n", folders);
+        g_free (folders);
+        return 1;
+    }
+    name = prefix ? g_strdup (prefix) : default_prefix (argv[1]);
+
+    /* Nodes by the IDs the library gives them */
+    count = apteryx_schema_node_count (schema);
+    parents = apteryx_schema_node_parents (schema);
+    nodes = g_ptr_array_new_with_free_func ((GDestroyNotify) gen_node_free);
+    names = g_hash_table_new (g_str_hash, g_str_equal);
+    for (uint32_t id = 0; id < count; id++)
+    {
+        add_node (nodes, names, apteryx_schema_node_by_id (schema, id),
+                  parents[id] == APTERYX_SCHEMA_NO_ID ? NULL : nodes->pdata[parents[id]]);
+    }
+
+    if (nodes->len == 0)
+    {
+        fprintf (stderr, "xml2c: no nodes in \"%s\"\n", folders);
+        fp = NULL;
+    }
+    else if (output && !(fp = fopen (output, "w")))
+    {
+        fprintf (stderr, "xml2c: failed to open \"%s\"\n", output);
+    }
+    else
+    {
+        emit_header (fp, name, nodes, folders);
+        if (fp != stdout)
+            fclose (fp);
+    }
+
+    g_hash_table_destroy (names);
+    g_ptr_array_free (nodes, true);
+    apteryx_schema_free (schema);
+    g_free (folders);
+    g_free (name);
+    return fp ? 0 : 1;
+}
@@ -20,12 +20,12 @@
 #include "internal.h"
 #include <libyang/libyang.h>
 
-/* Convert an YANG node to apteryx_schema_node */
-static struct apteryx_schema_node *
+/* Convert an YANG node to schema_node */
+static struct schema_node *
 yang_to_node (const struct lys_node *yang, int depth)
 {
-    struct apteryx_schema_node *node;
-    struct apteryx_schema_node *rnode;
+    struct schema_node *node;
+    struct schema_node *rnode;
 
     /* NULL */
     if (!yang)
@@ -61,14 +61,14 @@ yang_to_node (const struct lys_node *yang, int depth)
                     for (int i = 0; i < leaf->type.info.enums.count; i++)
                     {
                         struct lys_type_enum *enm = &leaf->type.info.enums.enm[i];
-                        struct apteryx_schema_node *child = node_create (enm->name);
+                        struct schema_node *child = node_create (enm->name);
                         child->flags |= NODE_FLAGS_ENUM;
                         if (enm->dsc)
                         {
                             child->description = g_strdup (enm->dsc);
                         }
                         child->value = g_strdup_printf ("%d", (enm->value));
-                        node->children = g_list_append (node->children, child);
+                        node_add_child (node, child);
                     }
                     break;
                 }
@@ -120,45 +120,82 @@ yang_to_node (const struct lys_node *yang, int depth)
             if (yang->flags & LYS_CONFIG_R)
                 node->flags |= NODE_FLAGS_READ;
         }
-        rnode->children = g_list_append (rnode->children, node);
+        node_add_child (rnode, node);
         depth += 1;
     }
 
-    /* Process children */
+    /* Process children - skipping any augmented in by other modules in the
+     * shared context so that each module converts as if loaded on its own */
     for (struct lys_node *child = yang->child; child; child = child->next)
     {
-        struct apteryx_schema_node *cn = yang_to_node (child, depth + 1);
+        struct schema_node *cn;
+        if (lys_node_module (child) != lys_node_module (yang))
+            continue;
+        cn = yang_to_node (child, depth + 1);
         if (cn)
-            node->children = g_list_append (node->children, cn);
+            node_add_child (node, cn);
     }
 
     return rnode;
 }
 
-/* Load an Apteryx schema in XML format */
-struct apteryx_schema_node *
-yang_schema_load (const char *filename, char **name, char **organization, char **version)
+/* Create the context shared by all the modules in one load */
+struct ly_ctx *
+yang_schema_context (void)
 {
-    struct apteryx_schema_node *root = NULL;
-    struct ly_ctx *ctx;
-    const struct lys_module *mod;
-    const struct lys_node *node;
-
-    /* Create a new context to load this module with */
-    ctx = ly_ctx_new (NULL, 0);
+    struct ly_ctx *ctx = ly_ctx_new (NULL, 0);
     if (!ctx)
     {
         ERROR ("YANG: Failed to create context.\n");
-        return NULL;
     }
+    return ctx;
+}
+
+void
+yang_schema_context_free (struct ly_ctx *ctx)
+{
+    ly_ctx_destroy (ctx, NULL);
+}
+
+/* Parse a module into the shared context */
+const struct lys_module *
+yang_schema_parse (struct ly_ctx *ctx, const char *filename)
+{
+    const struct lys_module *mod;
+    char *dir = g_path_get_dirname (filename);
+    char *name = g_path_get_basename (filename);
+    char *ext;
+
+    /* Imports are searched for alongside the modules being loaded */
+    ly_ctx_set_searchdir (ctx, dir);
+    g_free (dir);
+
+    /* May already have been loaded as an import of an earlier module */
+    ext = strpbrk (name, "@.");
+    if (ext)
+        *ext = '\0';
+    mod = ly_ctx_get_module (ctx, name, NULL, 0);
+    g_free (name);
+    if (mod)
+    {
+        lys_set_implemented (mod);
+        return mod;
+    }
+
     /* Parse */
-    mod = lys_parse_path (ctx, (const char *) filename, LYS_IN_YANG);
+    mod = lys_parse_path (ctx, filename, LYS_IN_YANG);
     if (!mod)
     {
         ERROR ("YANG: Failed to parse file\n");
-        ly_ctx_destroy (ctx, NULL);
-        return NULL;
     }
+    return mod;
+}
+
+/* Convert a module parsed into the shared context */
+struct schema_node *
+yang_schema_load (const struct lys_module *mod, char **name, char **organization, char **version)
+{
+    const struct lys_node *node;
 
     /* Model attributes */
     *name = g_strdup (mod->name);
@@ -171,12 +208,144 @@ yang_schema_load (const char *filename, char **name, char **organization, char *
     if (!node || !node->name)
     {
         ERROR ("YANG: No root node\n");
-        ly_ctx_destroy (ctx, NULL);
         return NULL;
     }
 
-    /* Convert to apteryx_schema_node */
-    root = yang_to_node (node, 0);
-    ly_ctx_destroy (ctx, NULL);
-    return root;
+    /* Convert to schema_node */
+    return yang_to_node (node, 0);
+}
+
+/* Skip white space and comments in YANG text */
+static const char *
+yang_skip (const char *p)
+{
+    while (*p)
+    {
+        if (g_ascii_isspace (*p))
+            p++;
+        else if (p[0] == '/' && p[1] == '/')
+            p += strcspn (p, "\n");
+        else if (p[0] == '/' && p[1] == '*')
+            p = strstr (p + 2, "*/") ? strstr (p + 2, "*/") + 2 : p + strlen (p);
+        else
+            break;
+    }
+    return p;
+}
+
+/* Next token of YANG text - '{', '}', ';', a string or '\0' at the end.
+ * Quoted strings joined with '+' are returned as one string. */
+static char
+yang_token (const char **text, GString *string)
+{
+    const char *p = yang_skip (*text);
+    char token = 's';
+
+    g_string_truncate (string, 0);
+    if (*p == '\0' || *p == '{' || *p == '}' || *p == ';')
+    {
+        token = *p;
+        *text = *p ? p + 1 : p;
+        return token;
+    }
+    if (*p != '"' && *p != '\'')
+    {
+        size_t len = strcspn (p, " \t\r\n;{}");
+        g_string_append_len (string, p, len);
+        *text = p + len;
+        return token;
+    }
+    while (*p == '"' || *p == '\'')
+    {
+        char quote = *p++;
+        while (*p && *p != quote)
+        {
+            if (quote == '"' && *p == '\\' && p[1])
+                p++;
+            g_string_append_c (string, *p++);
+        }
+        if (*p)
+            p++;
+        *text = p;
+        p = yang_skip (p);
+        if (*p != '+')
+            break;
+        p = yang_skip (p + 1);
+    }
+    return token;
+}
+
+/* Name of the root node of a YANG module without parsing it. Returns NULL
+ * when only libyang can tell - for a submodule or a module that includes one
+ * or starts with a uses, choice, RPC or notification. Sets deviates if
+ * the module deviates nodes of other modules. */
+char *
+yang_schema_root (const char *filename, bool *deviates)
+{
+    static const char *data[] = { "container", "list", "leaf", "leaf-list", "anydata", "anyxml", NULL };
+    static const char *unknown[] = { "uses", "choice", "rpc", "action", "notification", NULL };
+    GString *keyword = g_string_new (NULL);
+    GString *argument = g_string_new (NULL);
+    GString *skip = g_string_new (NULL);
+    char *contents = NULL;
+    char *name = NULL;
+    bool known = true;
+    const char *p;
+    char token;
+
+    if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    {
+        goto exit;
+    }
+    p = contents;
+    if (yang_token (&p, keyword) != 's' || yang_token (&p, argument) != 's' || yang_token (&p, skip) != '{')
+    {
+        goto exit;
+    }
+    if (strcmp (keyword->str, "module") != 0)
+    {
+        known = false;
+    }
+
+    /* Every top level statement is read for deviations */
+    while (yang_token (&p, keyword) == 's')
+    {
+        token = yang_token (&p, argument);
+        if (token == 's')
+            token = yang_token (&p, skip);
+        if (token != ';' && token != '{')
+            break;
+
+        if (strcmp (keyword->str, "deviation") == 0)
+            *deviates = true;
+        else if (strcmp (keyword->str, "include") == 0)
+            known = false;
+        else if (!name && g_strv_contains (unknown, keyword->str))
+            known = false;
+        else if (!name && known && argument->len && g_strv_contains (data, keyword->str))
+            name = strdup (argument->str);
+
+        /* Skip the substatements */
+        for (int depth = token == '{' ? 1 : 0; depth > 0; )
+        {
+            token = yang_token (&p, skip);
+            if (token == '{')
+                depth++;
+            else if (token == '}')
+                depth--;
+            else if (token == '\0')
+                break;
+        }
+    }
+    if (!known)
+    {
+        free (name);
+        name = NULL;
+    }
+exit:
+    g_string_free (keyword, true);
+    g_string_free (argument, true);
+    g_string_free (skip, true);
+    g_free (contents);
+    return name;
 }